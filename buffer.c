@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <sys/mman.h>
+#include <fcntl.h>
 #include "buffer.h"
 #include "logging.h"
 #include "utils.h"
@@ -38,29 +39,122 @@ void buf_reset(buf_t* buf) {
   buf->sz = 0;
 }
 
-buf_t* mmbuf_new(int fd, size_t sz) {
+// map the window starting at off
+// return false if error occurs.
+static bool mmbuf_map(mmbuf_t* mmbuf, off_t off) {
 
-  buf_t* mmbuf = malloc(sizeof(buf_t));
-  mmbuf->sz = sz;
-  mmbuf->data = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
-  mmbuf->data_p = mmbuf->data;
+  size_t sz = min(MMBUF_WINSZ, mmbuf->sz - off);
+  void* win = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, mmbuf->fd, off);
 
-  if (mmbuf->data == MAP_FAILED) {
-    log_errln("[mmbuf_new] mmap failed on %d: %s",
-              fd, strerror(errno));
+  if (win == MAP_FAILED) {
+    log_errln("[mmbuf_map] mmap failed on %d at %lld: %s",
+              mmbuf->fd, (long long) off, strerror(errno));
     errno = 0;
-    free(mmbuf);
+    return false;
+  }
+
+  mmbuf->win = win;
+  mmbuf->win_off = off;
+  mmbuf->win_sz = sz;
+
+  // page in this window ahead of send, and the next one from disk
+  madvise(win, sz, MADV_SEQUENTIAL);
+  madvise(win, sz, MADV_WILLNEED);
+  if (off + sz < mmbuf->sz)
+    posix_fadvise(mmbuf->fd, off + sz, MMBUF_WINSZ, POSIX_FADV_WILLNEED);
+
+  return true;
+}
+
+mmbuf_t* mmbuf_new(int fd, off_t sz) {
+
+  mmbuf_t* mmbuf = malloc(sizeof(mmbuf_t));
+  mmbuf->fd = fd;
+  mmbuf->sz = sz;
+  mmbuf->pos = 0;
+  mmbuf->win = NULL;
+  mmbuf->win_off = 0;
+  mmbuf->win_sz = 0;
+  mmbuf->borrowed = false;
+
+  // nothing to map for empty file
+  if (sz == 0)
+    return mmbuf;
+
+  if (!mmbuf_map(mmbuf, 0)) {
+    mmbuf_free(mmbuf);
     return NULL;
   }
 
+  if (sz > MMBUF_WINSZ)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  return mmbuf;
+}
+
+mmbuf_t* mmbuf_wrap(void* data, size_t sz) {
+  mmbuf_t* mmbuf = malloc(sizeof(mmbuf_t));
+  mmbuf->fd = -1;
+  mmbuf->sz = sz;
+  mmbuf->pos = 0;
+  mmbuf->win = data;
+  mmbuf->win_off = 0;
+  mmbuf->win_sz = sz;
+  mmbuf->borrowed = true;
   return mmbuf;
 }
 
-void mmbuf_free(buf_t* mmbuf) {
+void mmbuf_free(mmbuf_t* mmbuf) {
 
   if (!mmbuf)
     return;
 
-  munmap(mmbuf->data, mmbuf->sz);
+  if (mmbuf->win && !mmbuf->borrowed)
+    munmap(mmbuf->win, mmbuf->win_sz);
+  if (mmbuf->fd >= 0)
+    close(mmbuf->fd);
   free(mmbuf);
 }
+
+void* mmbuf_peek(mmbuf_t* mmbuf, size_t want, size_t* n) {
+
+  off_t pos = mmbuf->pos;
+
+  if (pos < mmbuf->win_off || pos >= mmbuf->win_off + mmbuf->win_sz) {
+
+    // content in memory is entirely in window
+    if (mmbuf->fd < 0) {
+      log_errln("[mmbuf_peek] Position %lld out of range.", (long long) pos);
+      return NULL;
+    }
+
+    // drop the consumed window
+    if (mmbuf->win)
+      munmap(mmbuf->win, mmbuf->win_sz);
+    mmbuf->win = NULL;
+    mmbuf->win_sz = 0;
+
+    if (!mmbuf_map(mmbuf, pos & ~((off_t) MMBUF_WINSZ - 1)))
+      return NULL;
+  }
+
+  *n = min(want, mmbuf->win_off + mmbuf->win_sz - pos);
+  return mmbuf->win + (pos - mmbuf->win_off);
+}
+
+void mmbuf_prefault(mmbuf_t* mmbuf) {
+
+  if (mmbuf->pos >= mmbuf->sz)
+    return;
+
+  size_t n;
+  volatile char* data = mmbuf_peek(mmbuf, mmbuf->win_sz, &n);
+  if (!data)
+    return;
+
+  // touch a byte per page
+  long pgsz = sysconf(_SC_PAGESIZE);
+  size_t i;
+  for (i = 0; i < n; i += pgsz)
+    (void) data[i];
+}
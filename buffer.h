@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include "utils.h"
 
 // buf capacity
 #define BUFSZ 8192
@@ -36,9 +37,45 @@ ssize_t buf_rsize(buf_t* buf);
 // reset data_p
 void buf_reset();
 
-// constructor for memory-mapped buffer
-buf_t* mmbuf_new(int fd, size_t sz);
+// window of mmbuf; a multiple of page size
+#define MMBUF_WINSZ (4 << 20)
+
+// File mapped into memory, one window at a time, so that huge files
+// don't eat up address space, nor fault in all at once.
+typedef struct {
+  // the file, kept open for sendfile; -1 if content is in memory
+  int fd;
+  // size of the file
+  off_t sz;
+  // current position in file
+  off_t pos;
+  // mapped window, [win_off, win_off+win_sz) of the file
+  void* win;
+  off_t win_off;
+  size_t win_sz;
+  // window is memory of someone else, not to be unmapped
+  bool borrowed;
+} mmbuf_t;
+
+// constructor for memory-mapped buffer; it takes over fd.
+mmbuf_t* mmbuf_new(int fd, off_t sz);
+// constructor for content that is already in memory
+mmbuf_t* mmbuf_wrap(void* data, size_t sz);
 // destroy a mmbuf
-void mmbuf_free(buf_t* buf);
+void mmbuf_free(mmbuf_t* mmbuf);
+
+/**
+ * @brief Get data at current position, sliding the window if needed.
+ * @param mmbuf The mmbuf; pos must be within the file.
+ * @param want Number of bytes wanted.
+ * @param n Number of contiguous bytes available, up to want.
+ * @return Pointer to data at pos.
+ *         NULL if error occurs.
+ */
+void* mmbuf_peek(mmbuf_t* mmbuf, size_t want, size_t* n);
+
+// fault in the window from current position, so that sending it
+// doesn't block on disk.
+void mmbuf_prefault(mmbuf_t* mmbuf);
 
 #endif // BUFFER_H
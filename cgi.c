@@ -4,31 +4,74 @@
  * @author Longqi Cai <longqic@andrew.cmu.edu>
  */
 
+#define _GNU_SOURCE  // memmem, pipe2, splice
 #include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <time.h>
 #include <sys/select.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include "cgi.h"
 #include "logging.h"
 
 #define PREFIX "/cgi"
 #define ENVP_CNT 64
-#define ENVSZ 2048
+// room for envp of a request
+#define ARENASZ (32 << 10)
 #define ERRSZ 2048
 
+// CGI spawned and not reaped yet. It's left unreaped while its group
+// may still be signaled: till its run is over, or, once SIGTERM'd, till
+// its SIGKILL. Its zombie holds on to the group id meanwhile, so the id
+// can't be taken by another process.
+typedef struct child_s {
+  pid_t pid;
+  // its run isn't over yet
+  bool held;
+  // SIGKILL is due; 0 if it's not killed, -1 if it's sent.
+  long kill_at;
+  struct child_s* next;
+} child_t;
+
+static child_t* children = NULL;
+
+// CGI script and its replicas, balanced as one
+static lb_t* scripts = NULL;
+
+static long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 cgi_t* cgi_new() {
   cgi_t* cgi = malloc(sizeof(cgi_t));
+  cgi->pid = -1;
   cgi->srv_in = -1;
   cgi->srv_out = -1;
   cgi->cgi_in = -1;
   cgi->cgi_out = -1;
   cgi->srv_err = -1;
   cgi->cgi_err = -1;
+  fcgi_reset(&cgi->fcgi);
+  cgi->px.in = NULL;
+  px_reset(&cgi->px);
+  cgi->hdrs = hdr_new(NULL, NULL);
+  cgi->zs = NULL;
+  cgi->cap = NULL;
+  cq_reset(&cgi->q);
+  cgi->lb = NULL;
   cgi_reset(cgi);
   return cgi;
 }
 
 void cgi_free(cgi_t* cgi) {
   if (cgi) {
+    hdr_free(cgi->hdrs);
+    zs_free(cgi->zs);
+    mc_cap_free(cgi->cap);
     free(cgi);
   }
 }
@@ -41,32 +84,59 @@ void close_pipe(int* fd) {
 }
 
 void cgi_reset(cgi_t* cgi) {
+  // how it ended tells how the backend did
+  cgi_close_out(cgi);
   cgi->phase = CGI_IDLE;
+  cgi->first = 0;
 
+  cgi->fastcgi = false;
+  cgi->proxy = false;
   close_pipe(&cgi->srv_out);
-  close_pipe(&cgi->srv_in);
   close_pipe(&cgi->cgi_in);
   close_pipe(&cgi->cgi_out);
   close_pipe(&cgi->srv_err);
   close_pipe(&cgi->cgi_err);
 
   cgi->buf_phase = BUF_RECV;
-}
 
-static char* str_new(char* src, int sz) {
-  char* str = malloc(sz+1);
-  strncpy0(str, src, sz);
-  return str;
+  cgi->out_phase = OUT_RAW;
+  cgi->nph = true;
+  cgi->status = 0;
+  cgi->reason[0] = 0;
+  hdr_reset(cgi->hdrs);
+  zs_free(cgi->zs);
+  cgi->zs = NULL;
+  mc_cap_free(cgi->cap);
+  cgi->cap = NULL;
 }
 
-#define add_entry(fmt, arg1) {                 \
-  sz = snprintf(data, ENVSZ, fmt, arg1);       \
-  envp[cnt++] = str_new(data, sz);             \
-}
+// Environment of CGI is built in an arena, behind entries that are the
+// same for all requests, which are built only once. It lives until the
+// next request, since CGI has been spawned by then.
+static char* envp[ENVP_CNT];
+static int n_const = 0;
+static char arena[ARENASZ];
+static char* arena_p;
+
+// append an entry to envp, in the arena
+// return the number of entries.
+static int add_entry(int cnt, const char* fmt, ...) {
+
+  size_t cap = arena + ARENASZ - arena_p;
+  va_list args;
+  va_start(args, fmt);
+  int sz = vsnprintf(arena_p, cap, fmt, args);
+  va_end(args);
+
+  // too large for what's left; drop it.
+  if (sz < 0 || sz >= cap || cnt >= ENVP_CNT - 1) {
+    log_errln("[envp] no room for %s.", fmt);
+    return cnt;
+  }
 
-#define add_entry_kv(fmt, arg1, arg2) {        \
-  sz = snprintf(data, ENVSZ, fmt, arg1, arg2); \
-  envp[cnt++] = str_new(data, sz);             \
+  envp[cnt] = arena_p;
+  arena_p += sz + 1;
+  return cnt + 1;
 }
 
 static void convert_key(const char* from, char* to) {
@@ -83,47 +153,59 @@ static void convert_key(const char* from, char* to) {
   *to = 0;
 }
 
+// build entries that don't change across requests, at head of arena
+static void envp_const(const conf_t* conf) {
+  arena_p = arena;
+  int cnt = 0;
+  cnt = add_entry(cnt, "GATEWAY_INTERFACE=%s", "CGI/1.1");
+  cnt = add_entry(cnt, "SERVER_NAME=%s", VERSION);
+  cnt = add_entry(cnt, "SERVER_SOFTWARE=%s", VERSION);
+  cnt = add_entry(cnt, "SERVER_PROTOCOL=%s", "HTTP/1.1");
+  cnt = add_entry(cnt, "SCRIPT_NAME=%s", PREFIX);
+  n_const = cnt;
+}
+
 // NOT thread safe
-static char** envp_new(const req_t* req, const conf_t* conf) {
+static char** envp_new(const req_t* req, const conf_t* conf,
+                       const char* script) {
 
-  static char data[ENVSZ+1];
   static char key[HDR_KEYSZ+5];
-  char** envp = malloc(sizeof(char*) * ENVP_CNT);
-  int cnt = 0;
-  int sz;
+  static char* const_end = NULL;
 
-  add_entry("GATEWAY_INTERFACE=%s", "CGI/1.1");
-  add_entry("PATH_INFO=%s", req->uri+strlen(PREFIX));
-  add_entry("REQUEST_URI=%s", req->uri);
-  add_entry("REQUEST_METHOD=%s", req_method(req));
+  if (!const_end) {
+    envp_const(conf);
+    const_end = arena_p;
+  }
+  arena_p = const_end;
+  int cnt = n_const;
+
+  cnt = add_entry(cnt, "SCRIPT_FILENAME=%s", script);
+  cnt = add_entry(cnt, "PATH_INFO=%s", req->uri+strlen(PREFIX));
+  cnt = add_entry(cnt, "REQUEST_URI=%s", req->uri);
+  cnt = add_entry(cnt, "REQUEST_METHOD=%s", req_method(req));
 
   if (req->params)
-    add_entry("QUERY_STRING=%s", req->params);
+    cnt = add_entry(cnt, "QUERY_STRING=%s", req->params);
 
   if (req->clen > 0)
-    add_entry("CONTENT_LENGTH=%zd", req->clen);
+    cnt = add_entry(cnt, "CONTENT_LENGTH=%zd", req->clen);
 
-  add_entry("HTTP_CONNECTION=%s", req->alive ? "Keep-alive" : "Close");
-  add_entry("REMOTE_ADDR=%s", req->addr);
-  add_entry("SERVER_PORT=%d", req->port);
-  add_entry("SERVER_NAME=%s", VERSION);
-  add_entry("SERVER_SOFTWARE=%s", VERSION);
-  add_entry("SERVER_PROTOCOL=%s", "HTTP/1.1");
-  add_entry("HTTP_HOST=%s", req->host);
-  add_entry("SCRIPT_NAME=%s", PREFIX);
+  cnt = add_entry(cnt, "HTTP_CONNECTION=%s",
+                  req->alive ? "Keep-alive" : "Close");
+  cnt = add_entry(cnt, "REMOTE_ADDR=%s", req->addr);
+  cnt = add_entry(cnt, "SERVER_PORT=%d", req->port);
+  cnt = add_entry(cnt, "HTTP_HOST=%s", req->host);
 
   if (req->scheme == HTTPS)
-    add_entry("HTTPS=%s", "on");
+    cnt = add_entry(cnt, "HTTPS=%s", "on");
 
-  hdr_t* hdr = req->hdrs->next;
-  for (hdr = req->hdrs->next;
-       hdr && cnt < ENVP_CNT;
-       hdr = hdr->next) {
+  hdr_t* hdr;
+  for (hdr = req->hdrs->next; hdr; hdr = hdr->next) {
     if (!strcasecmp(hdr->key, "Content-Type")) {
-      add_entry("CONTENT_TYPE=%s", hdr->val);
+      cnt = add_entry(cnt, "CONTENT_TYPE=%s", hdr->val);
     } else {
       convert_key(hdr->key, key);
-      add_entry_kv("%s=%s", key, hdr->val);
+      cnt = add_entry(cnt, "%s=%s", key, hdr->val);
     }
   }
 
@@ -138,23 +220,135 @@ static char** envp_new(const req_t* req, const conf_t* conf) {
   return envp;
 }
 
-static void envp_free(char** envp) {
-  int i;
-  for (i = 0; envp[i]; i++)
-    free(envp[i]);
-  free(envp);
+// start a request on FastCGI backend
+static bool fcgi_init_req(cgi_t* cgi, const req_t* req, const conf_t* conf) {
+
+  if (!fcgi_begin(&cgi->fcgi, envp_new(req, conf, conf->cgi)))
+    return false;
+
+  cgi->fastcgi = true;
+  cgi->pid = -1;
+  cgi->srv_in = cgi->fcgi.fd;
+  cgi->started = cgi->active = now_ms();
+
+  // fd used up!
+  if (cgi->srv_in >= FD_SETSIZE)
+    return false;
+
+#if DEBUG >= 1
+  log_line("[CGI init] fastcgi request on %d.", cgi->srv_in);
+#endif
+
+  cgi->phase = CGI_SRV_TO_CGI;
+  return true;
+}
+
+// forward a request to upstream
+static bool px_init_req(cgi_t* cgi, const req_t* req, int route) {
+
+  cgi->proxy = true;
+  cgi->pid = -1;
+  cgi->lb = px_balancer(route);
+  cgi->be = lb_pick(cgi->lb);
+  if (!px_begin(&cgi->px, req, route, cgi->be))
+    return false;
+
+  cgi->srv_in = cgi->px.fd;
+  cgi->started = cgi->active = now_ms();
+
+  // fd used up!
+  if (cgi->srv_in >= FD_SETSIZE)
+    return false;
+
+#if DEBUG >= 1
+  log_line("[CGI init] proxied request on %d.", cgi->srv_in);
+#endif
+
+  cgi->phase = CGI_SRV_TO_CGI;
+  return true;
+}
+
+// spawn CGI with its ends of pipes as stdin, stdout and stderr
+// return true if success.
+static bool spawn(cgi_t* cgi, const req_t* req, const conf_t* conf) {
+
+  posix_spawn_file_actions_t acts;
+  posix_spawn_file_actions_init(&acts);
+  posix_spawn_file_actions_adddup2(&acts, cgi->cgi_in, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&acts, cgi->cgi_out, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&acts, cgi->cgi_err, STDERR_FILENO);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+  // don't hold sockets of lisod
+  posix_spawn_file_actions_addclosefrom_np(&acts, STDERR_FILENO + 1);
+#endif
+
+  // lisod ignores SIGPIPE, which CGI shouldn't inherit
+  posix_spawnattr_t attr;
+  sigset_t def;
+  posix_spawnattr_init(&attr);
+  sigemptyset(&def);
+  sigaddset(&def, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &def);
+  // in a group of its own, so that what it starts is killed along
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF|
+                                  POSIX_SPAWN_SETPGROUP);
+
+  // the least busy replica
+  if (!scripts) {
+    scripts = lb_new("cgi");
+    lb_add(scripts, conf->cgi);
+    int i;
+    for (i = 0; i < conf->n_cgi_replicas; i++)
+      lb_add(scripts, conf->cgi_replicas[i]);
+  }
+  cgi->lb = scripts;
+  cgi->be = lb_pick(scripts);
+  char* script = (char*) scripts->be[cgi->be].name;
+
+  char* argv[] = {script, NULL};
+  pid_t pid;
+  int rc = posix_spawn(&pid, script, &acts, &attr, argv,
+                       envp_new(req, conf, script));
+
+  posix_spawn_file_actions_destroy(&acts);
+  posix_spawnattr_destroy(&attr);
+
+  if (rc) {
+    log_errln("[CGI] cannot spawn %s: %s", script, strerror(rc));
+    return false;
+  }
+
+  child_t* c = malloc(sizeof(child_t));
+  c->pid = pid;
+  c->held = true;
+  c->kill_at = 0;
+  c->next = children;
+  children = c;
+
+  cgi->pid = pid;
+  cgi->started = cgi->active = now_ms();
+  return true;
 }
 
 bool cgi_init(cgi_t* cgi, const req_t* req, const conf_t* conf) {
 
+  int route = px_route(req->uri);
+  if (route >= 0)
+    return px_init_req(cgi, req, route);
+
+  if (conf->fastcgi)
+    return fcgi_init_req(cgi, req, conf);
+
+  // none of them goes to CGI as is; its ends are dup'd.
   int stdin_pipe[2];
   int stdout_pipe[2];
   int stderr_pipe[2];
-  if (pipe(stdin_pipe) < 0)
+  if (pipe2(stdin_pipe, O_CLOEXEC) < 0)
     return false;
-  if (pipe(stdout_pipe) < 0)
+  if (pipe2(stdout_pipe, O_CLOEXEC) < 0)
     return false;
-  if (pipe(stderr_pipe) < 0)
+  if (pipe2(stderr_pipe, O_CLOEXEC) < 0)
     return false;
 
   cgi->cgi_in = stdin_pipe[0];
@@ -166,8 +360,15 @@ bool cgi_init(cgi_t* cgi, const req_t* req, const conf_t* conf) {
   cgi->cgi_err = stderr_pipe[1];
   cgi->srv_err = stderr_pipe[0];
 
+  // larger pipes take more of body and output at a time
+  if (conf->cgi_pipe_size > 0) {
+    fcntl(cgi->srv_out, F_SETPIPE_SZ, conf->cgi_pipe_size);
+    fcntl(cgi->srv_in, F_SETPIPE_SZ, conf->cgi_pipe_size);
+  }
+
   // fd used up!
   if (cgi->srv_in >= FD_SETSIZE ||
+      cgi->srv_out >= FD_SETSIZE ||
       cgi->srv_err >= FD_SETSIZE)
     return false;
 
@@ -180,64 +381,28 @@ bool cgi_init(cgi_t* cgi, const req_t* req, const conf_t* conf) {
   log_line("[CGI init] srv_err is %d.", cgi->srv_err);
 #endif
 
-  cgi->pid = fork();
-  if (cgi->pid < 0)
-    return false;
-
-  /**** child ****/
-  if (cgi->pid == 0) {
-    char* argv[] = {conf->cgi, NULL};
-    char** envp = envp_new(req, conf);
+  bool ok = spawn(cgi, req, conf);
 
-    close_pipe(&cgi->srv_in);
-    close_pipe(&cgi->srv_out);
-    close_pipe(&cgi->srv_err);
-    dup2(cgi->cgi_in, STDIN_FILENO);
-    dup2(cgi->cgi_out, STDOUT_FILENO);
-    dup2(cgi->cgi_err, STDERR_FILENO);
-
-#if DEBUG >= 1
-    int cnt;
-    for (cnt = 0; envp[cnt]; cnt++);
-    log_line("[CGI] execve, file=%s, envp_cnt=%d",
-             conf->cgi, cnt);
-    log_flush();
-#endif
-
-    if (execve(conf->cgi, argv, envp) < 0) {
-      log_errln("[CGI] %s", strerror(errno));
-      log_flush();
-      envp_free(envp);
-      errno = 0;
-      close_pipe(&cgi->cgi_in);
-      close_pipe(&cgi->cgi_out);
-      close_pipe(&cgi->cgi_err);
-      exit(EXIT_FAILURE);
-    }
-
-    // execve doesn't return, so don't need to free envp.
-  }
-
-  /**** parent ****/
-  if (cgi->pid > 0) {
+  close_pipe(&cgi->cgi_in);
+  close_pipe(&cgi->cgi_out);
+  close_pipe(&cgi->cgi_err);
+  if (!ok)
+    return false;
 
 #if DEBUG >= 1
-    log_line("[CGI] forked cgi %d.", cgi->pid);
-    log_flush();
+  log_line("[CGI] spawned cgi %d.", cgi->pid);
 #endif
 
-    close_pipe(&cgi->cgi_in);
-    close_pipe(&cgi->cgi_out);
-    close_pipe(&cgi->cgi_err);
-    cgi->phase = CGI_SRV_TO_CGI;
+  cgi->phase = CGI_SRV_TO_CGI;
 
-    // set cgi pipe as non-blocking
-    int flag;
-    flag = fcntl(cgi->srv_in, F_GETFL, 0);
-    fcntl(cgi->srv_in, F_SETFL, flag|O_NONBLOCK);
-    flag = fcntl(cgi->srv_err, F_GETFL, 0);
-    fcntl(cgi->srv_err, F_SETFL, flag|O_NONBLOCK);
-  }
+  // set cgi pipe as non-blocking
+  int flag;
+  flag = fcntl(cgi->srv_in, F_GETFL, 0);
+  fcntl(cgi->srv_in, F_SETFL, flag|O_NONBLOCK);
+  flag = fcntl(cgi->srv_err, F_GETFL, 0);
+  fcntl(cgi->srv_err, F_SETFL, flag|O_NONBLOCK);
+  flag = fcntl(cgi->srv_out, F_GETFL, 0);
+  fcntl(cgi->srv_out, F_SETFL, flag|O_NONBLOCK);
 
   return true;
 }
@@ -252,3 +417,279 @@ void cgi_logerr(cgi_t* cgi) {
     log_raw(err, n);
   }
 }
+
+ssize_t cgi_write(cgi_t* cgi, const void* data, size_t n) {
+  if (cgi->fastcgi)
+    return n > 0 ? fcgi_write(&cgi->fcgi, data, n) : 0;
+  if (cgi->proxy)
+    return px_write(&cgi->px, data, n);
+
+  ssize_t sz = write(cgi->srv_out, data, n);
+  if (sz < 0 && (errno == EAGAIN || errno == EINTR))
+    return CGI_AGAIN;
+  return sz;
+}
+
+int cgi_close_in(cgi_t* cgi) {
+  if (cgi->fastcgi) {
+    ssize_t rc = fcgi_write(&cgi->fcgi, NULL, 0);
+    if (rc == FCGI_AGAIN)
+      return CGI_AGAIN;
+    if (rc < 0)
+      return -1;
+  } else if (cgi->proxy) {
+    ssize_t rc = px_write(&cgi->px, NULL, 0);
+    if (rc == PX_AGAIN)
+      return CGI_AGAIN;
+    if (rc < 0)
+      return -1;
+  } else {
+    close_pipe(&cgi->srv_out);
+  }
+  // output is awaited from now on
+  cgi->active = now_ms();
+  return 1;
+}
+
+int cgi_wfd(const cgi_t* cgi) {
+  if (cgi->fastcgi)
+    return cgi->fcgi.fd;
+  return cgi->proxy ? cgi->px.fd : cgi->srv_out;
+}
+
+ssize_t cgi_read(cgi_t* cgi, void* data, size_t n) {
+
+  ssize_t sz;
+  if (cgi->fastcgi) {
+    sz = fcgi_read(&cgi->fcgi, data, n);
+  } else if (cgi->proxy) {
+    sz = px_read(&cgi->px, data, n);
+  } else {
+    sz = read(cgi->srv_in, data, n);
+    if (sz < 0 && (errno == EAGAIN || errno == EINTR))
+      return CGI_AGAIN;
+  }
+
+  if (sz > 0) {
+    cgi->active = now_ms();
+    if (!cgi->first)
+      cgi->first = cgi->active;
+  }
+  return sz;
+}
+
+ssize_t cgi_splice(cgi_t* cgi, int fd, size_t n) {
+  ssize_t sz = splice(cgi->srv_in, NULL, fd, NULL, n,
+                      SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+  if (sz < 0 && (errno == EAGAIN || errno == EINTR))
+    return CGI_AGAIN;
+  if (sz > 0)
+    cgi->active = now_ms();
+  return sz;
+}
+
+bool cgi_pending(const cgi_t* cgi) {
+  return cgi->proxy && px_pending(&cgi->px);
+}
+
+// the run of CGI pid is over; it may be reaped.
+static void release(pid_t pid) {
+  child_t* c;
+  for (c = children; c; c = c->next)
+    if (c->pid == pid)
+      c->held = false;
+  // it may have exited already, with no SIGCHLD to come
+  cgi_reap();
+}
+
+void cgi_close_out(cgi_t* cgi) {
+  // the run is over; let the next one go.
+  cq_leave(&cgi->q);
+  if (cgi->pid > 0) {
+    release(cgi->pid);
+    cgi->pid = -1;
+  }
+
+  // it failed if it's aborted, or says so; client may leave before
+  // it's known.
+  if (cgi->lb) {
+    int outcome = LB_UNKNOWN;
+    if (cgi->phase == CGI_ABORT || cgi->status >= 500)
+      outcome = LB_FAIL;
+    else if (cgi->phase == CGI_DONE)
+      outcome = LB_OK;
+    lb_done(cgi->lb, cgi->be, outcome,
+            cgi->first ? cgi->first - cgi->started : -1);
+    cgi->lb = NULL;
+  }
+
+  if (cgi->fastcgi) {
+    fcgi_end(&cgi->fcgi);
+    cgi->srv_in = -1;
+  } else if (cgi->proxy) {
+    px_end(&cgi->px);
+    cgi->srv_in = -1;
+  } else {
+    close_pipe(&cgi->srv_in);
+  }
+}
+
+long cgi_due(cgi_t* cgi, const conf_t* conf) {
+
+  long now = now_ms();
+  long due = -1;
+
+  if (conf->cgi_timeout > 0)
+    due = max(cgi->started + conf->cgi_timeout - now, 0);
+
+  // output waits on client rather than on CGI
+  if (cgi->buf_phase == BUF_SEND)
+    cgi->active = now;
+
+  if (conf->cgi_idle_timeout > 0 && cgi->phase == CGI_CGI_TO_SRV) {
+    long idle = max(cgi->active + conf->cgi_idle_timeout - now, 0);
+    if (due < 0 || idle < due)
+      due = idle;
+  }
+
+  return due;
+}
+
+void cgi_kill(cgi_t* cgi, const conf_t* conf) {
+
+  // FastCGI backend lives on; its conn is just closed.
+  if (cgi->fastcgi || cgi->pid <= 0)
+    return;
+
+  log_errln("[cgi_kill] cgi %d timed out.", cgi->pid);
+
+  // still held, so the group is its own, even if it has exited.
+  child_t* c;
+  for (c = children; c && c->pid != cgi->pid; c = c->next);
+  if (c) {
+    kill(-cgi->pid, SIGTERM);
+    c->held = false;
+    c->kill_at = now_ms() + conf->cgi_kill_grace;
+  }
+
+  cgi->pid = -1;
+}
+
+void cgi_reap() {
+  child_t** pp = &children;
+  while (*pp) {
+    child_t* c = *pp;
+    int status;
+    if (!c->held && c->kill_at <= 0 &&
+        waitpid(c->pid, &status, WNOHANG) != 0) {
+      *pp = c->next;
+      free(c);
+    } else {
+      pp = &c->next;
+    }
+  }
+}
+
+long cgi_kill_pump() {
+
+  long now = now_ms();
+  long next = -1;
+
+  child_t* c;
+  for (c = children; c; c = c->next) {
+    if (c->kill_at <= 0)
+      continue;
+    if (c->kill_at <= now) {
+      // the group is still there, led by the process or its zombie
+      kill(-c->pid, SIGKILL);
+      c->kill_at = -1;
+    } else if (next < 0 || c->kill_at - now < next) {
+      next = c->kill_at - now;
+    }
+  }
+
+  // those SIGKILL'd may be zombies already
+  cgi_reap();
+  return next;
+}
+
+// parse status like "404 Not Found" from p to eol
+// return true if success.
+static bool parse_status(cgi_t* cgi, const char* p, const char* eol) {
+  if (eol - p < 3)
+    return false;
+  cgi->status = atoi(p);
+  if (cgi->status < 100 || cgi->status > 999)
+    return false;
+  p += 3;
+  while (p < eol && *p == ' ')
+    p++;
+  strncpy0(cgi->reason, p, min(CGI_REASONSZ, eol - p));
+  return true;
+}
+
+ssize_t cgi_parse_hdr(cgi_t* cgi, const char* data, size_t sz) {
+
+  const char* end = memmem(data, sz, CRLF CRLF, 4);
+  if (!end)
+    return 0;
+
+  hdr_reset(cgi->hdrs);
+
+  /* status line, e.g. HTTP/1.1 200 OK */
+  const char* p = data;
+  const char* eol = memmem(p, end + 2 - p, CRLF, 2);
+  cgi->nph = !strncmp(p, "HTTP/", 5);
+  if (cgi->nph) {
+    p = memchr(p, ' ', eol - p);
+    if (!p || !parse_status(cgi, p+1, eol))
+      return -1;
+    p = eol + 2;
+  }
+
+  /* header lines */
+  char key[HDR_KEYSZ+1];
+  char val[HDR_VALSZ+1];
+  for (; p < end + 2; p = eol + 2) {
+    eol = memmem(p, end + 2 - p, CRLF, 2);
+    const char* colon = memchr(p, ':', eol - p);
+    if (!colon || colon == p)
+      return -1;
+    strncpy0(key, p, min(HDR_KEYSZ, colon - p));
+    strncpy0(val, colon + 1, min(HDR_VALSZ, eol - colon - 1));
+    strstrip(key);
+    strstrip(val);
+    hdr_append(cgi->hdrs, hdr_new(key, val));
+  }
+
+  /* CGI header has status in a field, defaulting to 200 or 302 */
+  if (!cgi->nph) {
+    hdr_t* status = hdr_get(cgi->hdrs, "Status");
+    if (status) {
+      if (!parse_status(cgi, status->val, status->val + strlen(status->val)))
+        return -1;
+      hdr_del(cgi->hdrs, "Status");
+    } else if (hdr_get(cgi->hdrs, "Location")) {
+      cgi->status = 302;
+      strcpy(cgi->reason, "Found");
+    } else {
+      cgi->status = 200;
+      strcpy(cgi->reason, "OK");
+    }
+  }
+
+  return end + 4 - data;
+}
+
+ssize_t cgi_pack_hdr(const cgi_t* cgi, char* hdr) {
+
+  char* hdr_p = hdr;
+  hdr_p += sprintf(hdr_p, "HTTP/1.1 %d %s" CRLF, cgi->status, cgi->reason);
+
+  hdr_t* h;
+  for (h = cgi->hdrs->next; h; h = h->next)
+    hdr_p += sprintf(hdr_p, "%s: %s" CRLF, h->key, h->val);
+
+  hdr_p += sprintf(hdr_p, CRLF);
+  return hdr_p - hdr;
+}
@@ -9,7 +9,18 @@
 
 #include "request.h"
 #include "buffer.h"
+#include "header.h"
+#include "compress.h"
 #include "config.h"
+#include "fcgi.h"
+#include "proxy.h"
+#include "mcache.h"
+#include "cgiq.h"
+#include "lb.h"
+
+#define CGI_REASONSZ 64
+// returned by cgi_read if nothing is readable yet
+#define CGI_AGAIN FCGI_AGAIN
 
 typedef struct {
   enum {
@@ -22,14 +33,57 @@ typedef struct {
     CGI_DISABLED,
   } phase;
 
+  // pid of CGI, which leads its own process group
   int pid;
+  // when it started, first gave output, and last did, in ms
+  long started;
+  long first;
+  long active;
   int srv_out, srv_in, srv_err;
   int cgi_in, cgi_out, cgi_err;
 
+  // request to FastCGI backend; srv_in is its socket, and there is
+  // neither process nor pipes.
+  bool fastcgi;
+  fcgi_t fcgi;
+
+  // request forwarded to upstream HTTP server; srv_in is its socket.
+  bool proxy;
+  px_t px;
+
   enum {
     BUF_RECV=1,
     BUF_SEND,
   } buf_phase;
+
+  // How output of CGI is relayed to client.
+  // Header is only parsed if output may be rewritten.
+  enum {
+    OUT_RAW=1,   // relay as is
+    OUT_HEADER,  // collecting header
+    OUT_GZIP,    // body is gzip'd in chunks
+    OUT_CHUNKED, // body is framed in chunks as is
+  } out_phase;
+
+  // parsed response header
+  // nph is false if it came as CGI header, which has to be rewritten.
+  bool nph;
+  int status;
+  char reason[CGI_REASONSZ+1];
+  hdr_t* hdrs;
+
+  // compressor for OUT_GZIP
+  zs_t* zs;
+
+  // output being captured for the micro-cache; NULL if not.
+  mc_cap_t* cap;
+
+  // ticket for a slot to run
+  cq_ent_t q;
+
+  // backend it runs on, among CGI replicas or upstreams; NULL if none.
+  lb_t* lb;
+  int be;
 } cgi_t;
 
 cgi_t* cgi_new();
@@ -39,4 +93,107 @@ bool cgi_init(cgi_t* cgi, const req_t* req, const conf_t* conf);
 void cgi_logerr(cgi_t* cgi);
 void close_pipe(int* fd);
 
+/**
+ * @brief Send request body to CGI without blocking.
+ * @param cgi The CGI.
+ * @param data The body.
+ * @param n Size of data.
+ * @return Bytes sent.
+ *         CGI_AGAIN if the pipe is full.
+ *        -1 if error occurs.
+ */
+ssize_t cgi_write(cgi_t* cgi, const void* data, size_t n);
+
+/**
+ * @brief Tell CGI there is no more request body.
+ * @param cgi The CGI.
+ * @return 1 if done.
+ *         CGI_AGAIN if it has to be tried again once writable.
+ *        -1 if error occurs.
+ */
+int cgi_close_in(cgi_t* cgi);
+
+// fd taking request body, to be selected for writability
+int cgi_wfd(const cgi_t* cgi);
+
+/**
+ * @brief Receive output of CGI.
+ * @param cgi The CGI.
+ * @param data Buffer for output.
+ * @param n Capacity of data.
+ * @return Bytes received.
+ *         0 if output is over.
+ *         CGI_AGAIN if nothing is readable yet.
+ *        -1 if error occurs.
+ */
+ssize_t cgi_read(cgi_t* cgi, void* data, size_t n);
+
+/**
+ * @brief Move output of CGI straight to a socket by splice.
+ * @param cgi The CGI; only a forked one has a pipe to splice from.
+ * @param fd The socket.
+ * @param n Max bytes to move.
+ * @return Bytes moved.
+ *         0 if output is over.
+ *         CGI_AGAIN if pipe is empty, or socket is full.
+ *        -1 if error occurs.
+ *
+ * Bytes not taken by the socket stay in the pipe.
+ */
+ssize_t cgi_splice(cgi_t* cgi, int fd, size_t n);
+// check if output can be read though srv_in may not be readable
+bool cgi_pending(const cgi_t* cgi);
+
+// done with output; FastCGI conn is kept alive if the request ended.
+// how it went counts for the backend.
+void cgi_close_out(cgi_t* cgi);
+
+/**
+ * @brief Check how long a running CGI has before it times out.
+ * @param cgi The CGI.
+ * @param conf Configurations.
+ * @return ms left; 0 if it has timed out.
+ *        -1 if there is no timeout.
+ *
+ * Output waiting on a slow client doesn't count as idle.
+ */
+long cgi_due(cgi_t* cgi, const conf_t* conf);
+
+// SIGTERM the process group of CGI, and SIGKILL it after a grace.
+void cgi_kill(cgi_t* cgi, const conf_t* conf);
+
+/**
+ * @brief SIGKILL those killed earlier whose grace is over.
+ * @return ms till the next is due; -1 if none.
+ */
+long cgi_kill_pump();
+
+// Reap CGI that has exited, except those whose group may still be
+// signaled: in the middle of a run, or waiting for SIGKILL.
+// CGI leads a process group of its own, so it's left to the event loop
+// by SIGCHLD handler, which only reaps children in lisod's group.
+void cgi_reap();
+
+/**
+ * @brief Parse response header of CGI.
+ *
+ * It is either NPH, starting with a status line, or CGI header, where
+ * status comes from the Status field.
+ * @param cgi The CGI to store status and headers.
+ * @param data The output of CGI.
+ * @param sz Size of data.
+ * @return Size of header, including the empty line.
+ *          0 if header is not complete yet.
+ *         -1 if header is malformed.
+ */
+ssize_t cgi_parse_hdr(cgi_t* cgi, const char* data, size_t sz);
+
+/**
+ * @brief Serialize the parsed response header.
+ * @param cgi The CGI with parsed header.
+ * @param hdr The header to be built.
+ * @return Serialized header size.
+ */
+ssize_t cgi_pack_hdr(const cgi_t* cgi, char* hdr);
+
 #endif // CGI_H
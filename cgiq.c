@@ -0,0 +1,190 @@
+/**
+ * @file cgiq.c
+ * @brief Implementation of cgiq.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <time.h>
+#include "cgiq.h"
+#include "logging.h"
+#include "utils.h"
+
+static const conf_t* conf = NULL;
+
+// runs going on, in total and under each limit
+static int running = 0;
+static int limit_running[CONF_MAXCGILIMITS];
+
+// waiting ones; oldest at head
+static cq_ent_t* head = NULL;
+static cq_ent_t* tail = NULL;
+static int waiting = 0;
+
+// counters
+static unsigned long n_admitted = 0;
+static unsigned long n_queued = 0;
+static unsigned long n_full = 0;
+static unsigned long n_expired = 0;
+// of those admitted from queue
+static unsigned long n_waited = 0;
+static long wait_total = 0;
+static long wait_max = 0;
+
+void cq_init(const conf_t* c) {
+  conf = c;
+}
+
+void cq_reset(cq_ent_t* ent) {
+  ent->state = CQ_IDLE;
+  ent->limit = -1;
+  ent->since = 0;
+  ent->prev = ent->next = NULL;
+}
+
+static long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// check if a run under limit can go now
+static bool has_room(int limit) {
+  if (conf->cgi_max > 0 && running >= conf->cgi_max)
+    return false;
+  return limit < 0 ||
+         limit_running[limit] < conf->cgi_limits[limit].max;
+}
+
+// check if someone waiting can go now
+static bool someone_admissible() {
+  cq_ent_t* ent;
+  for (ent = head; ent; ent = ent->next)
+    if (has_room(ent->limit))
+      return true;
+  return false;
+}
+
+// take a slot
+static void take(cq_ent_t* ent) {
+  running++;
+  if (ent->limit >= 0)
+    limit_running[ent->limit]++;
+  ent->state = CQ_ADMITTED;
+  n_admitted++;
+}
+
+static void unlink_ent(cq_ent_t* ent) {
+  if (ent->prev)
+    ent->prev->next = ent->next;
+  else
+    head = ent->next;
+  if (ent->next)
+    ent->next->prev = ent->prev;
+  else
+    tail = ent->prev;
+  ent->prev = ent->next = NULL;
+  waiting--;
+}
+
+bool cq_enter(cq_ent_t* ent, const char* uri) {
+
+  ent->limit = -1;
+  int i;
+  for (i = 0; i < conf->n_cgi_limits; i++) {
+    if (strstartswith(uri, conf->cgi_limits[i].prefix)) {
+      ent->limit = i;
+      break;
+    }
+  }
+
+  // go right away, unless it would jump the queue
+  if (has_room(ent->limit) && !someone_admissible()) {
+    take(ent);
+    return true;
+  }
+
+  if (waiting >= conf->cgi_queue) {
+    n_full++;
+    return false;
+  }
+
+  ent->state = CQ_WAITING;
+  ent->since = now_ms();
+  ent->prev = tail;
+  ent->next = NULL;
+  if (tail)
+    tail->next = ent;
+  else
+    head = ent;
+  tail = ent;
+  waiting++;
+  n_queued++;
+
+#if DEBUG >= 1
+  log_line("[cq_enter] %s waits; %d running, %d waiting.",
+           uri, running, waiting);
+#endif
+
+  return true;
+}
+
+void cq_leave(cq_ent_t* ent) {
+  if (ent->state == CQ_ADMITTED) {
+    running--;
+    if (ent->limit >= 0)
+      limit_running[ent->limit]--;
+  } else if (ent->state == CQ_WAITING) {
+    unlink_ent(ent);
+  }
+  ent->state = CQ_IDLE;
+}
+
+long cq_pump() {
+
+  if (!head)
+    return -1;
+
+  long now = now_ms();
+  long next = -1;
+  bool woke = false;
+
+  cq_ent_t* ent = head;
+  while (ent) {
+    cq_ent_t* nxt = ent->next;
+    long waited = now - ent->since;
+
+    if (has_room(ent->limit)) {
+      unlink_ent(ent);
+      take(ent);
+      n_waited++;
+      wait_total += waited;
+      wait_max = max(wait_max, waited);
+      woke = true;
+
+    } else if (conf->cgi_queue_timeout > 0 &&
+               waited >= conf->cgi_queue_timeout) {
+      unlink_ent(ent);
+      ent->state = CQ_EXPIRED;
+      n_expired++;
+      woke = true;
+
+    } else if (conf->cgi_queue_timeout > 0) {
+      long left = conf->cgi_queue_timeout - waited;
+      if (next < 0 || left < next)
+        next = left;
+    }
+
+    ent = nxt;
+  }
+
+  return woke ? 0 : next;
+}
+
+void cq_report() {
+  log_line("[cq_report] %d running, %d waiting; %lu admitted, %lu queued, "
+           "%lu turned away as queue is full, %lu timed out.",
+           running, waiting, n_admitted, n_queued, n_full, n_expired);
+  log_line("[cq_report] queued ones waited %ld ms on average, "
+           "%ld ms at most.",
+           n_waited ? wait_total / (long) n_waited : 0, wait_max);
+}
@@ -0,0 +1,66 @@
+/**
+ * @file cgiq.h
+ * @brief Admission of CGI runs.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * At most cgi_max CGI runs go at a time, and at most so many under
+ * each cgi_limit prefix. The rest wait in a FIFO queue, parked in
+ * CGI_READY, and are admitted by the event loop as runs end; the
+ * first in the queue whose prefix has room goes first. Requests
+ * beyond cgi_queue waiting ones, or waiting longer than
+ * cgi_queue_timeout, are answered with 503.
+ *
+ * It's used by the event loop only, so there is no lock.
+ */
+
+#ifndef CGIQ_H
+#define CGIQ_H
+
+#include "config.h"
+
+// ticket of a request in the queue
+typedef struct cq_ent_s {
+  enum {
+    CQ_IDLE=1,
+    CQ_WAITING,
+    CQ_ADMITTED,  // holds a slot
+    CQ_EXPIRED,   // waited too long
+  } state;
+  // index of cgi_limit it falls under; -1 if none
+  int limit;
+  // when it started waiting, in ms
+  long since;
+  struct cq_ent_s* prev;
+  struct cq_ent_s* next;
+} cq_ent_t;
+
+// set limits
+void cq_init(const conf_t* conf);
+// clear a ticket
+void cq_reset(cq_ent_t* ent);
+
+/**
+ * @brief Ask for a slot to run CGI for uri.
+ * @param ent The ticket.
+ * @param uri URI of the request.
+ * @return true if it's admitted right away, or it waits in queue.
+ *         false if the queue is full.
+ */
+bool cq_enter(cq_ent_t* ent, const char* uri);
+
+// give up the slot, or the place in queue
+void cq_leave(cq_ent_t* ent);
+
+/**
+ * @brief Admit those waiting for whom there is room, and expire those
+ *        waiting too long.
+ * @return 0 if some are admitted or expired, and to be served now.
+ *         ms till the next one expires.
+ *        -1 if none is waiting.
+ */
+long cq_pump();
+
+// log counters, and how long requests have waited
+void cq_report();
+
+#endif // CGIQ_H
@@ -0,0 +1,273 @@
+/**
+ * @file compress.c
+ * @brief Implementation of compress.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "compress.h"
+#include "logging.h"
+
+// window bits of zlib; +16 for gzip wrapper.
+#define ZS_WBITS (15 + 16)
+#define ZS_MEMLEVEL 8
+
+/**** streaming compressor ****/
+
+zs_t* zs_new(int level) {
+  zs_t* zs = malloc(sizeof(zs_t));
+  memset(&zs->strm, 0, sizeof(z_stream));
+  if (deflateInit2(&zs->strm, level, Z_DEFLATED, ZS_WBITS,
+                   ZS_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+    log_errln("[zs_new] deflateInit2 failed.");
+    free(zs);
+    return NULL;
+  }
+  zs->in = buf_new();
+  zs->finishing = false;
+  zs->done = false;
+  return zs;
+}
+
+void zs_free(zs_t* zs) {
+  if (!zs)
+    return;
+  deflateEnd(&zs->strm);
+  buf_free(zs->in);
+  free(zs);
+}
+
+bool zs_hungry(const zs_t* zs) {
+  return zs->strm.avail_in == 0 && !zs->finishing;
+}
+
+void zs_feed(zs_t* zs, size_t n) {
+  zs->in->sz = n;
+  zs->strm.next_in = zs->in->data;
+  zs->strm.avail_in = n;
+}
+
+void zs_finish(zs_t* zs) {
+  zs->finishing = true;
+}
+
+size_t zs_drain(zs_t* zs, void* out, size_t cap) {
+
+  if (zs->done)
+    return 0;
+
+  zs->strm.next_out = out;
+  zs->strm.avail_out = cap;
+
+  int rc = deflate(&zs->strm, zs->finishing ? Z_FINISH : Z_SYNC_FLUSH);
+  if (rc == Z_STREAM_END)
+    zs->done = true;
+  else if (rc != Z_OK && rc != Z_BUF_ERROR)
+    log_errln("[zs_drain] deflate failed with %d.", rc);
+
+  return cap - zs->strm.avail_out;
+}
+
+/**** cache of compressed files ****/
+
+#define ZC_BUCKETS 1024
+
+static zc_ent_t* buckets[ZC_BUCKETS];
+// most recently used at head
+static zc_ent_t* lru_head = NULL;
+static zc_ent_t* lru_tail = NULL;
+static size_t used = 0;
+static size_t budget = 0;
+// cache is shared by worker threads
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void zc_init(size_t sz) {
+  budget = sz;
+}
+
+static unsigned long hash(const char* str) {
+  unsigned long h = 5381;
+  for (; *str; str++)
+    h = h * 33 + (unsigned char) *str;
+  return h;
+}
+
+static void lru_unlink(zc_ent_t* ent) {
+  if (ent->prev_lru)
+    ent->prev_lru->next_lru = ent->next_lru;
+  else
+    lru_head = ent->next_lru;
+  if (ent->next_lru)
+    ent->next_lru->prev_lru = ent->prev_lru;
+  else
+    lru_tail = ent->prev_lru;
+  ent->prev_lru = ent->next_lru = NULL;
+}
+
+static void lru_push(zc_ent_t* ent) {
+  ent->prev_lru = NULL;
+  ent->next_lru = lru_head;
+  if (lru_head)
+    lru_head->prev_lru = ent;
+  lru_head = ent;
+  if (!lru_tail)
+    lru_tail = ent;
+}
+
+static void ent_free(zc_ent_t* ent) {
+  free(ent->path);
+  free(ent->data);
+  free(ent);
+}
+
+// remove ent from cache; free it if nobody is using it.
+static void evict(zc_ent_t* ent) {
+
+  zc_ent_t** pp = &buckets[hash(ent->path) % ZC_BUCKETS];
+  for (; *pp; pp = &(*pp)->next) {
+    if (*pp == ent) {
+      *pp = ent->next;
+      break;
+    }
+  }
+
+  lru_unlink(ent);
+  used -= ent->sz;
+  ent->evicted = true;
+
+  if (ent->ref == 0)
+    ent_free(ent);
+}
+
+// compress raw of size n in one shot
+// return compressed data, with size in sz; NULL if failed.
+static void* compress_all(const void* raw, size_t n, int level,
+                          size_t* sz) {
+  z_stream strm;
+  memset(&strm, 0, sizeof(z_stream));
+  if (deflateInit2(&strm, level, Z_DEFLATED, ZS_WBITS,
+                   ZS_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  size_t cap = deflateBound(&strm, n);
+  void* data = malloc(cap);
+
+  strm.next_in = (Bytef*) raw;
+  strm.avail_in = n;
+  strm.next_out = data;
+  strm.avail_out = cap;
+
+  if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&strm);
+    free(data);
+    return NULL;
+  }
+
+  *sz = cap - strm.avail_out;
+  deflateEnd(&strm);
+  return data;
+}
+
+// look up the entry of path; lock must be held.
+static zc_ent_t* lookup(const char* path, const struct stat* st, int enc) {
+
+  zc_ent_t* ent;
+  for (ent = buckets[hash(path) % ZC_BUCKETS]; ent; ent = ent->next) {
+    if (ent->enc != enc || strcmp(ent->path, path))
+      continue;
+
+    // file has changed since compressed
+    if (ent->ino != st->st_ino || ent->mtime != st->st_mtime ||
+        ent->fsz != st->st_size) {
+      evict(ent);
+      return NULL;
+    }
+
+    ent->ref++;
+    lru_unlink(ent);
+    lru_push(ent);
+    return ent;
+  }
+
+  return NULL;
+}
+
+zc_ent_t* zc_lookup(const char* path, const struct stat* st, int enc) {
+  pthread_mutex_lock(&mutex);
+  zc_ent_t* ent = lookup(path, st, enc);
+  pthread_mutex_unlock(&mutex);
+  return ent;
+}
+
+zc_ent_t* zc_put(const char* path, const struct stat* st, int enc,
+                 const void* raw, int level) {
+
+  unsigned long h = hash(path) % ZC_BUCKETS;
+
+  // compress without lock, since it takes a while
+  size_t sz;
+  void* data = compress_all(raw, st->st_size, level, &sz);
+  if (!data) {
+    log_errln("[zc_put] failed to compress %s.", path);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&mutex);
+
+  // someone else has just put it
+  zc_ent_t* ent = lookup(path, st, enc);
+  if (ent) {
+    pthread_mutex_unlock(&mutex);
+    free(data);
+    return ent;
+  }
+
+  ent = malloc(sizeof(zc_ent_t));
+  ent->path = strdup(path);
+  ent->ino = st->st_ino;
+  ent->mtime = st->st_mtime;
+  ent->fsz = st->st_size;
+  ent->enc = enc;
+  ent->data = data;
+  ent->sz = sz;
+  ent->ref = 1;
+  ent->evicted = false;
+
+  // too large to be cached; it lives as long as the response.
+  if (sz > budget) {
+    ent->next = NULL;
+    ent->prev_lru = ent->next_lru = NULL;
+    ent->evicted = true;
+    pthread_mutex_unlock(&mutex);
+    return ent;
+  }
+
+  // make room for it
+  while (used + sz > budget && lru_tail)
+    evict(lru_tail);
+
+  ent->next = buckets[h];
+  buckets[h] = ent;
+  lru_push(ent);
+  used += sz;
+
+  pthread_mutex_unlock(&mutex);
+
+#if DEBUG >= 1
+  log_line("[zc_put] cached %s, %zu -> %zu bytes.",
+           path, (size_t) st->st_size, sz);
+#endif
+
+  return ent;
+}
+
+void zc_release(zc_ent_t* ent) {
+  if (!ent)
+    return;
+  pthread_mutex_lock(&mutex);
+  if (--ent->ref == 0 && ent->evicted)
+    ent_free(ent);
+  pthread_mutex_unlock(&mutex);
+}
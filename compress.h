@@ -0,0 +1,111 @@
+/**
+ * @file compress.h
+ * @brief On-the-fly gzip compression.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * Provides a streaming compressor for dynamic content, and a cache of
+ * compressed static files, so that each file is compressed only once.
+ * The cache is thread-safe; a stream belongs to one thread.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "buffer.h"
+#include "utils.h"
+
+/**** streaming compressor ****/
+
+typedef struct {
+  z_stream strm;
+  // raw input to be compressed
+  buf_t* in;
+  // no more input is coming
+  bool finishing;
+  // the compressed stream is ended
+  bool done;
+} zs_t;
+
+// create a gzip stream with compression level
+zs_t* zs_new(int level);
+// destroy a gzip stream
+void zs_free(zs_t* zs);
+// check if raw input in zs->in is all consumed
+bool zs_hungry(const zs_t* zs);
+// size of raw input fed at a time; its compressed output fits in BUFSZ.
+#define ZS_INSZ (BUFSZ / 2)
+
+// feed n bytes in zs->in as input
+void zs_feed(zs_t* zs, size_t n);
+// no more input is coming
+void zs_finish(zs_t* zs);
+
+/**
+ * @brief Compress as much input as fits into out.
+ * @param zs The gzip stream.
+ * @param out Output buffer.
+ * @param cap Capacity of output buffer.
+ * @return Size of compressed data; may be 0.
+ *
+ * Output is flushed, so that what has been fed can be decoded by
+ * client right away.
+ */
+size_t zs_drain(zs_t* zs, void* out, size_t cap);
+
+/**** cache of compressed files ****/
+
+typedef struct zc_ent_s {
+  // key
+  char* path;
+  ino_t ino;
+  time_t mtime;
+  off_t fsz;
+  int enc;
+
+  // compressed content
+  void* data;
+  size_t sz;
+
+  // number of responses using it
+  int ref;
+  // removed from cache, and freed once ref drops to 0
+  bool evicted;
+
+  struct zc_ent_s* next;  // hash chain
+  struct zc_ent_s* prev_lru;
+  struct zc_ent_s* next_lru;
+} zc_ent_t;
+
+// set memory budget of the cache
+void zc_init(size_t budget);
+
+/**
+ * @brief Look up the compressed version of a file.
+ * @param path Path to the file.
+ * @param st Stat of the file.
+ * @param enc Content coding, in ENC_*.
+ * @return Cache entry with ref held; NULL if not cached.
+ *
+ * Stale entries are evicted on the way.
+ */
+zc_ent_t* zc_lookup(const char* path, const struct stat* st, int enc);
+
+/**
+ * @brief Compress a file and put it into cache.
+ * @param path Path to the file.
+ * @param st Stat of the file.
+ * @param enc Content coding, in ENC_*.
+ * @param raw Mapped content of the file.
+ * @param level Compression level.
+ * @return Cache entry with ref held; NULL if failed.
+ */
+zc_ent_t* zc_put(const char* path, const struct stat* st, int enc,
+                 const void* raw, int level);
+
+// release a cache entry
+void zc_release(zc_ent_t* ent);
+
+#endif // COMPRESS_H
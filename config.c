@@ -0,0 +1,435 @@
+/**
+ * @file config.c
+ * @brief Implementation of config.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "config.h"
+#include "worker.h"
+#include "tls.h"
+#include "wsgi.h"
+#include "utils.h"
+
+#define CONF_LINESZ 1024
+#define CONF_MAXARGS (CONF_MAXTYPES+1)
+
+// text types are worth compressing by default
+static const char* default_gzip_types[] = {
+  "text/*",
+  "application/javascript",
+  "application/json",
+  "application/xml",
+  "image/svg+xml",
+};
+#define n_default_gzip_types \
+  (sizeof(default_gzip_types) / sizeof(const char*))
+
+void conf_init(conf_t* conf) {
+  conf->workers = CONF_WORKERS;
+  conf->sendfile = CONF_SENDFILE;
+  conf->ktls = CONF_KTLS;
+  conf->ssl_min_version = tls_parse_version(CONF_SSL_MIN_VERSION);
+  conf->ssl_ecdsa_key = NULL;
+  conf->ssl_ecdsa_crt = NULL;
+  conf->ssl_ciphers = CONF_SSL_CIPHERS;
+  conf->ssl_groups = CONF_SSL_GROUPS;
+  conf->ssl_prefer_server_ciphers = CONF_SSL_PREFER_SERVER_CIPHERS;
+  conf->ssl_session_cache = CONF_SSL_SESSION_CACHE;
+  conf->ssl_session_timeout = CONF_SSL_SESSION_TIMEOUT;
+  conf->ssl_session_tickets = CONF_SSL_SESSION_TICKETS;
+  conf->ssl_ticket_key_rotate = CONF_SSL_TICKET_KEY_ROTATE;
+  conf->ssl_handshake_workers = CONF_SSL_HANDSHAKE_WORKERS;
+  conf->ssl_record_small = CONF_SSL_RECORD_SMALL;
+  conf->ssl_record_boost = CONF_SSL_RECORD_BOOST;
+  conf->ssl_record_idle = CONF_SSL_RECORD_IDLE;
+  conf->ssl_release_buffers = CONF_SSL_RELEASE_BUFFERS;
+  conf->ssl_free_list = CONF_SSL_FREE_LIST;
+  conf->cgi_pipe_size = CONF_CGI_PIPE_SIZE;
+  conf->cgi_max = CONF_CGI_MAX;
+  conf->n_cgi_replicas = 0;
+  conf->n_cgi_limits = 0;
+  conf->cgi_queue = CONF_CGI_QUEUE;
+  conf->cgi_queue_timeout = CONF_CGI_QUEUE_TIMEOUT;
+  conf->cgi_timeout = CONF_CGI_TIMEOUT;
+  conf->cgi_idle_timeout = CONF_CGI_IDLE_TIMEOUT;
+  conf->cgi_kill_grace = CONF_CGI_KILL_GRACE;
+  conf->n_cgi_caches = 0;
+  conf->n_cgi_cache_vary = 0;
+  conf->cgi_cache_swr = CONF_CGI_CACHE_SWR;
+  conf->cgi_cache_size = CONF_CGI_CACHE_SIZE;
+  conf->cgi_cache_max_entry = CONF_CGI_CACHE_MAX_ENTRY;
+  conf->fastcgi = NULL;
+  conf->fastcgi_keepalive = CONF_FASTCGI_KEEPALIVE;
+  conf->n_proxies = 0;
+  conf->proxy_keepalive = CONF_PROXY_KEEPALIVE;
+  conf->backend_max_fails = CONF_BACKEND_MAX_FAILS;
+  conf->backend_eject_time = CONF_BACKEND_EJECT_TIME;
+  conf->backend_slow_start = CONF_BACKEND_SLOW_START;
+  conf->wsgi = NULL;
+  conf->wsgi_workers = CONF_WSGI_WORKERS;
+  conf->wsgi_host = CONF_WSGI_HOST;
+  conf->mime_types = CONF_MIME_TYPES;
+  conf->n_policies = 0;
+
+  int i;
+  conf->n_gzip_types = n_default_gzip_types;
+  for (i = 0; i < n_default_gzip_types; i++)
+    strcpy0(conf->gzip_types[i], default_gzip_types[i]);
+  conf->gzip_level = CONF_GZIP_LEVEL;
+  conf->gzip_min_length = CONF_GZIP_MIN_LENGTH;
+  conf->gzip_max_length = CONF_GZIP_MAX_LENGTH;
+  conf->gzip_cache_size = CONF_GZIP_CACHE_SIZE;
+}
+
+bool conf_gzip_type(const conf_t* conf, const char* ctype) {
+
+  // ignore parameters like charset
+  size_t len = strcspn(ctype, "; \t");
+
+  int i;
+  for (i = 0; i < conf->n_gzip_types; i++) {
+    const char* type = conf->gzip_types[i];
+    size_t tlen = strlen(type);
+    if (tlen >= 2 && !strcmp(type+tlen-2, "/*")) {
+      if (len > tlen-1 && !strncasecmp(ctype, type, tlen-1))
+        return true;
+    } else if (len == tlen && !strncasecmp(ctype, type, len)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// parse a non-negative number into val
+// return true if success.
+static bool parse_long(const char* str, long* val) {
+  if (!*str || !isnum((char*) str))
+    return false;
+  *val = atol(str);
+  return true;
+}
+
+// parse on/off into val
+// return true if success.
+static bool parse_bool(const char* str, bool* val) {
+  if (!strcasecmp(str, "on"))
+    *val = true;
+  else if (!strcasecmp(str, "off"))
+    *val = false;
+  else
+    return false;
+  return true;
+}
+
+// apply one setting
+// return true if success.
+static bool conf_apply(conf_t* conf, int argc, char* argv[]) {
+
+  const char* key = argv[0];
+
+  if (!strcmp(key, "workers")) {
+    long n;
+    if (argc != 2 || !parse_long(argv[1], &n) || n > WK_MAXTHREADS)
+      return false;
+    conf->workers = n;
+
+  } else if (!strcmp(key, "sendfile")) {
+    if (argc != 2 || !parse_bool(argv[1], &conf->sendfile))
+      return false;
+
+  } else if (!strcmp(key, "ktls")) {
+    if (argc != 2 || !parse_bool(argv[1], &conf->ktls))
+      return false;
+
+  } else if (!strcmp(key, "ssl_min_version")) {
+    if (argc != 2 || !(conf->ssl_min_version = tls_parse_version(argv[1])))
+      return false;
+
+  } else if (!strcmp(key, "ssl_ecdsa_certificate")) {
+    if (argc != 3)
+      return false;
+    conf->ssl_ecdsa_key = strdup(argv[1]);
+    conf->ssl_ecdsa_crt = strdup(argv[2]);
+
+  } else if (!strcmp(key, "ssl_ciphers")) {
+    if (argc != 2)
+      return false;
+    conf->ssl_ciphers = strdup(argv[1]);
+
+  } else if (!strcmp(key, "ssl_groups")) {
+    if (argc != 2)
+      return false;
+    conf->ssl_groups = strdup(argv[1]);
+
+  } else if (!strcmp(key, "ssl_prefer_server_ciphers")) {
+    if (argc != 2 ||
+        !parse_bool(argv[1], &conf->ssl_prefer_server_ciphers))
+      return false;
+
+  } else if (!strcmp(key, "ssl_session_cache")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->ssl_session_cache))
+      return false;
+
+  } else if (!strcmp(key, "ssl_session_timeout")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->ssl_session_timeout))
+      return false;
+
+  } else if (!strcmp(key, "ssl_session_tickets")) {
+    if (argc != 2 || !parse_bool(argv[1], &conf->ssl_session_tickets))
+      return false;
+
+  } else if (!strcmp(key, "ssl_ticket_key_rotate")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->ssl_ticket_key_rotate))
+      return false;
+
+  } else if (!strcmp(key, "ssl_handshake_workers")) {
+    long n;
+    if (argc != 2 || !parse_long(argv[1], &n) || n > WK_MAXTHREADS)
+      return false;
+    conf->ssl_handshake_workers = n;
+
+  } else if (!strcmp(key, "ssl_record_small")) {
+    long n;
+    // openssl takes 512 at least
+    if (argc != 2 || !parse_long(argv[1], &n) ||
+        (n > 0 && n < 512) || n > TLS_MAXRECORD)
+      return false;
+    conf->ssl_record_small = n;
+
+  } else if (!strcmp(key, "ssl_record_boost")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->ssl_record_boost))
+      return false;
+
+  } else if (!strcmp(key, "ssl_record_idle")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->ssl_record_idle))
+      return false;
+
+  } else if (!strcmp(key, "ssl_release_buffers")) {
+    if (argc != 2 || !parse_bool(argv[1], &conf->ssl_release_buffers))
+      return false;
+
+  } else if (!strcmp(key, "ssl_free_list")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->ssl_free_list))
+      return false;
+
+  } else if (!strcmp(key, "cgi_pipe_size")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_pipe_size))
+      return false;
+
+  } else if (!strcmp(key, "cgi_max")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_max))
+      return false;
+
+  } else if (!strcmp(key, "cgi_replica")) {
+    if (argc != 2 || conf->n_cgi_replicas >= CONF_MAXREPLICAS)
+      return false;
+    conf->cgi_replicas[conf->n_cgi_replicas++] = strdup(argv[1]);
+
+  } else if (!strcmp(key, "cgi_limit")) {
+    cgi_limit_t* limit = &conf->cgi_limits[conf->n_cgi_limits];
+    if (argc != 3 || conf->n_cgi_limits >= CONF_MAXCGILIMITS ||
+        strlen(argv[1]) > CONF_PREFIXSZ ||
+        !parse_long(argv[2], &limit->max) || limit->max < 1)
+      return false;
+    strcpy0(limit->prefix, argv[1]);
+    conf->n_cgi_limits++;
+
+  } else if (!strcmp(key, "cgi_queue")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_queue))
+      return false;
+
+  } else if (!strcmp(key, "cgi_queue_timeout")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_queue_timeout))
+      return false;
+
+  } else if (!strcmp(key, "cgi_timeout")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_timeout))
+      return false;
+
+  } else if (!strcmp(key, "cgi_idle_timeout")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_idle_timeout))
+      return false;
+
+  } else if (!strcmp(key, "cgi_kill_grace")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_kill_grace))
+      return false;
+
+  } else if (!strcmp(key, "cgi_cache")) {
+    cgi_cache_t* cache = &conf->cgi_caches[conf->n_cgi_caches];
+    if (argc != 3 || conf->n_cgi_caches >= CONF_MAXCGICACHES ||
+        strlen(argv[1]) > CONF_PREFIXSZ ||
+        !parse_long(argv[2], &cache->ttl))
+      return false;
+    strcpy0(cache->prefix, argv[1]);
+    conf->n_cgi_caches++;
+
+  } else if (!strcmp(key, "cgi_cache_vary")) {
+    if (argc - 1 > CONF_MAXVARY)
+      return false;
+    int i;
+    for (i = 1; i < argc; i++) {
+      if (strlen(argv[i]) > CONF_TYPESZ)
+        return false;
+      strcpy0(conf->cgi_cache_vary[i-1], argv[i]);
+    }
+    conf->n_cgi_cache_vary = argc - 1;
+
+  } else if (!strcmp(key, "cgi_cache_swr")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_cache_swr))
+      return false;
+
+  } else if (!strcmp(key, "cgi_cache_size")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_cache_size))
+      return false;
+
+  } else if (!strcmp(key, "cgi_cache_max_entry")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->cgi_cache_max_entry))
+      return false;
+
+  } else if (!strcmp(key, "fastcgi")) {
+    if (argc != 2)
+      return false;
+    conf->fastcgi = strdup(argv[1]);
+
+  } else if (!strcmp(key, "fastcgi_keepalive")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->fastcgi_keepalive))
+      return false;
+
+  } else if (!strcmp(key, "proxy")) {
+    proxy_t* proxy = &conf->proxies[conf->n_proxies];
+    if (argc != 3 || conf->n_proxies >= CONF_MAXPROXIES ||
+        strlen(argv[1]) > CONF_PREFIXSZ)
+      return false;
+    strcpy0(proxy->prefix, argv[1]);
+    proxy->addr = strdup(argv[2]);
+    conf->n_proxies++;
+
+  } else if (!strcmp(key, "proxy_keepalive")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->proxy_keepalive))
+      return false;
+
+  } else if (!strcmp(key, "backend_max_fails")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->backend_max_fails))
+      return false;
+
+  } else if (!strcmp(key, "backend_eject_time")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->backend_eject_time))
+      return false;
+
+  } else if (!strcmp(key, "backend_slow_start")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->backend_slow_start))
+      return false;
+
+  } else if (!strcmp(key, "wsgi")) {
+    if (argc != 2 || !strchr(argv[1], ':'))
+      return false;
+    conf->wsgi = strdup(argv[1]);
+
+  } else if (!strcmp(key, "wsgi_workers")) {
+    long n;
+    if (argc != 2 || !parse_long(argv[1], &n) ||
+        n < 1 || n > WSGI_MAXHELPERS)
+      return false;
+    conf->wsgi_workers = n;
+
+  } else if (!strcmp(key, "wsgi_host")) {
+    if (argc != 2)
+      return false;
+    conf->wsgi_host = strdup(argv[1]);
+
+  } else if (!strcmp(key, "mime_types")) {
+    if (argc != 2)
+      return false;
+    conf->mime_types = strdup(argv[1]);
+
+  } else if (!strcmp(key, "cache_control")) {
+    cache_policy_t* policy = &conf->policies[conf->n_policies];
+    if (argc != 3 || conf->n_policies >= CONF_MAXPOLICIES ||
+        strlen(argv[1]) > CONF_EXTSZ ||
+        !parse_long(argv[2], &policy->max_age))
+      return false;
+    strcpy0(policy->ext, argv[1]);
+    conf->n_policies++;
+
+  } else if (!strcmp(key, "gzip_types")) {
+    // replaces the defaults
+    if (argc - 1 > CONF_MAXTYPES)
+      return false;
+    int i;
+    for (i = 1; i < argc; i++) {
+      if (strlen(argv[i]) > CONF_TYPESZ)
+        return false;
+      strcpy0(conf->gzip_types[i-1], argv[i]);
+    }
+    conf->n_gzip_types = argc - 1;
+
+  } else if (!strcmp(key, "gzip_level")) {
+    long level;
+    if (argc != 2 || !parse_long(argv[1], &level) || level > 9)
+      return false;
+    conf->gzip_level = level;
+
+  } else if (!strcmp(key, "gzip_min_length")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->gzip_min_length))
+      return false;
+
+  } else if (!strcmp(key, "gzip_max_length")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->gzip_max_length))
+      return false;
+
+  } else if (!strcmp(key, "gzip_cache_size")) {
+    if (argc != 2 || !parse_long(argv[1], &conf->gzip_cache_size))
+      return false;
+
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+int conf_load(conf_t* conf, const char* fname) {
+
+  FILE* f = fopen(fname, "r");
+  if (!f) {
+    fprintf(stderr, "Cannot open config file %s.\n", fname);
+    return -1;
+  }
+
+  char line[CONF_LINESZ+1];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+
+    // strip comment
+    char* p = strchr(line, '#');
+    if (p)
+      *p = 0;
+
+    int argc = 0;
+    char* argv[CONF_MAXARGS];
+    char* save = NULL;
+    for (p = strtok_r(line, " \t\r\n", &save);
+         p && argc < CONF_MAXARGS;
+         p = strtok_r(NULL, " \t\r\n", &save))
+      argv[argc++] = p;
+
+    // empty line
+    if (argc == 0)
+      continue;
+
+    if (!conf_apply(conf, argc, argv)) {
+      fprintf(stderr, "Invalid setting at %s:%d: %s\n",
+              fname, lineno, argv[0]);
+      fclose(f);
+      return -1;
+    }
+  }
+
+  fclose(f);
+  return 1;
+}
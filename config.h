@@ -2,13 +2,133 @@
  * @file config.h
  * @brief Global configurations.
  * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * Required settings come from the command line. Optional settings
+ * have defaults here, and can be overridden by a config file with
+ * one `key value...` per line; `#` starts a comment.
  */
 
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include "utils.h"
+
 #define VERSION "Liso/1.0"
 
+// max number of cache policies
+#define CONF_MAXPOLICIES 32
+// max length of a file extension, including the dot
+#define CONF_EXTSZ 16
+// max number of mime types in a list
+#define CONF_MAXTYPES 32
+// max length of a mime type
+#define CONF_TYPESZ 64
+// max number of cached CGI prefixes, and of headers keyed on
+#define CONF_MAXCGICACHES 16
+#define CONF_MAXCGILIMITS 16
+#define CONF_MAXPROXIES 16
+// the script on the command line takes one more slot of LB_MAXBACKENDS
+#define CONF_MAXREPLICAS 15
+#define CONF_MAXVARY 8
+#define CONF_PREFIXSZ 128
+
+// on-the-fly gzip; level 0 turns it off
+#define CONF_GZIP_LEVEL 6
+#define CONF_GZIP_MIN_LENGTH 1024
+#define CONF_GZIP_MAX_LENGTH (4 << 20)
+#define CONF_GZIP_CACHE_SIZE (64 << 20)
+
+// threads for blocking file I/O; 0 does it in the event loop
+#define CONF_WORKERS 4
+
+// zero-copy static body, by sendfile or kTLS
+#define CONF_SENDFILE true
+#define CONF_KTLS true
+
+// tls; the version is a name like TLSv1.2
+#define CONF_SSL_MIN_VERSION "TLSv1.2"
+#define CONF_SSL_SESSION_CACHE 20480
+#define CONF_SSL_SESSION_TIMEOUT 3600
+#define CONF_SSL_SESSION_TICKETS true
+#define CONF_SSL_TICKET_KEY_ROTATE 3600
+// threads for handshakes; 0 does them in the event loop
+#define CONF_SSL_HANDSHAKE_WORKERS 2
+// ciphers of tls 1.2 and key exchange groups, fastest first
+#define CONF_SSL_CIPHERS \
+  "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:" \
+  "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:" \
+  "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+#define CONF_SSL_GROUPS "X25519:P-256:P-384"
+#define CONF_SSL_PREFER_SERVER_CIPHERS true
+// records start small, and grow after the boost bytes are sent;
+// they start over after being idle for ms.
+#define CONF_SSL_RECORD_SMALL 1400
+#define CONF_SSL_RECORD_BOOST (1 << 20)
+#define CONF_SSL_RECORD_IDLE 1000
+// memory held by idle tls conns
+#define CONF_SSL_RELEASE_BUFFERS true
+#define CONF_SSL_FREE_LIST 256
+
+// capacity of pipes to and from CGI; 0 keeps the default
+#define CONF_CGI_PIPE_SIZE (256 << 10)
+
+// concurrent CGI runs, and those waiting for a slot; 0 is unlimited.
+#define CONF_CGI_MAX 32
+#define CONF_CGI_QUEUE 256
+#define CONF_CGI_QUEUE_TIMEOUT 10000
+
+// CGI runs are killed past these, in ms; 0 is never.
+#define CONF_CGI_TIMEOUT 60000
+#define CONF_CGI_IDLE_TIMEOUT 30000
+#define CONF_CGI_KILL_GRACE 3000
+
+// backends of CGI replicas or a proxy prefix are ejected after so many
+// failures in a row, for ms, and take full load ms after coming back.
+#define CONF_BACKEND_MAX_FAILS 3
+#define CONF_BACKEND_EJECT_TIME 10000
+#define CONF_BACKEND_SLOW_START 10000
+
+// micro-cache of CGI GETs; it's on for cgi_cache prefixes only.
+#define CONF_CGI_CACHE_SIZE (16 << 20)
+#define CONF_CGI_CACHE_MAX_ENTRY (1 << 20)
+#define CONF_CGI_CACHE_SWR 0
+
+// idle conns kept to FastCGI backend
+#define CONF_FASTCGI_KEEPALIVE 16
+// idle conns kept to each upstream of proxy
+#define CONF_PROXY_KEEPALIVE 8
+
+// helpers hosting a WSGI application
+#define CONF_WSGI_WORKERS 2
+#define CONF_WSGI_HOST "wsgi_host.py"
+
+// mime types in addition to the built-in ones
+#define CONF_MIME_TYPES "/etc/mime.types"
+
+// Cache-Control policy for files with ext
+typedef struct {
+  char ext[CONF_EXTSZ+1];
+  long max_age;
+} cache_policy_t;
+
+// at most max CGI runs go at a time under prefix
+typedef struct {
+  char prefix[CONF_PREFIXSZ+1];
+  long max;
+} cgi_limit_t;
+
+// GETs under prefix are cached for ttl seconds by default
+typedef struct {
+  char prefix[CONF_PREFIXSZ+1];
+  long ttl;
+} cgi_cache_t;
+
+// requests under prefix go to upstream at addr
+typedef struct {
+  char prefix[CONF_PREFIXSZ+1];
+  char* addr;
+} proxy_t;
+
 typedef struct {
   int http_port;
   int https_port;
@@ -18,6 +138,153 @@ typedef struct {
   char* cgi;
   char* prv;
   char* crt;
+
+  /**** optional ****/
+
+  // workers <n>; threads building static responses.
+  int workers;
+
+  // sendfile <on|off>; send static body by sendfile.
+  bool sendfile;
+  // ktls <on|off>; let kernel encrypt tls records, so that sendfile
+  // works for https as well.
+  bool ktls;
+
+  // ssl_min_version <TLSv1|TLSv1.1|TLSv1.2|TLSv1.3>
+  int ssl_min_version;
+  // ssl_ecdsa_certificate <key file> <certificate file>; served to
+  // clients that accept ECDSA, next to the RSA pair.
+  char* ssl_ecdsa_key;
+  char* ssl_ecdsa_crt;
+  // ssl_ciphers <openssl cipher list>; for tls 1.2 and below.
+  char* ssl_ciphers;
+  // ssl_groups <group>:...; key exchange groups.
+  char* ssl_groups;
+  // ssl_prefer_server_ciphers <on|off>; our order wins over client's.
+  bool ssl_prefer_server_ciphers;
+  // ssl_session_cache <n>; max number of cached sessions, 0 turns off.
+  long ssl_session_cache;
+  // ssl_session_timeout <seconds>; lifetime of sessions and tickets.
+  long ssl_session_timeout;
+  // ssl_session_tickets <on|off>
+  bool ssl_session_tickets;
+  // ssl_ticket_key_rotate <seconds>; 0 never rotates.
+  long ssl_ticket_key_rotate;
+  // ssl_handshake_workers <n>; threads doing handshakes.
+  int ssl_handshake_workers;
+  // ssl_record_small <bytes>; size of records at first, 0 always sends
+  // max records.
+  int ssl_record_small;
+  // ssl_record_boost <bytes>; records grow after so many bytes.
+  long ssl_record_boost;
+  // ssl_record_idle <ms>; records become small again after idle.
+  long ssl_record_idle;
+  // ssl_release_buffers <on|off>; idle conns free their record buffers.
+  bool ssl_release_buffers;
+  // ssl_free_list <n>; max number of SSL objects kept for reuse.
+  long ssl_free_list;
+
+  // cgi_replica <path>; an equivalent CGI script, balanced with cgi.
+  int n_cgi_replicas;
+  char* cgi_replicas[CONF_MAXREPLICAS];
+
+  // cgi_pipe_size <bytes>; capacity of pipes to and from CGI.
+  long cgi_pipe_size;
+
+  // cgi_max <n>; max number of concurrent CGI runs, 0 is unlimited.
+  long cgi_max;
+  // cgi_limit <prefix> <n>; max number of them under prefix.
+  int n_cgi_limits;
+  cgi_limit_t cgi_limits[CONF_MAXCGILIMITS];
+  // cgi_queue <n>; max number of requests waiting for a slot.
+  long cgi_queue;
+  // cgi_queue_timeout <ms>; those waiting longer get 503, 0 never.
+  long cgi_queue_timeout;
+
+  // cgi_timeout <ms>; CGI running longer is killed, 0 never.
+  long cgi_timeout;
+  // cgi_idle_timeout <ms>; so is CGI giving no output so long, 0 never.
+  long cgi_idle_timeout;
+  // cgi_kill_grace <ms>; SIGKILL follows SIGTERM so late.
+  long cgi_kill_grace;
+
+  // cgi_cache <prefix> <ttl>; Cache-Control from CGI overrides ttl.
+  int n_cgi_caches;
+  cgi_cache_t cgi_caches[CONF_MAXCGICACHES];
+  // cgi_cache_vary <header>...; request headers keyed on besides URI.
+  int n_cgi_cache_vary;
+  char cgi_cache_vary[CONF_MAXVARY][CONF_TYPESZ+1];
+  // cgi_cache_swr <seconds>; stale entries are served so long while
+  // being refreshed, unless CGI says stale-while-revalidate.
+  long cgi_cache_swr;
+  // cgi_cache_size <bytes>; budget for cached responses.
+  long cgi_cache_size;
+  // cgi_cache_max_entry <bytes>; larger bodies are not cached.
+  long cgi_cache_max_entry;
+
+  // fastcgi <unix:path|host:port>; dynamic requests go to a FastCGI
+  // backend instead of forking the CGI script.
+  char* fastcgi;
+  // fastcgi_keepalive <n>; max number of idle conns kept to backend.
+  long fastcgi_keepalive;
+
+  // proxy <prefix> <unix:path|host:port>; requests under prefix go to
+  // an upstream HTTP server instead. Upstreams of the same prefix are
+  // balanced.
+  int n_proxies;
+  proxy_t proxies[CONF_MAXPROXIES];
+  // proxy_keepalive <n>; max number of idle conns kept to each.
+  long proxy_keepalive;
+
+  // backend_max_fails <n>; a CGI replica or upstream failing so many
+  // times in a row is ejected, 0 never.
+  long backend_max_fails;
+  // backend_eject_time <ms>; how long it stays ejected.
+  long backend_eject_time;
+  // backend_slow_start <ms>; its share of load ramps up so long after
+  // coming back, 0 takes full load at once.
+  long backend_slow_start;
+
+  // wsgi <module:callable>; dynamic requests go to a WSGI application
+  // hosted in helper processes, e.g. flaskr.flaskr:app.
+  char* wsgi;
+  // wsgi_workers <n>; number of helper processes.
+  int wsgi_workers;
+  // wsgi_host <path>; script that loads the application in helpers.
+  char* wsgi_host;
+
+  // mime_types <path>; a mime.types file.
+  char* mime_types;
+
+  // cache_control <ext> <max-age>
+  int n_policies;
+  cache_policy_t policies[CONF_MAXPOLICIES];
+
+  // gzip_types <type>...; type/* matches the whole category.
+  int n_gzip_types;
+  char gzip_types[CONF_MAXTYPES][CONF_TYPESZ+1];
+  // gzip_level <0-9>
+  int gzip_level;
+  // gzip_min_length <bytes>; smaller responses are sent as is.
+  long gzip_min_length;
+  // gzip_max_length <bytes>; larger static files are sent as is.
+  long gzip_max_length;
+  // gzip_cache_size <bytes>; budget for compressed static files.
+  long gzip_cache_size;
 } conf_t;
 
+// fill in defaults for optional settings
+void conf_init(conf_t* conf);
+// check if responses of ctype can be gzip'd on the fly
+bool conf_gzip_type(const conf_t* conf, const char* ctype);
+
+/**
+ * @brief Load optional settings from config file.
+ * @param conf The configurations to be updated.
+ * @param fname Path to the config file.
+ * @return 1 if normal.
+ *        -1 if error occurs; reason is printed to stderr.
+ */
+int conf_load(conf_t* conf, const char* fname);
+
 #endif // CONFIG_H
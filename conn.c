@@ -5,8 +5,14 @@
  */
 
 #include <sys/socket.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/err.h>
 #include "conn.h"
+#include "tls.h"
 #include "logging.h"
 #include "utils.h"
 #include "config.h"
@@ -22,13 +28,18 @@ conn_t* cn_new(int fd, int idx) {
   // ssl status won't change once established
   conn->ssl = NULL;
   conn->ssl_accepted = false;
+  conn->ssl_stall = 0;
+  memset(&conn->rec, 0, sizeof(tls_rec_t));
   return conn;
 }
 
 void cn_free(conn_t* conn) {
   if (conn->ssl) {
-    SSL_shutdown(conn->ssl);
-    SSL_free(conn->ssl);
+    if (conn->ssl_accepted)
+      SSL_shutdown(conn->ssl);
+    // shutdown of a broken conn leaves errors behind
+    ERR_clear_error();
+    tls_ssl_free(conn->ssl);
   }
   req_free(conn->req);
   resp_free(conn->resp);
@@ -39,7 +50,7 @@ void cn_free(conn_t* conn) {
 
 int cn_init_ssl(conn_t* conn, SSL_CTX* ctx) {
 
-  if (!(conn->ssl = SSL_new(ctx))) {
+  if (!(conn->ssl = tls_ssl_new(ctx))) {
     log_errln("[cn_init_ssl] failed to SSL_new for %d.", conn->fd);
     return -1;
   }
@@ -49,7 +60,7 @@ int cn_init_ssl(conn_t* conn, SSL_CTX* ctx) {
     log_errln("[cn_init_ssl] failed to SSL_set_fd for %d with rc %d. %s",
               conn->fd, rc,
               ERR_error_string(SSL_get_error(conn->ssl, rc), NULL));
-    SSL_free(conn->ssl);
+    tls_ssl_free(conn->ssl);
     conn->ssl = NULL;
     return -1;
   }
@@ -62,23 +73,101 @@ int cn_init_ssl(conn_t* conn, SSL_CTX* ctx) {
   return 1;
 }
 
-static ssize_t smart_recv(SSL* ssl, int fd, void* data, size_t len) {
-  if (ssl)
-    return SSL_read(ssl, data, len);
-  else
-    return recv(fd, data, len, 0);
+// returned by i/o that would block; retry when the socket is ready.
+#define CN_AGAIN (-2)
+
+bool cn_pending(conn_t* conn) {
+  return conn->ssl && conn->ssl_accepted && SSL_has_pending(conn->ssl);
 }
 
-static ssize_t smart_send(SSL* ssl, int fd, void* data, size_t len) {
-  ssize_t rc;
-  if (ssl) {
-    rc = SSL_write(ssl, data, len);
-  } else {
-    rc = send(fd, data, len, 0);
-    if (rc < 0) {
-      log_errln("[smart_send %d] %s.", fd, strerror(errno));
-      errno = 0;
+// check if a failed socket op would block
+static bool would_block() {
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    return false;
+  errno = 0;
+  return true;
+}
+
+// SSL_get_error reads the error queue of the thread, so it must be
+// cleared before each tls op; otherwise errors left by another conn
+// would fail this one.
+
+// sort out a failed tls op, and remember which way it waits.
+// return CN_AGAIN if it would block, 0 if client closed,
+//        -1 if error occurs.
+static ssize_t ssl_failed(conn_t* conn, int rc, bool sending) {
+
+  int err = SSL_get_error(conn->ssl, rc);
+
+  switch (err) {
+    case SSL_ERROR_WANT_READ:
+      conn->ssl_stall = sending ? CN_SEND_WANTS_READ : 0;
+      return CN_AGAIN;
+    case SSL_ERROR_WANT_WRITE:
+      conn->ssl_stall = sending ? 0 : CN_RECV_WANTS_WRITE;
+      return CN_AGAIN;
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_SYSCALL:
+      if (would_block())
+        return CN_AGAIN;
+      break;
+  }
+
+  log_errln("[%s %d] ssl error %d. %s", sending ? "smart_send" : "smart_recv",
+            conn->fd, err, ERR_error_string(ERR_get_error(), NULL));
+  return -1;
+}
+
+// return bytes received; 0 if client closed,
+//        CN_AGAIN if it would block, -1 if error occurs.
+static ssize_t smart_recv(conn_t* conn, void* data, size_t len) {
+
+  if (conn->ssl) {
+    ERR_clear_error();
+    int rc = SSL_read(conn->ssl, data, len);
+    if (rc <= 0)
+      return ssl_failed(conn, rc, false);
+    conn->ssl_stall = 0;
+    return rc;
+  }
+
+  ssize_t rc = recv(conn->fd, data, len, 0);
+  if (rc < 0 && would_block())
+    return CN_AGAIN;
+  return rc;
+}
+
+// return bytes sent; CN_AGAIN if it would block, -1 if error occurs.
+// tls writes one record at a time, sized by what conn has sent.
+static ssize_t smart_send(conn_t* conn, void* data, size_t len) {
+
+  if (conn->ssl) {
+    size_t sent = 0;
+    ERR_clear_error();
+    while (sent < len) {
+      size_t n = min(len - sent, tls_rec_size(&conn->rec));
+      int rc = SSL_write(conn->ssl, (char*) data + sent, n);
+      if (rc <= 0) {
+        if (ssl_failed(conn, rc, true) != CN_AGAIN)
+          return -1;
+        // the rest is retried with the same record size
+        conn->rec.blocked = true;
+        return sent > 0 ? sent : CN_AGAIN;
+      }
+      tls_rec_sent(&conn->rec, rc);
+      sent += rc;
     }
+    conn->ssl_stall = 0;
+    return sent;
+  }
+
+  ssize_t rc = send(conn->fd, data, len, 0);
+  if (rc < 0) {
+    if (would_block())
+      return CN_AGAIN;
+    log_errln("[smart_send %d] %s.", conn->fd, strerror(errno));
+    errno = 0;
   }
   return rc;
 }
@@ -94,7 +183,9 @@ static ssize_t smart_send(SSL* ssl, int fd, void* data, size_t len) {
  */
 static int recv_ignore(conn_t* conn, FatCb fat_cb) {
   // recv the content anyway
-  ssize_t rc = smart_recv(conn->ssl, conn->fd, conn->buf->data, BUFSZ);
+  ssize_t rc = smart_recv(conn, conn->buf->data, BUFSZ);
+  if (rc == CN_AGAIN)
+    return 1;
   // finally client gives up
   if (rc <= 0)
     //  < 0   =>   fatal, drop
@@ -194,31 +285,38 @@ int cn_parse_req(conn_t* conn, void* last_recv_end, ErrCb err_cb) {
   return 1;
 }
 
-int cn_recv(conn_t* conn, ErrCb err_cb, FatCb fat_cb) {
+int cn_handshake(conn_t* conn) {
 
-  // ssl conn needs SSL_accept first
-  if (conn->ssl && !conn->ssl_accepted) {
+  ERR_clear_error();
+  int rc = SSL_accept(conn->ssl);
 
-    int rc = SSL_accept(conn->ssl);
+  // success; the caller marks it accepted on the event loop.
+  if (rc == 1)
+    return 1;
 
-    // error occurs
-    if (rc == 0) {
-      log_errln("[cn_recv] failed to SSL_accept for %d with rc %d. %s",
-                conn->fd, rc,
-                ERR_error_string(SSL_get_error(conn->ssl, rc), NULL));
-      SSL_free(conn->ssl);
-      conn->ssl = NULL;
-      return fat_cb(conn);
+  // client would block; continue when it's ready.
+  int err = SSL_get_error(conn->ssl, rc);
+  if (err == SSL_ERROR_WANT_READ)
+    return 0;
+  if (err == SSL_ERROR_WANT_WRITE)
+    return 2;
+
+  log_errln("[cn_handshake] failed to SSL_accept for %d with rc %d. %s",
+            conn->fd, rc, ERR_error_string(ERR_get_error(), NULL));
+  // ssl is released with conn, by the event loop.
+  return -1;
+}
 
-    // client would block; continue in next iter.
-    } else if (rc < 0) {
-      return 1;
+int cn_recv(conn_t* conn, ErrCb err_cb, FatCb fat_cb) {
 
-    // success
-    } else {
-      conn->ssl_accepted = true;
-      return 1;
-    }
+  // ssl conn needs handshake first
+  if (conn->ssl && !conn->ssl_accepted) {
+    int rc = cn_handshake(conn);
+    if (rc < 0)
+      return fat_cb(conn);
+    conn->ssl_accepted = rc == 1;
+    conn->ssl_stall = rc == 2 ? CN_RECV_WANTS_WRITE : 0;
+    return 1;
   }
 
   // ignore the aborted ones
@@ -226,6 +324,11 @@ int cn_recv(conn_t* conn, ErrCb err_cb, FatCb fat_cb) {
   if (conn->req->phase == REQ_ABORT)
     return recv_ignore(conn, fat_cb);
 
+  // body in buf hasn't been taken by cgi yet
+  if (conn->req->phase == REQ_BODY && conn->req->type == REQ_DYNAMIC &&
+      buf_rsize(conn->buf) > 0)
+    return 1;
+
   /******** recv msg ********/
 
   ssize_t rsize = BUFSZ - conn->buf->sz;
@@ -238,7 +341,9 @@ int cn_recv(conn_t* conn, ErrCb err_cb, FatCb fat_cb) {
 
   // append to conn buf
   void* last_recv_end = buf_end(conn->buf);
-  ssize_t dsize = smart_recv(conn->ssl, conn->fd, last_recv_end, rsize);
+  ssize_t dsize = smart_recv(conn, last_recv_end, rsize);
+  if (dsize == CN_AGAIN)
+    return 1;
   if (dsize < 0) {
     conn->req->phase = REQ_ABORT;
     return fat_cb(conn);
@@ -269,19 +374,132 @@ int cn_recv(conn_t* conn, ErrCb err_cb, FatCb fat_cb) {
   return 1;
 }
 
-int cn_prepare_static_header(conn_t* conn, const conf_t* conf, ErrCb err_cb) {
+// max size of body sent by one sendfile
+#define CN_SENDFILESZ (1 << 20)
+// max size of body sent by one tls write; a few max records.
+#define CN_SSLCHUNK (4 * TLS_MAXRECORD)
+
+// cork or uncork the socket; corked data is sent in full packets.
+static void cork(conn_t* conn, bool on) {
+  int val = on;
+  if (setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val)) < 0) {
+    log_errln("[cork %d] %s.", conn->fd, strerror(errno));
+    errno = 0;
+  }
+}
+
+// send n bytes of body from file, by kTLS for ssl conns.
+// return bytes sent; CN_AGAIN if it would block, -1 if error occurs.
+static ssize_t send_file(conn_t* conn, size_t n) {
+
+  mmbuf_t* body = conn->resp->mmbuf;
+  ssize_t rc;
+
+  if (conn->ssl) {
+    ERR_clear_error();
+    rc = SSL_sendfile(conn->ssl, body->fd, body->pos, n, 0);
+    if (rc <= 0)
+      return ssl_failed(conn, rc, true) == CN_AGAIN ? CN_AGAIN : -1;
+    conn->ssl_stall = 0;
+  } else {
+    off_t off = body->pos;
+    rc = sendfile(conn->fd, body->fd, &off, n);
+    if (rc < 0) {
+      if (would_block())
+        return CN_AGAIN;
+      log_errln("[send_file %d] %s.", conn->fd, strerror(errno));
+      errno = 0;
+    }
+  }
+
+  return rc;
+}
+
+// check if body of the current range follows buf right away
+static bool body_follows(conn_t* conn) {
+  resp_t* resp = conn->resp;
+  if (conn->req->method == M_HEAD || !resp->mmbuf)
+    return false;
+  if (resp->phase == RESP_HEADER)
+    return resp->n_ranges <= 1 && resp_body_rsize(resp) > 0;
+  return resp->range_idx < resp->n_ranges;
+}
+
+// Copy the first window of body into buf, right after the header, so
+// that they go out in one SSL_write. Plain conns use writev instead.
+static void coalesce_body(conn_t* conn) {
+
+  if (!conn->ssl || conn->resp->sendfile || !body_follows(conn))
+    return;
+
+  buf_t* buf = conn->buf;
+  mmbuf_t* body = conn->resp->mmbuf;
+  size_t n;
+  void* data = mmbuf_peek(body, min(BUFSZ - buf->sz,
+                                    resp_body_rsize(conn->resp)), &n);
+  // leave it to cn_serve_static, which fails the conn
+  if (!data)
+    return;
+
+  memcpy(buf_end(buf), data, n);
+  buf->sz += n;
+  body->pos += n;
+}
+
+// prepare the next part header of multipart/byteranges in buf
+static void prepare_part_hdr(conn_t* conn) {
+
+  resp_t* resp = conn->resp;
+
+  buf_reset(conn->buf);
+  conn->buf->sz = resp_part_hdr(resp, resp->range_idx, conn->buf->data);
+  resp->phase = RESP_PART;
+
+  if (resp->range_idx < resp->n_ranges)
+    resp->mmbuf->pos = resp->ranges[resp->range_idx].first;
+  coalesce_body(conn);
+}
+
+int cn_build_static(conn_t* conn, const conf_t* conf) {
 #if DEBUG >= 1
-  log_line("[prepare_static] %d", conn->fd);
+  log_line("[build_static] %d", conn->fd);
 #endif
 
-  /* Try to build response */
   if (!resp_build(conn->resp, conn->req, conf))
+    return -1;
+
+  // zero-copy body, if it's from file and not encrypted by us
+  resp_t* resp = conn->resp;
+  resp->sendfile = conf->sendfile && conn->req->method == M_GET &&
+                   resp->mmbuf && resp->mmbuf->fd >= 0 &&
+                   (!conn->ssl || BIO_get_ktls_send(SSL_get_wbio(conn->ssl)));
+
+  // so that the event loop won't fault on the first window
+  if (conn->req->method == M_GET && resp->mmbuf) {
+    if (resp->n_ranges > 1)
+      resp->mmbuf->pos = resp->ranges[0].first;
+    mmbuf_prefault(resp->mmbuf);
+  }
+
+  return 1;
+}
+
+int cn_prepare_static_header(conn_t* conn, int built, ErrCb err_cb) {
+#if DEBUG >= 1
+  log_line("[prepare_static] %d", conn->fd);
+#endif
+
+  if (built < 0)
     return err_cb(conn, conn->resp->status);
 
   /* prepare header */
   conn->resp->phase = RESP_HEADER;
   buf_reset(conn->buf);
   conn->buf->sz = resp_hdr(conn->resp, conn->buf->data);
+  coalesce_body(conn);
+  // hold header back until body fills up the packet
+  if (conn->resp->sendfile)
+    cork(conn, true);
 
 #if DEBUG >= 1
   log_line("[prepare_static] Serving static page for %d.", conn->fd);
@@ -335,7 +553,9 @@ static int cn_send_error_page(conn_t* conn, SuccCb succ_cb, FatCb fat_cb) {
   /**** send ****/
 
   ssize_t rsize = buf_end(buf) - buf->data_p;
-  ssize_t rc = smart_send(conn->ssl, conn->fd, buf->data_p, rsize);
+  ssize_t rc = smart_send(conn, buf->data_p, rsize);
+  if (rc == CN_AGAIN)
+    return 1;
   if (rc <= 0) {
     log_errln("Error sending error msg.");
     return fat_cb(conn);
@@ -348,17 +568,68 @@ static int cn_send_error_page(conn_t* conn, SuccCb succ_cb, FatCb fat_cb) {
   return 1;
 }
 
+/**
+ * @brief Send header in buf, along with body if it follows.
+ * @param conn Connection.
+ * @return Bytes sent.
+ *         CN_AGAIN if it would block.
+ *        -1 if error occurs.
+ *
+ * Plain conns send header and the first window of body in one writev,
+ * so that small files go out in one packet. Body of ssl conns has been
+ * copied into buf by coalesce_body already.
+ */
+static ssize_t send_header(conn_t* conn) {
+
+  buf_t* buf = conn->buf;
+  ssize_t rsize = buf_rsize(buf);
+
+  if (conn->ssl || conn->resp->sendfile || !body_follows(conn)) {
+    ssize_t rc = smart_send(conn, buf->data_p, rsize);
+    if (rc > 0)
+      buf->data_p += rc;
+    return rc;
+  }
+
+  mmbuf_t* body = conn->resp->mmbuf;
+  struct iovec iov[2];
+  iov[0].iov_base = buf->data_p;
+  iov[0].iov_len = rsize;
+  iov[1].iov_base = mmbuf_peek(body, min(BUFSZ, resp_body_rsize(conn->resp)),
+                               &iov[1].iov_len);
+  if (!iov[1].iov_base)
+    return -1;
+
+  ssize_t rc = writev(conn->fd, iov, 2);
+  if (rc < 0) {
+    if (would_block())
+      return CN_AGAIN;
+    log_errln("[send_header %d] %s.", conn->fd, strerror(errno));
+    errno = 0;
+    return rc;
+  }
+
+  buf->data_p += min(rc, rsize);
+  if (rc > rsize)
+    body->pos += rc - rsize;
+  return rc;
+}
+
 int cn_serve_static(conn_t* conn, SuccCb succ_cb, FatCb fat_cb) {
 
-  if (conn->resp->phase == RESP_ABORT)
+  resp_t* resp = conn->resp;
+  ssize_t rc;
+
+  if (resp->phase == RESP_ABORT)
     return cn_send_error_page(conn, succ_cb, fat_cb);
 
-  if (conn->resp->phase == RESP_HEADER) {
-    buf_t* buf = conn->buf;
-    ssize_t rsize = buf_end(buf) - buf->data_p;
+  // header, or part header of multipart/byteranges
+  if (resp->phase == RESP_HEADER || resp->phase == RESP_PART) {
 
-    ssize_t rc = smart_send(conn->ssl, conn->fd, buf->data_p, rsize);
+    rc = send_header(conn);
 
+    if (rc == CN_AGAIN)
+      return 1;
     if (rc <= 0) {
 #if DEBUG >= 1
       log_line("[cn_serve_static] Error when sending to %d.", conn->fd);
@@ -370,24 +641,41 @@ int cn_serve_static(conn_t* conn, SuccCb succ_cb, FatCb fat_cb) {
     log_line("[cn_serve_static] Sent %zd bytes of header to %d", rc, conn->fd);
 #endif
 
-    buf->data_p += rc;
-    if (rc == rsize)
-      conn->resp->phase = RESP_BODY;
-    if (conn->req->method == M_HEAD ||
-        conn->resp->mmbuf->data_p >= buf_end(conn->resp->mmbuf))
-      return succ_cb(conn);
+    if (buf_rsize(conn->buf) > 0)
+      return 1;
 
-    // only do one send at a time, so return early.
-    return 1;
-  }
+    if (!body_follows(conn)) {
+      // no body for HEAD, 304 or empty file,
+      // or the closing boundary is sent
+      if (resp->phase == RESP_PART || resp->n_ranges <= 1) {
+        if (resp->sendfile)
+          cork(conn, false);
+        return succ_cb(conn);
+      }
+      // multipart starts with part header
+      prepare_part_hdr(conn);
+      return 1;
+    }
+
+    resp->phase = RESP_BODY;
 
-  if (conn->resp->phase == RESP_BODY) {
-    buf_t* buf = conn->resp->mmbuf;
-    ssize_t rsize = buf_end(buf) - buf->data_p;
-    ssize_t asize = min(BUFSZ, rsize);
+  } else if (resp->phase == RESP_BODY) {
 
-    ssize_t rc = smart_send(conn->ssl, conn->fd, buf->data_p, asize);
+    mmbuf_t* body = resp->mmbuf;
 
+    if (resp->sendfile) {
+      rc = send_file(conn, min(CN_SENDFILESZ, resp_body_rsize(resp)));
+    } else {
+      size_t asize;
+      size_t want = conn->ssl ? CN_SSLCHUNK : BUFSZ;
+      void* data = mmbuf_peek(body, min(want, resp_body_rsize(resp)), &asize);
+      if (!data)
+        return fat_cb(conn);
+      rc = smart_send(conn, data, asize);
+    }
+
+    if (rc == CN_AGAIN)
+      return 1;
     if (rc <= 0) {
 #if DEBUG >= 1
       if (rc < 0)
@@ -402,43 +690,130 @@ int cn_serve_static(conn_t* conn, SuccCb succ_cb, FatCb fat_cb) {
     log_line("[cn_serve_static] Sent %zd bytes of body to %d", rc, conn->fd);
 #endif
 
-    buf->data_p += rc;
-    if (buf->data_p >= buf_end(buf))
-      return succ_cb(conn);
+    body->pos += rc;
+
+  } else {
+    return 1;
   }
 
-  return 1;
+  // current range is not done yet
+  if (resp_body_rsize(resp) > 0)
+    return 1;
+
+  // move on to the next range
+  if (resp->n_ranges > 1) {
+    resp->range_idx++;
+    prepare_part_hdr(conn);
+    return 1;
+  }
+
+  // push out what's held back
+  if (resp->sendfile)
+    cork(conn, false);
+
+  return succ_cb(conn);
+}
+
+// check if output of CGI may be gzip'd for req
+static bool cgi_gzip_allowed(const req_t* req, const conf_t* conf) {
+  // chunked coding is needed, so it has to be HTTP/1.1.
+  return conf->gzip_level > 0 && (req->encodings & ENC_GZIP) &&
+         req->method != M_HEAD && !strcmp(req->version, "HTTP/1.1");
+}
+
+// answer from the micro-cache, the way a static response is sent
+static void serve_cached(conn_t* conn, mc_ent_t* ent) {
+
+  resp_t* resp = conn->resp;
+  resp->status = 200;
+  resp->alive = conn->req->alive;
+  resp->clen = ent->sz;
+  resp->ment = ent;
+  resp->mmbuf = mmbuf_wrap(ent->body, ent->sz);
+  mc_ent_hdrs(ent, resp->hdrs);
+
+  conn->cgi->phase = CGI_DISABLED;
+  cn_prepare_static_header(conn, 1, NULL);
+}
+
+// give up running CGI, and respond with status
+static int cgi_refuse(conn_t* conn, int status, ErrCb err_cb) {
+  cq_leave(&conn->cgi->q);
+  mc_cap_free(conn->cgi->cap);
+  conn->cgi->cap = NULL;
+  conn->cgi->phase = CGI_ABORT;
+  conn->resp->phase = RESP_ABORT;
+  return err_cb(conn, status);
 }
 
 int cn_init_cgi(conn_t* conn, const conf_t* conf,
                 SuccCb succ_cb, ErrCb err_cb) {
-  if (cgi_init(conn->cgi, conn->req, conf)) {
-    conn->cgi->phase = CGI_SRV_TO_CGI;
-    return succ_cb(conn);
-  } else {
-    conn->cgi->phase = CGI_ABORT;
-    conn->resp->phase = RESP_ABORT;
-    return err_cb(conn, 500);
+
+  req_t* req = conn->req;
+  cgi_t* cgi = conn->cgi;
+
+  // first time here; try cache, then ask for a slot.
+  if (cgi->q.state == CQ_IDLE) {
+    char key[MC_KEYSZ];
+    long ttl = mc_key(req, conf, key);
+
+    if (ttl >= 0) {
+      mc_ent_t* ent = mc_lookup(key);
+      if (ent) {
+        serve_cached(conn, ent);
+        return succ_cb(conn);
+      }
+      cgi->cap = mc_cap_new(key, ttl, conf);
+    }
+
+    // queue is full
+    if (!cq_enter(&cgi->q, req->uri))
+      return cgi_refuse(conn, 503, err_cb);
   }
+
+  // parked in CGI_READY till the event loop admits it
+  if (cgi->q.state == CQ_WAITING)
+    return 1;
+  if (cgi->q.state == CQ_EXPIRED)
+    return cgi_refuse(conn, 503, err_cb);
+
+  if (!cgi_init(cgi, req, conf))
+    return cgi_refuse(conn, cgi->proxy || conf->fastcgi ? 502 : 500,
+                      err_cb);
+
+  cgi->phase = CGI_SRV_TO_CGI;
+
+  // output may come as CGI header to be rewritten, be gzip'd, or
+  // be cached; have a look at its header first.
+  cgi->out_phase = OUT_HEADER;
+
+  return succ_cb(conn);
 }
 
 int cn_stream_to_cgi(conn_t* conn, ErrCb err_cb) {
 
   ssize_t rsize = buf_end(conn->buf) - conn->buf->data_p;
 
-  // we trust cgi's not blocking
-  // TODO: do we?
   while (rsize > 0) {
-    ssize_t sz = write(conn->cgi->srv_out, conn->buf->data_p, rsize);
-    if (sz <= 0)
-      return err_cb(conn, 500);
+    ssize_t sz = cgi_write(conn->cgi, conn->buf->data_p, rsize);
 
-    rsize -= sz;
+    // pipe is full; the rest waits in buf till it drains.
+    if (sz == CGI_AGAIN)
+      return 1;
+
+    if (sz <= 0) {
+      conn->cgi->phase = CGI_ABORT;
+      bool remote = conn->cgi->fastcgi || conn->cgi->proxy;
+      return err_cb(conn, remote ? 502 : 500);
+    }
 
 #if DEBUG >= 2
     log_line("[stream to cgi]");
     log_raw(conn->buf->data_p, sz);
 #endif
+
+    conn->buf->data_p += sz;
+    rsize -= sz;
   }
 
   // reset buffer in order to recv
@@ -447,16 +822,324 @@ int cn_stream_to_cgi(conn_t* conn, ErrCb err_cb) {
   return 1;
 }
 
-int cn_stream_from_cgi(conn_t* conn, ErrCb err_cb) {
+// check if CGI output is worth gzip'ing, given its header
+static bool cgi_gzip_worthy(const cgi_t* cgi, const conf_t* conf) {
+
+  if (cgi->status != 200 ||
+      hdr_get(cgi->hdrs, "Content-Encoding") ||
+      hdr_get(cgi->hdrs, "Transfer-Encoding"))
+    return false;
+
+  hdr_t* ctype = hdr_get(cgi->hdrs, "Content-Type");
+  if (!ctype || !conf_gzip_type(conf, ctype->val))
+    return false;
+
+  hdr_t* clen = hdr_get(cgi->hdrs, "Content-Length");
+  if (clen && atol(clen->val) < conf->gzip_min_length)
+    return false;
+
+  return true;
+}
+
+// chunk size line, e.g. 1ff0\r\n
+#define CHUNK_HDRSZ 8
+// last chunk
+#define CHUNK_LAST "0" CRLF CRLF
+// max size of header to be rewritten; the rewritten one has to fit
+// into buf along with body read so far.
+#define CGI_HDRSZ (BUFSZ / 2)
+
+// max bytes moved by a splice; it's bounded by the pipe anyway.
+#define CGI_SPLICESZ (1 << 20)
+
+// raw output of a forked CGI goes to a plaintext client as is,
+// so it's moved by splice rather than through conn->buf.
+static bool cgi_splice_ok(conn_t* conn) {
+  return !conn->ssl && !conn->cgi->fastcgi && !conn->cgi->proxy &&
+         !conn->cgi->cap && conn->cgi->out_phase == OUT_RAW;
+}
+
+// keep body from CGI for the micro-cache; n of 0 means it's over.
+static void cgi_capture(cgi_t* cgi, const void* data, size_t n) {
+  if (!cgi->cap)
+    return;
+  if (n == 0) {
+    mc_cap_end(cgi->cap);
+    cgi->cap = NULL;
+  } else if (!mc_cap_body(cgi->cap, data, n)) {
+    mc_cap_free(cgi->cap);
+    cgi->cap = NULL;
+  }
+}
+
+// frame n bytes of data into a chunk appended to buf
+// data may lie in buf, past its end.
+static void append_chunk(buf_t* buf, const void* data, size_t n) {
+  char line[32];
+  int len = sprintf(line, "%zx" CRLF, n);
+  memmove(buf_end(buf) + len, data, n);
+  memcpy(buf_end(buf), line, len);
+  buf->sz += len + n;
+  memcpy(buf_end(buf), CRLF, 2);
+  buf->sz += 2;
+}
+
+// append the last chunk to buf; CGI output is over.
+static void append_last_chunk(conn_t* conn) {
+  buf_t* buf = conn->buf;
+  memcpy(buf_end(buf), CHUNK_LAST, strlen(CHUNK_LAST));
+  buf->sz += strlen(CHUNK_LAST);
+  conn->cgi->phase = CGI_DONE;
+}
+
+// compress what's fed so far into a chunk appended to buf
+static void append_gzip_chunk(conn_t* conn) {
+
+  buf_t* buf = conn->buf;
+  zs_t* zs = conn->cgi->zs;
+
+  // leave room for chunk framing
+  char* data = buf_end(buf) + CHUNK_HDRSZ;
+  size_t cap = BUFSZ - buf->sz - CHUNK_HDRSZ - strlen(CRLF CHUNK_LAST);
+  size_t n = zs_drain(zs, data, cap);
+
+  if (n > 0)
+    append_chunk(buf, data, n);
+
+  if (zs->done)
+    append_last_chunk(conn);
+}
+
+// Rewrite CGI header into a response header in buf, followed by body
+// of size n read so far, which lies at the end of buf; over tells if
+// that's all of it.
+// Body without length is framed in chunks, or ended by closing conn.
+static void rewrite_cgi_hdr(conn_t* conn, size_t n, bool over) {
+
+  cgi_t* cgi = conn->cgi;
+  req_t* req = conn->req;
+  buf_t* buf = conn->buf;
+
+  bool bodyless = req->method == M_HEAD ||
+                  cgi->status == 204 || cgi->status == 304;
+  bool chunked = !bodyless &&
+                 !hdr_get(cgi->hdrs, "Content-Length") &&
+                 !hdr_get(cgi->hdrs, "Transfer-Encoding");
+
+  if (chunked && strcmp(req->version, "HTTP/1.1")) {
+    chunked = false;
+    req->alive = false;
+  }
+  if (chunked)
+    hdr_append(cgi->hdrs, hdr_new("Transfer-Encoding", "chunked"));
+  if (!req->alive) {
+    hdr_del(cgi->hdrs, "Connection");
+    hdr_append(cgi->hdrs, hdr_new("Connection", "close"));
+  }
+
+  char* body = (char*) buf->data + BUFSZ - n;
+  buf_reset(buf);
+  buf->sz = cgi_pack_hdr(cgi, buf->data);
+
+  if (!chunked) {
+    memmove(buf_end(buf), body, n);
+    buf->sz += n;
+    if (over)
+      cgi->phase = CGI_DONE;
+    cgi->out_phase = OUT_RAW;
+    return;
+  }
+
+  if (n > 0)
+    append_chunk(buf, body, n);
+  if (over)
+    append_last_chunk(conn);
+  cgi->out_phase = OUT_CHUNKED;
+}
+
+// Collect header of CGI output, and decide how to relay the rest.
+static int stream_cgi_hdr(conn_t* conn, const conf_t* conf, ErrCb err_cb) {
+
+  cgi_t* cgi = conn->cgi;
+  buf_t* buf = conn->buf;
+  int err = cgi->fastcgi || cgi->proxy ? 502 : 500;
+
+  ssize_t n = cgi_read(cgi, buf_end(buf), CGI_HDRSZ - buf->sz);
+  if (n == CGI_AGAIN)
+    return 1;
+  if (n < 0) {
+    cgi->phase = CGI_ABORT;
+    return err_cb(conn, err);
+  }
+  buf->sz += n;
+
+  ssize_t hsz = cgi_parse_hdr(cgi, buf->data, buf->sz);
+
+  // wait for the rest of header
+  if (hsz == 0 && n > 0 && buf->sz < CGI_HDRSZ)
+    return 1;
+
+  // only NPH output can go without being parsed
+  if (hsz <= 0 && (cgi->proxy || buf->sz < 5 ||
+                   strncmp((char*) buf->data, "HTTP/", 5))) {
+    log_errln("[stream_cgi_hdr] malformed header from cgi.");
+    cgi->phase = CGI_ABORT;
+    return err_cb(conn, err);
+  }
+
+  // body from upstream comes unframed, to be framed anew for client
+  if (cgi->proxy) {
+    cgi->nph = false;
+    px_strip_hdrs(cgi->hdrs);
+  }
+
+  // cacheable output is kept as is, rather than gzip'd
+  if (cgi->cap) {
+    if (hsz > 0 && mc_cap_hdr(cgi->cap, cgi->status, cgi->hdrs, conf)) {
+      cgi_capture(cgi, (char*) buf->data + hsz, buf->sz - hsz);
+      if (n == 0)
+        cgi_capture(cgi, NULL, 0);
+    } else {
+      mc_cap_free(cgi->cap);
+      cgi->cap = NULL;
+    }
+  }
+
+  if (hsz > 0 && !cgi->cap && cgi_gzip_allowed(conn->req, conf) &&
+      cgi_gzip_worthy(cgi, conf))
+    cgi->zs = zs_new(conf->gzip_level);
+
+  cgi->buf_phase = BUF_SEND;
+
+  // relay as is
+  if (!cgi->zs && (hsz <= 0 || cgi->nph)) {
+    cgi->out_phase = OUT_RAW;
+    if (n == 0)
+      cgi->phase = CGI_DONE;
+    return 1;
+  }
+
+  // move body so far out of the way of rewritten header
+  size_t body = buf->sz - hsz;
+  memmove((char*) buf->data + BUFSZ - body, (char*) buf->data + hsz, body);
+
+  if (!cgi->zs) {
+    rewrite_cgi_hdr(conn, body, n == 0);
+    return 1;
+  }
+
+  // feed body so far to compressor
+  memcpy(cgi->zs->in->data, (char*) buf->data + BUFSZ - body, body);
+  zs_feed(cgi->zs, body);
+  if (n == 0)
+    zs_finish(cgi->zs);
+
+  // length is unknown until compressed
+  hdr_del(cgi->hdrs, "Content-Length");
+  hdr_append(cgi->hdrs, hdr_new("Content-Encoding", "gzip"));
+  hdr_append(cgi->hdrs, hdr_new("Transfer-Encoding", "chunked"));
+  hdr_t* vary = hdr_get(cgi->hdrs, "Vary");
+  if (!vary)
+    hdr_append(cgi->hdrs, hdr_new("Vary", "Accept-Encoding"));
+  else if (strlen(vary->val) + 20 < HDR_VALSZ)
+    strcat(vary->val, ", Accept-Encoding");
+
+  buf_reset(buf);
+  buf->sz = cgi_pack_hdr(cgi, buf->data);
+  append_gzip_chunk(conn);
+
+  cgi->out_phase = OUT_GZIP;
+  return 1;
+}
+
+// Compress CGI output into a chunk.
+static int stream_cgi_gzip(conn_t* conn, ErrCb err_cb) {
+
+  cgi_t* cgi = conn->cgi;
+  zs_t* zs = cgi->zs;
+
+  if (zs_hungry(zs)) {
+    ssize_t n = cgi_read(cgi, zs->in->data, ZS_INSZ);
+    if (n == CGI_AGAIN)
+      return 1;
+    if (n < 0) {
+      cgi->phase = CGI_ABORT;
+      return err_cb(conn, 500);
+    }
+    if (n == 0)
+      zs_finish(zs);
+    else
+      zs_feed(zs, n);
+  }
+
+  buf_reset(conn->buf);
+  append_gzip_chunk(conn);
+  if (conn->buf->sz > 0)
+    cgi->buf_phase = BUF_SEND;
+
+  return 1;
+}
+
+// Frame CGI output into a chunk.
+static int stream_cgi_chunked(conn_t* conn, ErrCb err_cb) {
+
+  cgi_t* cgi = conn->cgi;
+  buf_t* buf = conn->buf;
+
+  // leave room for chunk framing
+  buf_reset(buf);
+  char* data = (char*) buf->data + CHUNK_HDRSZ;
+  size_t cap = BUFSZ - CHUNK_HDRSZ - strlen(CRLF CHUNK_LAST);
+  ssize_t n = cgi_read(cgi, data, cap);
+  if (n == CGI_AGAIN)
+    return 1;
+  if (n < 0) {
+    cgi->phase = CGI_ABORT;
+    return err_cb(conn, 500);
+  }
+
+  cgi_capture(cgi, data, n);
+  if (n > 0)
+    append_chunk(buf, data, n);
+  else
+    append_last_chunk(conn);
+
+  cgi->buf_phase = BUF_SEND;
+  return 1;
+}
+
+int cn_stream_from_cgi(conn_t* conn, const conf_t* conf, ErrCb err_cb) {
+
+  if (conn->cgi->out_phase == OUT_HEADER)
+    return stream_cgi_hdr(conn, conf, err_cb);
+
+  if (conn->cgi->out_phase == OUT_GZIP)
+    return stream_cgi_gzip(conn, err_cb);
+
+  if (conn->cgi->out_phase == OUT_CHUNKED)
+    return stream_cgi_chunked(conn, err_cb);
+
+  // output is readable; it's spliced once client is writable.
+  if (cgi_splice_ok(conn)) {
+    buf_reset(conn->buf);
+    conn->cgi->buf_phase = BUF_SEND;
+    return 1;
+  }
 
-  conn->buf->sz = read(conn->cgi->srv_in, conn->buf->data, BUFSZ);
+  buf_reset(conn->buf);
+  ssize_t n = cgi_read(conn->cgi, conn->buf->data, BUFSZ);
+
+  if (n == CGI_AGAIN)
+    return 1;
 
-  if (conn->buf->sz < 0) {
+  if (n < 0) {
     conn->cgi->phase = CGI_ABORT;
     return err_cb(conn, 500);
   }
 
-  if (conn->buf->sz == 0)
+  conn->buf->sz = n;
+  cgi_capture(conn->cgi, conn->buf->data, n);
+  if (n == 0)
     conn->cgi->phase = CGI_DONE;
 
   conn->cgi->buf_phase = BUF_SEND;
@@ -464,22 +1147,64 @@ int cn_stream_from_cgi(conn_t* conn, ErrCb err_cb) {
   return 1;
 }
 
+// splice output of CGI to client
+static int serve_cgi_splice(conn_t* conn, SuccCb succ_cb, FatCb fat_cb) {
+
+  ssize_t rc = cgi_splice(conn->cgi, conn->fd, CGI_SPLICESZ);
+
+  // most likely the pipe is drained; wait for it.
+  // if it's the socket that is full, the pipe is ready right away,
+  // and we come back here once the socket is writable.
+  if (rc == CGI_AGAIN) {
+    conn->cgi->buf_phase = BUF_RECV;
+    return 1;
+  }
+
+  if (rc < 0) {
+    log_errln("[serve_cgi_splice %d] %s.", conn->fd, strerror(errno));
+    return fat_cb(conn);
+  }
+
+  if (rc == 0) {
+    conn->cgi->phase = CGI_DONE;
+    return succ_cb(conn);
+  }
+
+#if DEBUG >= 1
+  log_line("[serve_cgi_splice %d] %zd bytes.", conn->fd, rc);
+#endif
+
+  return 1;
+}
+
 int cn_serve_dynamic(conn_t* conn, SuccCb succ_cb, FatCb fat_cb) {
 
   buf_t* buf = conn->buf;
   ssize_t rsize = buf_end(buf) - buf->data_p;
 
-  if (rsize == 0 && conn->cgi->phase == CGI_DONE)
-    return succ_cb(conn);
+  if (rsize == 0 && conn->cgi->phase == CGI_CGI_TO_SRV &&
+      cgi_splice_ok(conn))
+    return serve_cgi_splice(conn, succ_cb, fat_cb);
 
-  ssize_t rc = smart_send(conn->ssl, conn->fd, buf->data_p, rsize);
-  if (rc <= 0) {
-    return fat_cb(conn);
+  if (rsize > 0) {
+    ssize_t rc = smart_send(conn, buf->data_p, rsize);
+    if (rc == CN_AGAIN)
+      return 1;
+    if (rc <= 0)
+      return fat_cb(conn);
+    buf->data_p += rc;
+    rsize -= rc;
   }
 
-  rsize -= rc;
-  if (rsize == 0)
-    conn->cgi->buf_phase = BUF_RECV;
+  // only part of it is sent
+  if (rsize > 0)
+    return 1;
+
+  if (conn->cgi->phase == CGI_DONE)
+    return succ_cb(conn);
+
+  buf_reset(buf);
+  conn->cgi->buf_phase = BUF_RECV;
 
   return 1;
 }
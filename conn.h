@@ -16,6 +16,13 @@
 #include "request.h"
 #include "response.h"
 #include "cgi.h"
+#include "worker.h"
+#include "tls.h"
+
+// a tls op that waits for the socket the other way round, e.g. a
+// handshake step driven by recv that has to write.
+#define CN_RECV_WANTS_WRITE 1
+#define CN_SEND_WANTS_READ 2
 
 /* conn_t */
 typedef struct {
@@ -35,6 +42,12 @@ typedef struct {
   SSL* ssl;
   // ssl accept status
   bool ssl_accepted;
+  // CN_*_WANTS_* if the last tls op stalled that way; 0 otherwise.
+  int ssl_stall;
+  // record sizing
+  tls_rec_t rec;
+  // job run by worker on behalf of the conn
+  wk_job_t job;
 } conn_t;
 
 /**
@@ -83,6 +96,24 @@ void cn_free(conn_t* conn);
  */
 int cn_init_ssl(conn_t* conn, SSL_CTX* ctx);
 
+// check if tls holds data received but not read yet; the socket
+// won't be readable for it.
+bool cn_pending(conn_t* conn);
+
+/**
+ * @brief Take a step of ssl handshake.
+ * @param conn Connection.
+ * @return 1 if handshake is done.
+ *         0 if it waits for client to send.
+ *         2 if it waits for socket to be writable.
+ *        -1 if error occurs; conn should be dropped.
+ *
+ * It may take a while on private key, so it's meant to run on a worker
+ * thread, and only touches ssl of conn; ssl_accepted is left to the
+ * event loop, which reads it while the step is going on.
+ */
+int cn_handshake(conn_t* conn);
+
 /**
  * @brief Recv content from client.
  * @param conn Connection.
@@ -102,13 +133,25 @@ int cn_recv(conn_t* conn, ErrCb err_cb, FatCb fat_cb);
 int cn_parse_req(conn_t* conn, void* last_recv_end, ErrCb err_cb);
 
 /**
- * @brief Prepare static header in buffer.
+ * @brief Build static response, and fault in the beginning of body.
  * @param conn Connection.
  * @param conf Global configurations.
+ * @return 1 if success.
+ *        -1 if error occurs; resp->status tells why.
+ *
+ * It may block on disk, so it's meant to run on a worker thread, and
+ * only touches req and resp of conn.
+ */
+int cn_build_static(conn_t* conn, const conf_t* conf);
+
+/**
+ * @brief Prepare static header in buffer.
+ * @param conn Connection.
+ * @param built Result of cn_build_static.
  * @param err_cb Error callback.
  * @return 1 always.
  */
-int cn_prepare_static_header(conn_t* conn, const conf_t* conf, ErrCb err_cb);
+int cn_prepare_static_header(conn_t* conn, int built, ErrCb err_cb);
 
 /**
  * @brief Serve static page to client.
@@ -133,6 +176,10 @@ int cn_init_cgi(conn_t* conn, const conf_t* conf,
 
 /**
  * @brief Stream body to CGI
+ *
+ * Takes as much as the pipe does; what's left stays in conn->buf
+ * until it drains, and no more is received from client meanwhile.
+ *
  * @param conn Connection
  * @param err_cb Error callback
  * @return 1 always
@@ -142,10 +189,13 @@ int cn_stream_to_cgi(conn_t* conn, ErrCb err_cb);
 /**
  * @brief Stream response from CGI
  * @param conn Connection
+ * @param conf Global configurations
  * @param err_cb Error callback
  * @return 1 always
+ *
+ * Output may be gzip'd, if client accepts it.
  */
-int cn_stream_from_cgi(conn_t* conn, ErrCb err_cb);
+int cn_stream_from_cgi(conn_t* conn, const conf_t* conf, ErrCb err_cb);
 
 /**
  * @brief Serve dynamic content to client
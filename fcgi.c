@@ -0,0 +1,347 @@
+/**
+ * @file fcgi.c
+ * @brief Implementation of fcgi.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <errno.h>
+#include <sys/socket.h>
+#include "fcgi.h"
+#include "logging.h"
+
+// record types
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+
+#define FCGI_VERSION 1
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+// one request per conn, so the id is always the same
+#define FCGI_ID 1
+// max content of a record
+#define FCGI_MAXCONTENT 65535
+#define FCGI_HDRSZ 8
+
+// address of backend
+static struct sockaddr_storage addr;
+static socklen_t addrlen = 0;
+
+// idle conns to backend
+static int* idle = NULL;
+static int n_idle = 0;
+static int max_idle = 0;
+
+bool fcgi_init(const char* str, int keepalive) {
+
+  if (!sockaddr_parse(str, &addr, &addrlen))
+    return false;
+
+  max_idle = keepalive;
+  idle = malloc(sizeof(int) * max(keepalive, 1));
+  return true;
+}
+
+void fcgi_reset(fcgi_t* fcgi) {
+  fcgi->fd = -1;
+  fcgi->hdr_got = 0;
+  fcgi->type = 0;
+  fcgi->left = 0;
+  fcgi->pad = 0;
+  fcgi->ended = false;
+  fcgi->connecting = false;
+  fcgi->staged = NULL;
+  fcgi->staged_p = 0;
+  fcgi->staged_sz = 0;
+  fcgi->ohdr_left = 0;
+  fcgi->out_left = 0;
+}
+
+// check if an idle conn is still open; backend may have closed it.
+static bool still_open(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// lease an idle conn, or start connecting a new one
+// return the fd; -1 if backend is unreachable right away.
+static int lease(bool* connecting) {
+
+  *connecting = false;
+  while (n_idle > 0) {
+    int fd = idle[--n_idle];
+    if (still_open(fd))
+      return fd;
+    close(fd);
+  }
+
+  int fd = sock_connect(&addr, addrlen);
+  if (fd < 0) {
+    log_errln("[fcgi] cannot connect to backend: %s", strerror(errno));
+    return -1;
+  }
+  *connecting = true;
+
+#if DEBUG >= 1
+  log_line("[fcgi] connecting to backend at %d.", fd);
+#endif
+
+  return fd;
+}
+
+// fill in header of a record of type with content of size n
+static void fill_hdr(unsigned char* hdr, int type, size_t n) {
+  hdr[0] = FCGI_VERSION;
+  hdr[1] = type;
+  hdr[2] = 0;
+  hdr[3] = FCGI_ID;
+  hdr[4] = n >> 8;
+  hdr[5] = n & 0xff;
+  hdr[6] = 0;
+  hdr[7] = 0;
+}
+
+// stage a record of type with content of size n
+static void stage_record(fcgi_t* fcgi, int type, const void* data,
+                         size_t n) {
+  fcgi->staged = realloc(fcgi->staged, fcgi->staged_sz + FCGI_HDRSZ + n);
+  unsigned char* p = fcgi->staged + fcgi->staged_sz;
+  fill_hdr(p, type, n);
+  if (n > 0)
+    memcpy(p + FCGI_HDRSZ, data, n);
+  fcgi->staged_sz += FCGI_HDRSZ + n;
+}
+
+// append length of a name or value to p
+static unsigned char* put_len(unsigned char* p, size_t len) {
+  if (len < 128) {
+    *p++ = len;
+  } else {
+    *p++ = (len >> 24) | 0x80;
+    *p++ = len >> 16;
+    *p++ = len >> 8;
+    *p++ = len;
+  }
+  return p;
+}
+
+// stage envp as name-value pairs, followed by an empty PARAMS record
+static void stage_params(fcgi_t* fcgi, char** envp) {
+
+  unsigned char data[FCGI_MAXCONTENT];
+  unsigned char* p = data;
+
+  int i;
+  for (i = 0; envp[i]; i++) {
+    const char* eq = strchr(envp[i], '=');
+    if (!eq)
+      continue;
+    size_t klen = eq - envp[i];
+    size_t vlen = strlen(eq+1);
+    if (klen + vlen + 8 > FCGI_MAXCONTENT)
+      continue;
+
+    // flush records when it's full
+    if (p - data + klen + vlen + 8 > FCGI_MAXCONTENT) {
+      stage_record(fcgi, FCGI_PARAMS, data, p - data);
+      p = data;
+    }
+
+    p = put_len(p, klen);
+    p = put_len(p, vlen);
+    memcpy(p, envp[i], klen);
+    p += klen;
+    memcpy(p, eq+1, vlen);
+    p += vlen;
+  }
+
+  if (p > data)
+    stage_record(fcgi, FCGI_PARAMS, data, p - data);
+  stage_record(fcgi, FCGI_PARAMS, NULL, 0);
+}
+
+bool fcgi_begin(fcgi_t* fcgi, char** envp) {
+
+  fcgi_reset(fcgi);
+  if ((fcgi->fd = lease(&fcgi->connecting)) < 0)
+    return false;
+
+  unsigned char body[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN};
+  stage_record(fcgi, FCGI_BEGIN_REQUEST, body, sizeof(body));
+  stage_params(fcgi, envp);
+  return true;
+}
+
+// send without blocking
+// return as send; FCGI_AGAIN if the socket is full.
+static ssize_t send_some(int fd, const void* data, size_t n, int flags) {
+  ssize_t sz = send(fd, data, n, flags|MSG_DONTWAIT|MSG_NOSIGNAL);
+  if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return FCGI_AGAIN;
+  if (sz < 0)
+    log_errln("[fcgi_write] %s", strerror(errno));
+  return sz;
+}
+
+// finish connecting, and send what's staged
+// return 1 if it's all sent; FCGI_AGAIN if not yet, -1 if error occurs.
+static int flush_staged(fcgi_t* fcgi) {
+
+  if (fcgi->connecting) {
+    int rc = sock_connected(fcgi->fd);
+    if (rc == 0)
+      return FCGI_AGAIN;
+    if (rc < 0) {
+      log_errln("[fcgi] cannot connect to backend: %s", strerror(errno));
+      return -1;
+    }
+    fcgi->connecting = false;
+  }
+
+  while (fcgi->staged_p < fcgi->staged_sz) {
+    ssize_t sz = send_some(fcgi->fd, fcgi->staged + fcgi->staged_p,
+                           fcgi->staged_sz - fcgi->staged_p, 0);
+    if (sz < 0)
+      return sz;
+    fcgi->staged_p += sz;
+  }
+
+  free(fcgi->staged);
+  fcgi->staged = NULL;
+  return 1;
+}
+
+ssize_t fcgi_write(fcgi_t* fcgi, const void* data, size_t n) {
+
+  // request head goes first
+  if (fcgi->staged || fcgi->connecting) {
+    int rc = flush_staged(fcgi);
+    if (rc != 1)
+      return rc;
+  }
+
+  // start a record with what's given
+  if (fcgi->ohdr_left == 0 && fcgi->out_left == 0) {
+    fcgi->out_left = min(n, FCGI_MAXCONTENT);
+    fill_hdr(fcgi->ohdr, FCGI_STDIN, fcgi->out_left);
+    fcgi->ohdr_left = FCGI_HDRSZ;
+  }
+
+  ssize_t sz;
+  if (fcgi->ohdr_left > 0) {
+    sz = send_some(fcgi->fd, fcgi->ohdr + FCGI_HDRSZ - fcgi->ohdr_left,
+                   fcgi->ohdr_left, n > 0 ? MSG_MORE : 0);
+    if (sz < 0)
+      return sz;
+    fcgi->ohdr_left -= sz;
+    if (fcgi->ohdr_left > 0)
+      return FCGI_AGAIN;
+  }
+
+  // the empty record is sent
+  if (fcgi->out_left == 0)
+    return 0;
+
+  sz = send_some(fcgi->fd, data, min(n, fcgi->out_left), 0);
+  if (sz > 0)
+    fcgi->out_left -= sz;
+  return sz;
+}
+
+// receive into data without blocking
+// return as recv; FCGI_AGAIN if nothing yet, -1 on eof as well.
+static ssize_t recv_some(fcgi_t* fcgi, void* data, size_t n) {
+  ssize_t sz = recv(fcgi->fd, data, n, MSG_DONTWAIT);
+  if (sz > 0)
+    return sz;
+  if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return FCGI_AGAIN;
+  if (sz == 0)
+    log_errln("[fcgi_read] backend closed %d in the middle.", fcgi->fd);
+  else
+    log_errln("[fcgi_read] %s", strerror(errno));
+  return -1;
+}
+
+ssize_t fcgi_read(fcgi_t* fcgi, void* data, size_t n) {
+
+  char skip[1024];
+  ssize_t sz;
+
+  while (!fcgi->ended) {
+
+    /* header */
+    if (fcgi->hdr_got < FCGI_HDRSZ) {
+      sz = recv_some(fcgi, fcgi->hdr + fcgi->hdr_got,
+                     FCGI_HDRSZ - fcgi->hdr_got);
+      if (sz < 0)
+        return sz;
+      fcgi->hdr_got += sz;
+      if (fcgi->hdr_got < FCGI_HDRSZ)
+        continue;
+
+      if (fcgi->hdr[0] != FCGI_VERSION) {
+        log_errln("[fcgi_read] bad version %d.", fcgi->hdr[0]);
+        return -1;
+      }
+      fcgi->type = fcgi->hdr[1];
+      fcgi->left = (fcgi->hdr[4] << 8) | fcgi->hdr[5];
+      fcgi->pad = fcgi->hdr[6];
+    }
+
+    /* stdout goes straight to caller */
+    if (fcgi->left > 0 && fcgi->type == FCGI_STDOUT) {
+      sz = recv_some(fcgi, data, min(n, fcgi->left));
+      if (sz > 0)
+        fcgi->left -= sz;
+      return sz;
+    }
+
+    /* anything else is consumed here */
+    if (fcgi->left > 0 || fcgi->pad > 0) {
+      size_t want = fcgi->left > 0 ? fcgi->left : fcgi->pad;
+      sz = recv_some(fcgi, skip, min(want, sizeof(skip)));
+      if (sz < 0)
+        return sz;
+      if (fcgi->left > 0) {
+        if (fcgi->type == FCGI_STDERR) {
+          log_errln("[fcgi %d]", fcgi->fd);
+          log_raw(skip, sz);
+        }
+        fcgi->left -= sz;
+      } else {
+        fcgi->pad -= sz;
+      }
+      continue;
+    }
+
+    /* record is done */
+    fcgi->hdr_got = 0;
+    if (fcgi->type == FCGI_END_REQUEST)
+      fcgi->ended = true;
+  }
+
+  return 0;
+}
+
+void fcgi_end(fcgi_t* fcgi) {
+
+  if (fcgi->fd < 0)
+    return;
+
+  if (fcgi->ended && n_idle < max_idle) {
+    idle[n_idle++] = fcgi->fd;
+#if DEBUG >= 1
+    log_line("[fcgi_end] keep %d alive, %d idle.", fcgi->fd, n_idle);
+#endif
+  } else {
+    close(fcgi->fd);
+  }
+
+  free(fcgi->staged);
+  fcgi_reset(fcgi);
+}
@@ -0,0 +1,109 @@
+/**
+ * @file fcgi.h
+ * @brief FastCGI client.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * Dynamic requests can go to a FastCGI backend, i.e. a long-lived
+ * application process, instead of a CGI script forked per request.
+ * The backend is reached over a Unix or TCP socket. Connections are
+ * kept alive after a request ends, and reused by later ones.
+ *
+ * A request owns the connection until it ends, so all records on it
+ * carry the same request id. Params and stdin are framed into records
+ * on the way out; stdout and stderr are demultiplexed from records on
+ * the way in.
+ *
+ * Nothing blocks the event loop. A new connection may still be going
+ * on as the request begins, so BEGIN_REQUEST and PARAMS are staged,
+ * and go out ahead of stdin once the socket is writable.
+ */
+
+#ifndef FCGI_H
+#define FCGI_H
+
+#include "utils.h"
+
+// returned by fcgi_read if nothing is readable yet
+#define FCGI_AGAIN (-2)
+
+// a request in progress
+typedef struct {
+  // connection to backend; -1 if none
+  int fd;
+  // header of the record being received
+  unsigned char hdr[8];
+  size_t hdr_got;
+  // type of the record being received, and its content and padding left
+  int type;
+  size_t left;
+  size_t pad;
+  // END_REQUEST is received; the connection can be reused.
+  bool ended;
+  // connection is still going on
+  bool connecting;
+  // BEGIN_REQUEST and PARAMS not sent yet; NULL once they are.
+  unsigned char* staged;
+  size_t staged_p;
+  size_t staged_sz;
+  // header of the stdin record being sent, and its content left
+  unsigned char ohdr[8];
+  size_t ohdr_left;
+  size_t out_left;
+} fcgi_t;
+
+/**
+ * @brief Set up the backend.
+ * @param addr Address of backend, `unix:/path` or `host:port`;
+ *             `unix:@name` is an abstract socket.
+ * @param keepalive Max number of idle connections kept.
+ * @return true if normal.
+ *         false if addr is invalid.
+ */
+bool fcgi_init(const char* addr, int keepalive);
+
+// reset a request to be unused
+void fcgi_reset(fcgi_t* fcgi);
+
+/**
+ * @brief Start a request on a connection to backend.
+ * @param fcgi The request.
+ * @param envp Params as `key=value`, NULL terminated.
+ * @return true if normal.
+ *         false if backend is unreachable right away.
+ *
+ * Records are only staged; they are sent by fcgi_write.
+ */
+bool fcgi_begin(fcgi_t* fcgi, char** envp);
+
+/**
+ * @brief Send stdin to backend without blocking, after what's staged.
+ * @param fcgi The request.
+ * @param data Content of stdin; n of 0 closes stdin.
+ * @param n Size of data.
+ * @return Bytes sent; 0 once stdin is closed.
+ *         FCGI_AGAIN if the socket is still connecting, or full.
+ *        -1 if error occurs, e.g. backend is unreachable.
+ *
+ * What's left of data has to be passed again, since a record may have
+ * been started with it.
+ */
+ssize_t fcgi_write(fcgi_t* fcgi, const void* data, size_t n);
+
+/**
+ * @brief Receive stdout from backend.
+ * @param fcgi The request.
+ * @param data Buffer for stdout.
+ * @param n Capacity of data.
+ * @return Bytes received.
+ *         0 if the request has ended.
+ *         FCGI_AGAIN if no stdout is readable yet.
+ *        -1 if error occurs.
+ *
+ * Stderr on the way is logged.
+ */
+ssize_t fcgi_read(fcgi_t* fcgi, void* data, size_t n);
+
+// end a request; its connection is kept alive if it ended cleanly.
+void fcgi_end(fcgi_t* fcgi);
+
+#endif // FCGI_H
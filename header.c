@@ -4,10 +4,11 @@
  * @author Longqi Cai <longqic@andrew.cmu.edu>
  */
 
+#include <strings.h>
 #include "header.h"
 #include "utils.h"
 
-hdr_t* hdr_new(char* key, char* val) {
+hdr_t* hdr_new(const char* key, const char* val) {
   hdr_t* hdr = malloc(sizeof(hdr_t));
   if (key)
     strncpy0(hdr->key, key, HDR_KEYSZ);
@@ -42,3 +43,31 @@ void hdr_reset(hdr_t* hdrs) {
   hdr_free(hdrs->next);
   hdrs->next = NULL;
 }
+
+void hdr_append(hdr_t* hdrs, hdr_t* hdr) {
+  hdr_t* p;
+  for (p = hdrs; p->next; p = p->next);
+  hdr->next = NULL;
+  p->next = hdr;
+}
+
+hdr_t* hdr_get(const hdr_t* hdrs, const char* key) {
+  hdr_t* p;
+  for (p = hdrs->next; p; p = p->next)
+    if (!strcasecmp(p->key, key))
+      return p;
+  return NULL;
+}
+
+void hdr_del(hdr_t* hdrs, const char* key) {
+  hdr_t* p = hdrs;
+  while (p->next) {
+    hdr_t* q = p->next;
+    if (!strcasecmp(q->key, key)) {
+      p->next = q->next;
+      free(q);
+    } else {
+      p = q;
+    }
+  }
+}
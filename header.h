@@ -23,12 +23,18 @@ typedef struct hdr_s {
 } hdr_t;
 
 // create a new header node
-hdr_t* hdr_new(char* key, char* val);
+hdr_t* hdr_new(const char* key, const char* val);
 // destroy the entire list of hdrs
 void hdr_free(hdr_t* hdrs);
 // insert a header into the header list. NOT copying.
 void hdr_insert(hdr_t* hdrs, hdr_t* hdr);
 // reset a list of headers
 void hdr_reset(hdr_t* hdrs);
+// append a header to the end of header list. NOT copying.
+void hdr_append(hdr_t* hdrs, hdr_t* hdr);
+// find the first header with key, case insensitive; NULL if not found.
+hdr_t* hdr_get(const hdr_t* hdrs, const char* key);
+// delete all headers with key, case insensitive
+void hdr_del(hdr_t* hdrs, const char* key);
 
 #endif // HEADER_H
@@ -0,0 +1,153 @@
+/**
+ * @file lb.c
+ * @brief Implementation of lb.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <time.h>
+#include "lb.h"
+#include "logging.h"
+
+static const conf_t* conf = NULL;
+
+static lb_t lbs[LB_MAXBALANCERS];
+static int n_lbs = 0;
+
+void lb_init(const conf_t* c) {
+  conf = c;
+}
+
+static long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+lb_t* lb_new(const char* label) {
+  if (n_lbs >= LB_MAXBALANCERS)
+    return NULL;
+  lb_t* lb = &lbs[n_lbs++];
+  memset(lb, 0, sizeof(lb_t));
+  lb->label = label;
+  return lb;
+}
+
+int lb_add(lb_t* lb, const char* name) {
+  if (lb->n >= LB_MAXBACKENDS)
+    return -1;
+  lb_be_t* be = &lb->be[lb->n];
+  memset(be, 0, sizeof(lb_be_t));
+  be->name = name;
+  return lb->n++;
+}
+
+// bring it back once ejection is over; it starts slow, on its last chance.
+static void reinstate(lb_t* lb, lb_be_t* be, long now) {
+  if (!be->ejected || now < be->ejected)
+    return;
+  be->ejected = 0;
+  be->since = conf->backend_slow_start > 0 ? now : 0;
+  be->fails = conf->backend_max_fails - 1;
+  log_line("[lb] %s %s is back.", lb->label, be->name);
+}
+
+// load it would have with one more, scaled up while it starts slow
+static double load(lb_be_t* be, long now) {
+  double weight = 1;
+  if (be->since) {
+    long up = now - be->since;
+    if (up >= conf->backend_slow_start)
+      be->since = 0;
+    else
+      weight = max(0.1, (double) up / conf->backend_slow_start);
+  }
+  return (be->inflight + 1) / weight;
+}
+
+int lb_pick(lb_t* lb) {
+
+  long now = now_ms();
+  int best = -1;
+  double best_load = 0;
+  bool panic = true;
+
+  int i;
+  for (i = 0; i < lb->n; i++) {
+    reinstate(lb, &lb->be[i], now);
+    if (!lb->be[i].ejected)
+      panic = false;
+  }
+
+  // ties go to the first after the last picked
+  for (i = 0; i < lb->n; i++) {
+    int k = (lb->next + i) % lb->n;
+    lb_be_t* be = &lb->be[k];
+    if (be->ejected && !panic)
+      continue;
+    double l = load(be, now);
+    if (best < 0 || l < best_load) {
+      best = k;
+      best_load = l;
+    }
+  }
+
+  lb->next = (best + 1) % lb->n;
+  lb->be[best].inflight++;
+
+#if DEBUG >= 1
+  log_line("[lb_pick] %s %s, %d in flight.", lb->label,
+           lb->be[best].name, lb->be[best].inflight);
+#endif
+
+  return best;
+}
+
+void lb_done(lb_t* lb, int i, int outcome, long latency) {
+
+  lb_be_t* be = &lb->be[i];
+  be->inflight--;
+  be->n_reqs++;
+
+  if (latency >= 0) {
+    be->n_timed++;
+    be->lat_total += latency;
+    be->lat_max = max(be->lat_max, latency);
+  }
+
+  if (outcome == LB_OK) {
+    be->fails = 0;
+    return;
+  }
+  if (outcome != LB_FAIL)
+    return;
+
+  be->n_fails++;
+  be->fails++;
+  if (be->ejected || conf->backend_max_fails <= 0 ||
+      be->fails < conf->backend_max_fails)
+    return;
+
+  be->ejected = now_ms() + conf->backend_eject_time;
+  be->n_ejects++;
+  log_errln("[lb] %s %s is ejected after %d failures.",
+            lb->label, be->name, be->fails);
+}
+
+void lb_report() {
+  long now = now_ms();
+  int i, j;
+  for (i = 0; i < n_lbs; i++) {
+    lb_t* lb = &lbs[i];
+    for (j = 0; j < lb->n; j++) {
+      lb_be_t* be = &lb->be[j];
+      log_line("[lb_report] %s %s%s: %d in flight; %lu done, %lu failed, "
+               "%lu times ejected; first output in %ld ms on average, "
+               "%ld ms at most.",
+               lb->label, be->name,
+               be->ejected > now ? " (ejected)" : "",
+               be->inflight, be->n_reqs, be->n_fails, be->n_ejects,
+               be->n_timed ? be->lat_total / (long) be->n_timed : 0,
+               be->lat_max);
+    }
+  }
+}
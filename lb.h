@@ -0,0 +1,95 @@
+/**
+ * @file lb.h
+ * @brief Balancing of requests over equivalent backends.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * A balancer holds equivalent backends, e.g. CGI replicas, or upstreams
+ * of a proxy prefix. Each request goes to the one with the fewest in
+ * flight, so that a slow one takes fewer. A backend failing
+ * backend_max_fails times in a row is ejected for backend_eject_time;
+ * when it comes back, its share of load ramps up over
+ * backend_slow_start, and one more failure ejects it again. If all are
+ * ejected, they are all picked from anyway.
+ *
+ * It's used by the event loop only, so there is no lock.
+ */
+
+#ifndef LB_H
+#define LB_H
+
+#include "config.h"
+
+#define LB_MAXBACKENDS 16
+// CGI replicas, and a balancer for each proxy prefix
+#define LB_MAXBALANCERS (CONF_MAXPROXIES + 1)
+
+// how a request went on its backend
+enum {
+  LB_OK=1,
+  LB_FAIL,     // error, timeout, or 5xx
+  LB_UNKNOWN,  // client left before it's known
+};
+
+typedef struct {
+  // script path, or upstream address
+  const char* name;
+  int inflight;
+  // failures in a row
+  int fails;
+  // when it's back from ejection; 0 if it's in
+  long ejected;
+  // when it came back, for slow start; 0 if long ago
+  long since;
+
+  // counters
+  unsigned long n_reqs;
+  unsigned long n_fails;
+  unsigned long n_ejects;
+  // time to first output, in ms
+  unsigned long n_timed;
+  long lat_total;
+  long lat_max;
+} lb_be_t;
+
+typedef struct {
+  const char* label;
+  lb_be_t be[LB_MAXBACKENDS];
+  int n;
+  // where ties are broken from, so that they take turns
+  int next;
+} lb_t;
+
+// set thresholds
+void lb_init(const conf_t* conf);
+
+/**
+ * @brief Make a balancer, to be reported under label.
+ * @return The balancer; NULL if too many.
+ */
+lb_t* lb_new(const char* label);
+
+/**
+ * @brief Add a backend.
+ * @return Its index; -1 if too many.
+ */
+int lb_add(lb_t* lb, const char* name);
+
+/**
+ * @brief Pick a backend for a request, and count it in flight.
+ * @return Index of the backend.
+ */
+int lb_pick(lb_t* lb);
+
+/**
+ * @brief Done with a request on a backend.
+ * @param lb The balancer.
+ * @param be Index of the backend.
+ * @param outcome LB_OK, LB_FAIL, or LB_UNKNOWN.
+ * @param latency ms till its first output; -1 if none.
+ */
+void lb_done(lb_t* lb, int be, int outcome, long latency);
+
+// log counters and latency of each backend
+void lb_report();
+
+#endif // LB_H
@@ -24,6 +24,16 @@
 #include <openssl/ssl.h>
 #include "daemon.h"
 #include "pool.h"
+#include "compress.h"
+#include "fcgi.h"
+#include "proxy.h"
+#include "mcache.h"
+#include "cgiq.h"
+#include "lb.h"
+#include "wsgi.h"
+#include "worker.h"
+#include "tls.h"
+#include "mime.h"
 #include "logging.h"
 #include "config.h"
 #include "utils.h"
@@ -34,6 +44,12 @@ static int sock = -1;
 // ssl sock and context
 static int ssl_sock = -1;
 static SSL_CTX* ssl_ctx = NULL;
+// eventfd of finished jobs; -1 if there's no worker
+static int wk_sock = -1;
+// workers building static responses; NULL builds them in loop.
+static wk_pool_t* file_workers = NULL;
+// workers doing ssl handshakes; NULL does them in loop.
+static wk_pool_t* ssl_workers = NULL;
 
 // connection pool
 static pool_t* pool = NULL;
@@ -41,6 +57,19 @@ static pool_t* pool = NULL;
 // input arguments
 static const int ARG_CNT = 8;
 static conf_t conf;
+// set by SIGUSR1; the loop logs a report.
+static volatile sig_atomic_t report = 0;
+// set by SIGCHLD; the loop reaps CGI.
+static volatile sig_atomic_t reap = 0;
+// ms till the first running CGI times out; -1 if none.
+static long cgi_due_next = -1;
+
+// the sooner of two waits in ms, where -1 is forever
+static long sooner(long a, long b) {
+  if (a < 0)
+    return b;
+  return b < 0 ? a : min(a, b);
+}
 
 // tear down the server with rc as return code
 static int teardown(int rc) {
@@ -60,6 +89,8 @@ static int teardown(int rc) {
 
   release_lock();
 
+  wsgi_stop();
+
   if (ssl_ctx)
     SSL_CTX_free(ssl_ctx);
 
@@ -85,7 +116,11 @@ static void signal_handler(int sig) {
   switch (sig) {
     case SIGCHLD:
       /* reap child to prevent zombie */
-      while ((pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0);
+      // only helpers in our group; CGI leads its own, and is reaped
+      // by the loop.
+      while ((pid = waitpid(0, &status, WNOHANG|WUNTRACED)) > 0)
+        wsgi_reaped(pid);
+      reap = 1;
       break;
     case SIGHUP:
       /* rehash the server */
@@ -93,6 +128,9 @@ static void signal_handler(int sig) {
     case SIGTERM:
       teardown(EXIT_SUCCESS);
       break;
+    case SIGUSR1:
+      report = 1;
+      break;
     default:
       break;
   }
@@ -108,7 +146,7 @@ static SSL_CTX* new_ssl_ctx(const char* prv, const char* crt) {
   SSL_load_error_strings();
   SSL_library_init();
 
-  if (!(ssl_ctx = SSL_CTX_new(TLSv1_server_method()))) {
+  if (!(ssl_ctx = SSL_CTX_new(TLS_server_method()))) {
     fprintf(stderr, "[new_ssl_ctx] Error creating SSL context. "
                     "Server NOT started.\n");
     teardown(EXIT_FAILURE);
@@ -131,6 +169,18 @@ static SSL_CTX* new_ssl_ctx(const char* prv, const char* crt) {
                     "Server NOT started.\n");
   }
 
+  if (tls_setup(ssl_ctx, &conf) < 0) {
+    fprintf(stderr, "[new_ssl_ctx] Error setting up TLS. "
+                    "Server NOT started.\n");
+    teardown(EXIT_FAILURE);
+  }
+
+#ifdef SSL_OP_ENABLE_KTLS
+  // kernel takes over record encryption after handshake, if it can.
+  if (conf.ktls)
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
   return ssl_ctx;
 }
 
@@ -286,17 +336,53 @@ static int liso_reset_or_close(conn_t* conn) {
   }
 }
 
-// prepare to recv stderr from cgi
+// prepare to recv stderr from cgi, or to send the cached response.
 static int liso_cgi_inited(conn_t* conn) {
-  FD_SET(conn->cgi->srv_err, &pool->read_set);
+  if (conn->resp->phase == RESP_HEADER) {
+    FD_SET(conn->fd, &pool->write_set);
+    return 1;
+  }
+  // FastCGI has stderr in records instead
+  if (conn->cgi->srv_err >= 0)
+    FD_SET(conn->cgi->srv_err, &pool->read_set);
   return 1;
 }
 
+// kill CGI that has run too long, or gone quiet; respond with 504,
+// unless part of output is sent already.
+// return 1 if conn is to respond.
+//       -1 if conn is drop.
+static int liso_cgi_timeout(conn_t* conn) {
+
+  cgi_t* cgi = conn->cgi;
+  cgi_kill(cgi, &conf);
+
+  // stop waiting on it; pipes are closed as conn is reset.
+  if (cgi->srv_in >= 0)
+    FD_CLR(cgi->srv_in, &pool->read_set);
+  if (cgi->srv_err >= 0)
+    FD_CLR(cgi->srv_err, &pool->read_set);
+  if (cgi_wfd(cgi) >= 0)
+    FD_CLR(cgi_wfd(cgi), &pool->write_set);
+
+  // it counts against the backend either way
+  cgi->phase = CGI_ABORT;
+  if (cgi->out_phase != OUT_HEADER)
+    return liso_drop_conn(conn);
+
+  // rest of body is never read
+  if (conn->req->phase != REQ_DONE)
+    conn->req->alive = false;
+
+  FD_CLR(conn->fd, &pool->read_set);
+  return liso_conn_err(conn, 504);
+}
+
 #define liso_recv(conn)                     \
   cn_recv(conn, liso_conn_err, liso_drop_conn)
 
-#define liso_prepare_static_header(conn)    \
-  cn_prepare_static_header(conn, &conf, liso_conn_err)
+#define liso_prepare_static_header(conn, built) \
+  cn_prepare_static_header(conn, built, liso_conn_err)
 
 #define liso_serve_static(conn)             \
   cn_serve_static(conn, liso_reset_or_close, liso_drop_conn)
@@ -308,23 +394,85 @@ static int liso_cgi_inited(conn_t* conn) {
   cn_stream_to_cgi(conn, liso_conn_err)
 
 #define liso_stream_from_cgi(conn)          \
-  cn_stream_from_cgi(conn, liso_conn_err)
+  cn_stream_from_cgi(conn, &conf, liso_conn_err)
 
 #define liso_serve_dynamic(conn)            \
   cn_serve_dynamic(conn, liso_reset_or_close, liso_drop_conn)
 
 
+// build static response on worker thread
+static int liso_build_static(void* arg) {
+  return cn_build_static((conn_t*) arg, &conf);
+}
+
+// static response is built; ready to send it.
+static void liso_static_built(void* arg, int built) {
+  conn_t* conn = arg;
+  liso_prepare_static_header(conn, built);
+  FD_SET(conn->fd, &pool->write_set);
+}
+
+// build static response of conn, and prepare its header when it's done.
+static void liso_serve_static_async(conn_t* conn) {
+
+  // no worker; do it right away
+  if (!file_workers) {
+    liso_prepare_static_header(conn, cn_build_static(conn, &conf));
+    return;
+  }
+
+  // not writable until it's built
+  FD_CLR(conn->fd, &pool->write_set);
+  conn->resp->phase = RESP_BUILDING;
+  conn->job.work = liso_build_static;
+  conn->job.done = liso_static_built;
+  conn->job.arg = conn;
+  wk_submit(file_workers, &conn->job);
+}
+
+// do a step of handshake on worker thread
+static int liso_handshake(void* arg) {
+  return cn_handshake((conn_t*) arg);
+}
+
+// a step of handshake is done; wait for what it needs next.
+static void liso_handshaken(void* arg, int rc) {
+  conn_t* conn = arg;
+  if (rc == 1)
+    conn->ssl_accepted = true;
+  if (rc < 0)
+    liso_drop_conn(conn);
+  else if (rc == 2)
+    FD_SET(conn->fd, &pool->write_set);
+  else
+    FD_SET(conn->fd, &pool->read_set);
+}
+
+// hand conn over to ssl workers until the step of handshake is done
+static void liso_handshake_async(conn_t* conn) {
+  FD_CLR(conn->fd, &pool->read_set);
+  FD_CLR(conn->fd, &pool->write_set);
+  conn->job.work = liso_handshake;
+  conn->job.done = liso_handshaken;
+  conn->job.arg = conn;
+  wk_submit(ssl_workers, &conn->job);
+}
+
 int main(int argc, char* argv[]) {
 
   int i;
 
-  if (argc != ARG_CNT+1) {
+  if (argc != ARG_CNT+1 && argc != ARG_CNT+2) {
     fprintf(stdout, "Usage: %s <HTTP port> <HTTPS port> <log file>"
                     "<lock file> <www folder> <CGI script path>"
-                    "<private key file> <certificate file>\n", argv[0]);
+                    "<private key file> <certificate file>"
+                    "[config file]\n", argv[0]);
     return EXIT_FAILURE;
   }
 
+  // before openssl allocates anything
+  tls_track_memory();
+
   conf.http_port = atoi(argv[1]);
   conf.https_port = atoi(argv[2]);
   conf.log = argv[3];
@@ -334,6 +482,38 @@ int main(int argc, char* argv[]) {
   conf.prv = argv[7];
   conf.crt = argv[8];
 
+  // optional settings
+  conf_init(&conf);
+  if (argc == ARG_CNT+2 && conf_load(&conf, argv[9]) < 0)
+    return EXIT_FAILURE;
+  zc_init(conf.gzip_cache_size);
+  mc_init(&conf);
+  cq_init(&conf);
+  lb_init(&conf);
+  // hosted WSGI application is reached by FastCGI as well
+  if (conf.wsgi && conf.fastcgi) {
+    fprintf(stderr, "Only one of wsgi and fastcgi can be set.\n");
+    return EXIT_FAILURE;
+  }
+  if (conf.wsgi && !wsgi_init(&conf))
+    return EXIT_FAILURE;
+  if (conf.fastcgi && !fcgi_init(conf.fastcgi, conf.fastcgi_keepalive)) {
+    fprintf(stderr, "Invalid FastCGI backend %s.\n", conf.fastcgi);
+    return EXIT_FAILURE;
+  }
+  if (!px_init(&conf)) {
+    fprintf(stderr, "Invalid upstream of proxy.\n");
+    return EXIT_FAILURE;
+  }
+
+  // mime types; the default file is optional.
+  mime_init();
+  if (mime_load(conf.mime_types) < 0 &&
+      strcmp(conf.mime_types, CONF_MIME_TYPES)) {
+    fprintf(stderr, "Cannot open mime types %s.\n", conf.mime_types);
+    return EXIT_FAILURE;
+  }
+
   // open listener sockets
   sock = open_listener_socket(conf.http_port);
   ssl_sock = open_listener_socket(conf.https_port);
@@ -347,34 +527,82 @@ int main(int argc, char* argv[]) {
   // create ssl context
   ssl_ctx = new_ssl_ctx(conf.prv, conf.crt);
 
+  // start workers after daemonize; threads don't survive fork.
+  if ((conf.workers > 0 || conf.ssl_handshake_workers > 0) &&
+      (wk_sock = wk_init()) >= 0) {
+    if (conf.workers > 0)
+      file_workers = wk_new(conf.workers);
+    if (conf.ssl_handshake_workers > 0)
+      ssl_workers = wk_new(conf.ssl_handshake_workers);
+    FD_SET(wk_sock, &pool->read_set);
+    pool->min_max_fd = max(pool->min_max_fd, wk_sock);
+    pool->max_fd = pool->min_max_fd;
+  }
+
   // avoid crash when client continues to send after sock is closed.
   signal(SIGPIPE, SIG_IGN);
   // set up signal handlers
   signal(SIGCHLD, signal_handler); /* child terminate signal */
   signal(SIGHUP, signal_handler);  /* hangup signal */
   signal(SIGTERM, signal_handler); /* software termination signal from kill */
+  signal(SIGUSR1, signal_handler); /* report memory usage */
 
   /* setup log */
   if (log_init(conf.log) < 0)
     teardown(EXIT_FAILURE);
   log_line("-------- Liso Server starts --------");
 
+  // helpers are children of the daemon
+  if (conf.wsgi)
+    wsgi_start();
+
   /******** main loop ********/
 
   while (1) {
 
-    // get pool ready
-    pl_ready(pool);
+    if (report) {
+      report = 0;
+      tls_report();
+      cq_report();
+      lb_report();
+    }
+
+    if (reap) {
+      reap = 0;
+      cgi_reap();
+    }
+
+    // get pool ready; don't block if tls holds data to be read.
+    struct timeval poll = {0, 0};
+    bool pending = pl_ready(pool);
+
+    // spawn dead helpers again; wake up for those held back.
+    struct timeval retry = {1, 0};
+    bool respawn = conf.wsgi && wsgi_check();
+
+    // admit CGI runs waiting for a slot; wake up for the next to expire,
+    // for the next CGI to time out, or to SIGKILL.
+    long wake = cq_pump();
+    wake = sooner(wake, cgi_due_next);
+    wake = sooner(wake, cgi_kill_pump());
+    struct timeval due = {wake / 1000, wake % 1000 * 1000};
+
+    struct timeval* timeout = respawn ? &retry : NULL;
+    if (wake >= 0 && (!timeout || wake < 1000))
+      timeout = &due;
+    if (pending)
+      timeout = &poll;
 
     // select those who are ready
     if ((pool->n_ready = select(pool->max_fd+1,
                                 &pool->read_ready,
                                 &pool->write_ready,
-                                NULL, NULL)) == -1) {
+                                NULL, timeout)) == -1) {
       log_errln("[select] %s", strerror(errno));
       errno = 0;
       continue;
     }
+    pl_tls_ready(pool);
 
 #if DEBUG >= 2
     log_line("[select] n_ready=%zu", pool->n_ready);
@@ -409,17 +637,28 @@ int main(int argc, char* argv[]) {
       }
     }
 
+    /**** finished jobs ****/
+
+    if (wk_sock >= 0 && FD_ISSET(wk_sock, &pool->read_ready))
+      wk_complete();
+
     /**** serve connections ****/
 
     int max_fd = pool->min_max_fd;
+    cgi_due_next = -1;
 
     for (i = 0; i < pool->n_conns; i++) {
 
       conn_t* conn = pool->conns[i];
 
-      /* recv */
+      /* handshake, or recv */
+
+      if (ssl_workers && conn->ssl && !conn->ssl_accepted) {
+        if (FD_ISSET(conn->fd, &pool->read_ready) ||
+            FD_ISSET(conn->fd, &pool->write_ready))
+          liso_handshake_async(conn);
 
-      if (FD_ISSET(conn->fd, &pool->read_ready)) {
+      } else if (FD_ISSET(conn->fd, &pool->read_ready)) {
         if (liso_recv(conn) < 0) {
           // the fatal conn is cleaned up and the last one replaces it.
           // go back and forward to process the new connection.
@@ -440,12 +679,17 @@ int main(int argc, char* argv[]) {
           conn->req->phase == REQ_DONE &&
           conn->resp->phase == RESP_READY) {
         // will set phase inside; only prepare once.
-        liso_prepare_static_header(conn);
+        liso_serve_static_async(conn);
       }
 
       if (conn->req->type == REQ_DYNAMIC &&
           conn->cgi->phase == CGI_READY) {
         liso_init_cgi(conn);
+
+        // waiting for a slot; body beyond buf stays with client.
+        if (conn->cgi->phase == CGI_READY && buf_rsize(conn->buf) > 0 &&
+            conn->req->phase != REQ_DONE)
+          FD_CLR(conn->fd, &pool->read_set);
       }
 
       // prepare for select
@@ -453,24 +697,61 @@ int main(int argc, char* argv[]) {
 
         FD_CLR(conn->fd, &pool->read_set);
 
-        // static response is fast, so ready for write now
-        if (conn->req->type == REQ_STATIC)
+        // static response is ready for write once it's built
+        if (conn->req->type == REQ_STATIC &&
+            conn->resp->phase != RESP_BUILDING)
           FD_SET(conn->fd, &pool->write_set);
       }
 
       if (conn->req->type == REQ_DYNAMIC &&
           conn->cgi->phase == CGI_SRV_TO_CGI) {
 
-        // assumes we can stream conn->buf->data_p
-        // to cgi pipe without blocking
-        liso_stream_to_cgi(conn);
+        // once the pipe is full, wait till it's writable again.
+        int wfd = cgi_wfd(conn->cgi);
+        if (!FD_ISSET(wfd, &pool->write_set) ||
+            FD_ISSET(wfd, &pool->write_ready))
+          liso_stream_to_cgi(conn);
+
+        if (conn->cgi->phase != CGI_SRV_TO_CGI) {
+          FD_CLR(wfd, &pool->write_set);
+
+        } else if (buf_rsize(conn->buf) > 0) {
+          // backpressure; stop taking body from client.
+          FD_CLR(conn->fd, &pool->read_set);
+          FD_SET(wfd, &pool->write_set);
+
+        } else if (conn->req->phase != REQ_DONE) {
+          FD_CLR(wfd, &pool->write_set);
+          FD_SET(conn->fd, &pool->read_set);
+
+        } else {
+          // cgi stream out/in transition
+          int rc = cgi_close_in(conn->cgi);
+          if (rc == CGI_AGAIN) {
+            FD_SET(wfd, &pool->write_set);
+          } else if (rc < 0) {
+            // backend is unreachable
+            FD_CLR(wfd, &pool->write_set);
+            conn->cgi->phase = CGI_ABORT;
+            liso_conn_err(conn, 502);
+          } else {
+            FD_CLR(wfd, &pool->write_set);
+            FD_SET(conn->cgi->srv_in, &pool->read_set);
+            conn->cgi->phase = CGI_CGI_TO_SRV;
+          }
+        }
+      }
 
-        // cgi stream out/in transition
-        if (conn->req->phase == REQ_DONE) {
-          close_pipe(&conn->cgi->srv_out);
-          FD_SET(conn->cgi->srv_in, &pool->read_set);
-          conn->cgi->phase = CGI_CGI_TO_SRV;
+      // kill CGI that has run too long, or gone quiet
+      if (conn->req->type == REQ_DYNAMIC &&
+          (conn->cgi->phase == CGI_SRV_TO_CGI ||
+           conn->cgi->phase == CGI_CGI_TO_SRV)) {
+        long left = cgi_due(conn->cgi, &conf);
+        if (left == 0 && liso_cgi_timeout(conn) < 0) {
+          i -= 1;
+          continue;
         }
+        cgi_due_next = sooner(cgi_due_next, left);
       }
 
       /* serve */
@@ -486,13 +767,15 @@ int main(int argc, char* argv[]) {
           liso_stream_from_cgi(conn);
 
           // late write ready to prevent busy waiting
+          // output waits in buf or pipe; don't wake up for more meanwhile.
           if (conn->cgi->buf_phase == BUF_SEND) {
             FD_SET(conn->fd, &pool->write_set);
+            FD_CLR(conn->cgi->srv_in, &pool->read_set);
           }
 
           if (conn->cgi->phase == CGI_DONE) {
             FD_CLR(conn->cgi->srv_in, &pool->read_set);
-            close_pipe(&conn->cgi->srv_in);
+            cgi_close_out(conn->cgi);
           }
         }
 
@@ -507,6 +790,8 @@ int main(int argc, char* argv[]) {
           if (conn->cgi->buf_phase == BUF_RECV &&
               conn->fd > 0) {
             FD_CLR(conn->fd, &pool->write_set);
+            if (conn->cgi->phase == CGI_CGI_TO_SRV)
+              FD_SET(conn->cgi->srv_in, &pool->read_set);
           }
         }
       }
@@ -526,6 +811,7 @@ int main(int argc, char* argv[]) {
       /* maintain max_fd */
       max_fd = max(max_fd, conn->fd);
       max_fd = max(max_fd, conn->cgi->srv_in);
+      max_fd = max(max_fd, conn->cgi->srv_out);
       max_fd = max(max_fd, conn->cgi->srv_err);
 
       if (conn->fd >= FD_SETSIZE)
@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include "logging.h"
 
 #define DATESZ 64
@@ -21,14 +22,18 @@ static int fd = -1;
 // line buffer
 static char dt[DATESZ];
 static char line[LINESZ+1];
-static char wrapped[LINESZ+DATESZ+10];
+static char wrapped[LINESZ+DATESZ+32];
+// buffers above are shared by worker threads
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void lock() {
+  pthread_mutex_lock(&mutex);
   lockf(fd, F_LOCK, 0);
 }
 
 static void unlock() {
   lockf(fd, F_ULOCK, 0);
+  pthread_mutex_unlock(&mutex);
 }
 
 int log_init(char* fname) {
@@ -52,7 +57,8 @@ bool log_inited() {
 
 void prepare_datetime(char* datetime) {
   time_t t = time(NULL);
-  struct tm tm = *localtime(&t);
+  struct tm tm;
+  localtime_r(&t, &tm);
   strftime(datetime, DATESZ, "%X %a %x", &tm);
 }
 
@@ -0,0 +1,389 @@
+/**
+ * @file mcache.c
+ * @brief Implementation of mcache.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include "mcache.h"
+#include "logging.h"
+#include "utils.h"
+
+#define MC_BUCKETS 1024
+// capture starts with so much room, and doubles
+#define MC_CAPSZ (16 << 10)
+
+static mc_ent_t* buckets[MC_BUCKETS];
+// most recently used at head
+static mc_ent_t* lru_head = NULL;
+static mc_ent_t* lru_tail = NULL;
+static size_t used = 0;
+static size_t budget = 0;
+
+void mc_init(const conf_t* conf) {
+  budget = conf->cgi_cache_size;
+}
+
+static unsigned long hash(const char* str) {
+  unsigned long h = 5381;
+  for (; *str; str++)
+    h = h * 33 + (unsigned char) *str;
+  return h;
+}
+
+static void lru_unlink(mc_ent_t* ent) {
+  if (ent->prev_lru)
+    ent->prev_lru->next_lru = ent->next_lru;
+  else
+    lru_head = ent->next_lru;
+  if (ent->next_lru)
+    ent->next_lru->prev_lru = ent->prev_lru;
+  else
+    lru_tail = ent->prev_lru;
+  ent->prev_lru = ent->next_lru = NULL;
+}
+
+static void lru_push(mc_ent_t* ent) {
+  ent->prev_lru = NULL;
+  ent->next_lru = lru_head;
+  if (lru_head)
+    lru_head->prev_lru = ent;
+  lru_head = ent;
+  if (!lru_tail)
+    lru_tail = ent;
+}
+
+// memory an entry takes
+static size_t ent_size(const mc_ent_t* ent) {
+  return strlen(ent->key) + strlen(ent->hdrs) + ent->sz;
+}
+
+static void ent_free(mc_ent_t* ent) {
+  free(ent->key);
+  free(ent->hdrs);
+  free(ent->body);
+  free(ent);
+}
+
+// remove ent from cache; free it if nobody is using it.
+static void evict(mc_ent_t* ent) {
+
+  mc_ent_t** pp = &buckets[hash(ent->key) % MC_BUCKETS];
+  for (; *pp; pp = &(*pp)->next) {
+    if (*pp == ent) {
+      *pp = ent->next;
+      break;
+    }
+  }
+
+  lru_unlink(ent);
+  used -= ent_size(ent);
+  ent->evicted = true;
+  if (ent->ref == 0)
+    ent_free(ent);
+}
+
+// find the entry of key
+static mc_ent_t* find(const char* key) {
+  mc_ent_t* ent;
+  for (ent = buckets[hash(key) % MC_BUCKETS]; ent; ent = ent->next)
+    if (!strcmp(ent->key, key))
+      return ent;
+  return NULL;
+}
+
+// check if request header name is keyed on
+static bool keyed_on(const char* name, const conf_t* conf) {
+  int i;
+  for (i = 0; i < conf->n_cgi_cache_vary; i++)
+    if (!strcasecmp(name, conf->cgi_cache_vary[i]))
+      return true;
+  return false;
+}
+
+long mc_key(const req_t* req, const conf_t* conf, char* key) {
+
+  // a request of someone's own, or with body, is never shared; nor is
+  // one with cookies, unless they are keyed on.
+  if (req->method != M_GET || req->clen > 0 ||
+      hdr_get(req->hdrs, "Authorization") ||
+      (hdr_get(req->hdrs, "Cookie") && !keyed_on("Cookie", conf)))
+    return -1;
+
+  long ttl = -1;
+  int i;
+  for (i = 0; i < conf->n_cgi_caches; i++) {
+    if (strstartswith(req->uri, conf->cgi_caches[i].prefix)) {
+      ttl = conf->cgi_caches[i].ttl;
+      break;
+    }
+  }
+  if (ttl < 0)
+    return -1;
+
+  int n = snprintf(key, MC_KEYSZ, "%s://%s%s?%s",
+                   req->scheme == HTTPS ? "https" : "http", req->host,
+                   req->uri, req->params ? req->params : "");
+  for (i = 0; i < conf->n_cgi_cache_vary && n < MC_KEYSZ; i++) {
+    hdr_t* h = hdr_get(req->hdrs, conf->cgi_cache_vary[i]);
+    n += snprintf(key + n, MC_KEYSZ - n, "\n%s", h ? h->val : "");
+  }
+
+  // too long to be a key
+  if (n >= MC_KEYSZ)
+    return -1;
+  return ttl;
+}
+
+mc_ent_t* mc_lookup(const char* key) {
+
+  mc_ent_t* ent = find(key);
+  if (!ent)
+    return NULL;
+
+  long age = time(NULL) - ent->born;
+
+  if (age >= ent->ttl + ent->swr) {
+    evict(ent);
+    return NULL;
+  }
+
+  // stale; the first one refreshes it, and the rest take it as is.
+  if (age >= ent->ttl && !ent->updating) {
+    ent->updating = true;
+    return NULL;
+  }
+
+  ent->ref++;
+  lru_unlink(ent);
+  lru_push(ent);
+  return ent;
+}
+
+void mc_release(mc_ent_t* ent) {
+  if (!ent)
+    return;
+  if (--ent->ref == 0 && ent->evicted)
+    ent_free(ent);
+}
+
+void mc_ent_hdrs(const mc_ent_t* ent, hdr_t* hdrs) {
+
+  char key[HDR_KEYSZ+1];
+  char val[HDR_VALSZ+1];
+  const char* p = ent->hdrs;
+  const char* eol;
+
+  for (; (eol = strstr(p, "\r\n")); p = eol + 2) {
+    const char* colon = strstr(p, ": ");
+    if (!colon || colon > eol)
+      continue;
+    strncpy0(key, p, min(colon - p, HDR_KEYSZ));
+    strncpy0(val, colon + 2, min(eol - colon - 2, HDR_VALSZ));
+    hdr_append(hdrs, hdr_new(key, val));
+  }
+
+  snprintf(val, sizeof(val), "%ld", (long) (time(NULL) - ent->born));
+  hdr_append(hdrs, hdr_new("Age", val));
+}
+
+mc_cap_t* mc_cap_new(const char* key, long ttl, const conf_t* conf) {
+  mc_cap_t* cap = malloc(sizeof(mc_cap_t));
+  cap->key = strdup(key);
+  cap->ttl = ttl;
+  cap->swr = conf->cgi_cache_swr;
+  cap->hdrs = NULL;
+  cap->body = NULL;
+  cap->sz = 0;
+  cap->cap = 0;
+  cap->max = conf->cgi_cache_max_entry;
+  cap->clen = -1;
+  return cap;
+}
+
+// find directive name in Cache-Control cc
+// return true if it's there; its value is put in val, -1 if none.
+static bool cc_find(const char* cc, const char* name, long* val) {
+
+  size_t len = strlen(name);
+  const char* p = cc;
+
+  while (*p) {
+    p += strspn(p, " \t,");
+    size_t tlen = strcspn(p, ",");
+    if (tlen >= len && !strncasecmp(p, name, len) &&
+        (tlen == len || p[len] == '=' || p[len] == ' ')) {
+      const char* eq = p + len;
+      *val = *eq == '=' ? atol(eq + 1) : -1;
+      return true;
+    }
+    p += tlen;
+  }
+  return false;
+}
+
+// check if each header in Vary is keyed on
+static bool vary_keyed(const char* vary, const conf_t* conf) {
+
+  char name[CONF_TYPESZ+1];
+  const char* p = vary;
+
+  while (*p) {
+    p += strspn(p, " \t,");
+    size_t len = strcspn(p, " \t,");
+    if (len == 0)
+      break;
+    if (len > CONF_TYPESZ)
+      return false;
+    strncpy0(name, p, len);
+
+    // including "*"
+    if (!keyed_on(name, conf))
+      return false;
+    p += len;
+  }
+  return true;
+}
+
+// headers that are framed anew for each response
+static bool hdr_framing(const char* key) {
+  return !strcasecmp(key, "Connection") ||
+         !strcasecmp(key, "Keep-Alive") ||
+         !strcasecmp(key, "Transfer-Encoding") ||
+         !strcasecmp(key, "Content-Length") ||
+         !strcasecmp(key, "Date") ||
+         !strcasecmp(key, "Server");
+}
+
+bool mc_cap_hdr(mc_cap_t* cap, int status, const hdr_t* hdrs,
+                const conf_t* conf) {
+
+  if (status != 200 || hdr_get(hdrs, "Set-Cookie"))
+    return false;
+
+  long val;
+  hdr_t* cc = hdr_get(hdrs, "Cache-Control");
+  if (cc) {
+    if (cc_find(cc->val, "no-store", &val) ||
+        cc_find(cc->val, "no-cache", &val) ||
+        cc_find(cc->val, "private", &val))
+      return false;
+    if (cc_find(cc->val, "s-maxage", &val) ||
+        cc_find(cc->val, "max-age", &val))
+      cap->ttl = val;
+    if (cc_find(cc->val, "stale-while-revalidate", &val))
+      cap->swr = max(val, 0);
+  }
+  if (cap->ttl <= 0)
+    return false;
+
+  const hdr_t* h;
+  for (h = hdrs->next; h; h = h->next)
+    if (!strcasecmp(h->key, "Vary") && !vary_keyed(h->val, conf))
+      return false;
+
+  hdr_t* clen = hdr_get(hdrs, "Content-Length");
+  if (clen && atol(clen->val) > (long) cap->max)
+    return false;
+
+  /* pack header */
+
+  size_t sz = 1;
+  for (h = hdrs->next; h; h = h->next)
+    sz += strlen(h->key) + strlen(h->val) + 4;
+
+  cap->hdrs = malloc(sz);
+  char* p = cap->hdrs;
+  *p = 0;
+  for (h = hdrs->next; h; h = h->next) {
+    if (hdr_framing(h->key))
+      continue;
+    p += sprintf(p, "%s: %s\r\n", h->key, h->val);
+  }
+
+  // body of known length is taken in one piece
+  if (clen) {
+    cap->clen = atol(clen->val);
+    cap->cap = cap->clen;
+    cap->body = cap->clen > 0 ? malloc(cap->cap) : NULL;
+  }
+
+  return true;
+}
+
+bool mc_cap_body(mc_cap_t* cap, const void* data, size_t n) {
+
+  if (cap->sz + n > cap->max)
+    return false;
+
+  if (cap->sz + n > cap->cap) {
+    cap->cap = min(max(cap->cap * 2, max(cap->sz + n, MC_CAPSZ)), cap->max);
+    cap->body = realloc(cap->body, cap->cap);
+  }
+
+  memcpy((char*) cap->body + cap->sz, data, n);
+  cap->sz += n;
+  return true;
+}
+
+void mc_cap_end(mc_cap_t* cap) {
+
+  // CGI has ended short
+  if (cap->clen >= 0 && cap->sz != (size_t) cap->clen) {
+    mc_cap_free(cap);
+    return;
+  }
+
+  mc_ent_t* ent = malloc(sizeof(mc_ent_t));
+  ent->key = cap->key;
+  ent->hdrs = cap->hdrs;
+  ent->body = cap->body;
+  ent->sz = cap->sz;
+  ent->born = time(NULL);
+  ent->ttl = cap->ttl;
+  ent->swr = cap->swr;
+  ent->updating = false;
+  ent->ref = 0;
+  ent->evicted = false;
+  free(cap);
+
+  // replaces the stale one
+  mc_ent_t* old = find(ent->key);
+  if (old)
+    evict(old);
+
+  size_t sz = ent_size(ent);
+  if (sz > budget) {
+    ent_free(ent);
+    return;
+  }
+
+  // make room for it
+  while (used + sz > budget && lru_tail)
+    evict(lru_tail);
+
+  unsigned long h = hash(ent->key) % MC_BUCKETS;
+  ent->next = buckets[h];
+  buckets[h] = ent;
+  lru_push(ent);
+  used += sz;
+
+#if DEBUG >= 1
+  log_line("[mc_cap_end] cached %s, %zu bytes for %lds.",
+           ent->key, ent->sz, ent->ttl);
+#endif
+}
+
+void mc_cap_free(mc_cap_t* cap) {
+  if (!cap)
+    return;
+
+  mc_ent_t* ent = find(cap->key);
+  if (ent)
+    ent->updating = false;
+
+  free(cap->key);
+  free(cap->hdrs);
+  free(cap->body);
+  free(cap);
+}
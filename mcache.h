@@ -0,0 +1,124 @@
+/**
+ * @file mcache.h
+ * @brief Micro-cache of CGI responses.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * GETs under a cgi_cache prefix are answered from memory for a few
+ * seconds, instead of running CGI each time. Entries are keyed on
+ * scheme, host, URI, params, and the request headers in cgi_cache_vary.
+ * Output of CGI is captured as it streams to the first client, and
+ * kept if it turns out cacheable: 200, no Set-Cookie, and nothing in
+ * Cache-Control or Vary that says otherwise.
+ *
+ * A stale entry is still served for stale-while-revalidate seconds,
+ * while the first request after it expires runs CGI to refresh it.
+ *
+ * It's used by the event loop only, so there is no lock.
+ */
+
+#ifndef MCACHE_H
+#define MCACHE_H
+
+#include <time.h>
+#include "header.h"
+#include "request.h"
+#include "config.h"
+
+#define MC_KEYSZ 8192
+
+typedef struct mc_ent_s {
+  char* key;
+
+  // response header from CGI, packed as "Key: Val\r\n" lines;
+  // those framing the response are left out.
+  char* hdrs;
+  void* body;
+  size_t sz;
+
+  // fresh for ttl seconds since born, then stale for swr seconds
+  time_t born;
+  long ttl;
+  long swr;
+  // a request is running CGI to refresh it
+  bool updating;
+
+  // number of responses using it
+  int ref;
+  // removed from cache, and freed once ref drops to 0
+  bool evicted;
+
+  struct mc_ent_s* next;  // hash chain
+  struct mc_ent_s* prev_lru;
+  struct mc_ent_s* next_lru;
+} mc_ent_t;
+
+// output of CGI being captured
+typedef struct mc_cap_s {
+  char* key;
+  long ttl;
+  long swr;
+  char* hdrs;
+  void* body;
+  size_t sz;
+  size_t cap;
+  size_t max;
+  // Content-Length from CGI; -1 if absent.
+  long clen;
+} mc_cap_t;
+
+// set memory budget of the cache
+void mc_init(const conf_t* conf);
+
+/**
+ * @brief Check if req may be answered from cache.
+ * @param req The request.
+ * @param conf Configurations.
+ * @param key Buffer of MC_KEYSZ for its key.
+ * @return Default ttl of its prefix; -1 if it's not to be cached.
+ */
+long mc_key(const req_t* req, const conf_t* conf, char* key);
+
+/**
+ * @brief Look up a response.
+ * @param key Key of the request.
+ * @return Cache entry with ref held; NULL if it has to run CGI.
+ *
+ * A stale entry is returned as long as some other request is
+ * refreshing it; otherwise the caller is to refresh it.
+ */
+mc_ent_t* mc_lookup(const char* key);
+
+// release a cache entry
+void mc_release(mc_ent_t* ent);
+
+/**
+ * @brief Pack header of an entry for a response.
+ * @param ent The entry.
+ * @param hdrs Header list to be appended to, with Age.
+ */
+void mc_ent_hdrs(const mc_ent_t* ent, hdr_t* hdrs);
+
+// start capturing output for key, with the default ttl
+mc_cap_t* mc_cap_new(const char* key, long ttl, const conf_t* conf);
+
+/**
+ * @brief Check if response header of CGI allows it to be cached.
+ * @param cap The capture.
+ * @param status Status from CGI.
+ * @param hdrs Header from CGI.
+ * @param conf Configurations.
+ * @return true if it's cacheable so far.
+ */
+bool mc_cap_hdr(mc_cap_t* cap, int status, const hdr_t* hdrs,
+                const conf_t* conf);
+
+// append body; false if it has grown too large to be cached.
+bool mc_cap_body(mc_cap_t* cap, const void* data, size_t n);
+
+// output is complete; put it into cache, and free the capture.
+void mc_cap_end(mc_cap_t* cap);
+
+// give up the capture; a stale entry can be refreshed by others.
+void mc_cap_free(mc_cap_t* cap);
+
+#endif // MCACHE_H
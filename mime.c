@@ -0,0 +1,143 @@
+/**
+ * @file mime.c
+ * @brief Implementation of mime.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mime.h"
+
+#define MIME_LINESZ 1024
+
+typedef struct {
+  // lower case; empty if the slot is free
+  char ext[MIME_EXTSZ+1];
+  const char* type;
+} mime_slot_t;
+
+static mime_slot_t slots[MIME_SLOTS];
+static int n_slots = 0;
+
+static const char* builtin_types[][2] = {
+  {"html", "text/html"},
+  {"htm", "text/html"},
+  {"css", "text/css"},
+  {"js", "application/javascript"},
+  {"json", "application/json"},
+  {"txt", "text/plain"},
+  {"xml", "application/xml"},
+  {"png", "image/png"},
+  {"jpg", "image/jpeg"},
+  {"jpeg", "image/jpeg"},
+  {"gif", "image/gif"},
+  {"svg", "image/svg+xml"},
+  {"ico", "image/x-icon"},
+  {"webp", "image/webp"},
+  {"woff", "font/woff"},
+  {"woff2", "font/woff2"},
+  {"pdf", "application/pdf"},
+  {"wasm", "application/wasm"},
+};
+#define n_builtin_types \
+  (sizeof(builtin_types) / sizeof(builtin_types[0]))
+
+static unsigned long hash(const char* str) {
+  unsigned long h = 5381;
+  for (; *str; str++)
+    h = h * 33 + (unsigned char) *str;
+  return h;
+}
+
+// copy ext into key in lower case
+// return false if ext is empty or too long.
+static bool make_key(const char* ext, char* key) {
+  size_t i;
+  for (i = 0; ext[i]; i++) {
+    if (i >= MIME_EXTSZ)
+      return false;
+    key[i] = tolower((unsigned char) ext[i]);
+  }
+  key[i] = 0;
+  return i > 0;
+}
+
+// find the slot of key; it's either free or holding key.
+static mime_slot_t* probe(const char* key) {
+  unsigned long i = hash(key) & (MIME_SLOTS-1);
+  while (slots[i].ext[0] && strcmp(slots[i].ext, key))
+    i = (i + 1) & (MIME_SLOTS-1);
+  return &slots[i];
+}
+
+bool mime_add(const char* ext, const char* type) {
+
+  char key[MIME_EXTSZ+1];
+  if (!make_key(ext, key))
+    return false;
+
+  mime_slot_t* slot = probe(key);
+  if (!slot->ext[0]) {
+    // keep one slot free, so that probing always ends
+    if (n_slots >= MIME_SLOTS-1)
+      return false;
+    strcpy0(slot->ext, key);
+    n_slots++;
+  }
+  slot->type = type;
+  return true;
+}
+
+void mime_init() {
+  int i;
+  for (i = 0; i < n_builtin_types; i++)
+    mime_add(builtin_types[i][0], builtin_types[i][1]);
+}
+
+int mime_load(const char* fname) {
+
+  FILE* f = fopen(fname, "r");
+  if (!f)
+    return -1;
+
+  int cnt = 0;
+  char line[MIME_LINESZ+1];
+  while (fgets(line, sizeof(line), f)) {
+
+    // strip comment
+    char* p = strchr(line, '#');
+    if (p)
+      *p = 0;
+
+    char* save = NULL;
+    char* type = strtok_r(line, " \t\r\n", &save);
+    char* ext = strtok_r(NULL, " \t\r\n", &save);
+    // types without extensions are of no use
+    if (!type || !ext)
+      continue;
+
+    // shared by all its extensions, and lives as long as the server
+    type = strdup(type);
+    for (; ext; ext = strtok_r(NULL, " \t\r\n", &save))
+      if (mime_add(ext, type))
+        cnt++;
+  }
+
+  fclose(f);
+  return cnt;
+}
+
+const char* mime_type(const char* path) {
+
+  const char* dot = strrchr(path, '.');
+  if (!dot || strchr(dot, '/'))
+    return MIME_DEFAULT;
+
+  char key[MIME_EXTSZ+1];
+  if (!make_key(dot+1, key))
+    return MIME_DEFAULT;
+
+  mime_slot_t* slot = probe(key);
+  return slot->ext[0] ? slot->type : MIME_DEFAULT;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file mime.h
+ * @brief Registry of mime types, keyed by file extension.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * A few common types are built in. More are loaded at startup from a
+ * mime.types file, with one `type ext...` per line, and override the
+ * built-in ones. Extensions live in an open-addressing hash table, so
+ * lookup costs the same for hundreds of types.
+ */
+
+#ifndef MIME_H
+#define MIME_H
+
+#include "utils.h"
+
+// max number of extensions; power of 2
+#define MIME_SLOTS 4096
+// max length of an extension, excluding the dot
+#define MIME_EXTSZ 16
+// type of files without a known extension
+#define MIME_DEFAULT "text/plain"
+
+// register the built-in types
+void mime_init();
+
+/**
+ * @brief Load types from a mime.types file.
+ * @param fname Path to the file.
+ * @return Number of extensions loaded.
+ *        -1 if the file cannot be opened.
+ */
+int mime_load(const char* fname);
+
+// map ext, without the dot, to type; existing mapping is replaced.
+// return false if ext is too long or the table is full.
+bool mime_add(const char* ext, const char* type);
+
+// look up the mime type of path by its extension, case insensitive.
+// return MIME_DEFAULT if unknown.
+const char* mime_type(const char* path);
+
+#endif // MIME_H
@@ -26,9 +26,56 @@ pool_t* pl_new(int sock, int ssl_sock) {
   return p;
 }
 
-void pl_ready(pool_t* p) {
+bool pl_ready(pool_t* p) {
+
   p->read_ready = p->read_set;
   p->write_ready = p->write_set;
+
+  bool pending = false;
+  int i;
+  for (i = 0; i < p->n_conns; i++) {
+    conn_t* c = p->conns[i];
+    if (c->ssl_stall == CN_RECV_WANTS_WRITE)
+      FD_SET(c->fd, &p->write_ready);
+    else if (c->ssl_stall == CN_SEND_WANTS_READ)
+      FD_SET(c->fd, &p->read_ready);
+    if (FD_ISSET(c->fd, &p->read_set) && cn_pending(c))
+      pending = true;
+    if (c->cgi->srv_in >= 0 && FD_ISSET(c->cgi->srv_in, &p->read_set) &&
+        cgi_pending(c->cgi))
+      pending = true;
+  }
+
+  return pending;
+}
+
+void pl_tls_ready(pool_t* p) {
+
+  int i;
+  for (i = 0; i < p->n_conns; i++) {
+    conn_t* c = p->conns[i];
+
+    // data already decrypted doesn't show on the socket
+    if (FD_ISSET(c->fd, &p->read_set) && cn_pending(c))
+      FD_SET(c->fd, &p->read_ready);
+    // nor does output of upstream already taken in
+    if (c->cgi->srv_in >= 0 && FD_ISSET(c->cgi->srv_in, &p->read_set) &&
+        cgi_pending(c->cgi))
+      FD_SET(c->cgi->srv_in, &p->read_ready);
+
+    // the stalled op goes on the way it was driven
+    if (c->ssl_stall == CN_RECV_WANTS_WRITE &&
+        FD_ISSET(c->fd, &p->write_ready)) {
+      FD_SET(c->fd, &p->read_ready);
+      if (!FD_ISSET(c->fd, &p->write_set))
+        FD_CLR(c->fd, &p->write_ready);
+    } else if (c->ssl_stall == CN_SEND_WANTS_READ &&
+               FD_ISSET(c->fd, &p->read_ready)) {
+      FD_SET(c->fd, &p->write_ready);
+      if (!FD_ISSET(c->fd, &p->read_set))
+        FD_CLR(c->fd, &p->read_ready);
+    }
+  }
 }
 
 void pl_free(pool_t* p) {
@@ -96,9 +143,13 @@ int pl_reset_conn(pool_t* pool, conn_t* conn) {
   FD_SET(conn->fd, &pool->read_set);
   FD_CLR(conn->fd, &pool->write_set);
 
+  // request body may be waiting on it
+  if (cgi_wfd(conn->cgi) >= 0)
+    FD_CLR(cgi_wfd(conn->cgi), &pool->write_set);
+
   if (conn->cgi->srv_in >= 0) {
     FD_CLR(conn->cgi->srv_in, &pool->read_set);
-    close_pipe(&conn->cgi->srv_in);
+    cgi_close_out(conn->cgi);
   }
 
   if (conn->cgi->srv_err >= 0) {
@@ -37,8 +37,17 @@ typedef struct {
 pool_t* pl_new(int sock, int ssl_sock);
 // Free a pool.
 void pl_free(pool_t* p);
-// Prepare the pool for select.
-void pl_ready(pool_t* p);
+/**
+ * @brief Prepare the pool for select.
+ * @param p The pool.
+ * @return true if tls of some conn, or its upstream, holds data to be read,
+ *         so that select shouldn't block.
+ *
+ * Stalled tls ops wait for the socket the other way round as well.
+ */
+bool pl_ready(pool_t* p);
+// After select, mark conns whose tls ops or upstream input can go on as ready.
+void pl_tls_ready(pool_t* p);
 // Add a connection to pool.
 int pl_add_conn(pool_t* p, conn_t* c);
 // Delete and free the connection from the pool.
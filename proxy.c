@@ -0,0 +1,542 @@
+/**
+ * @file proxy.c
+ * @brief Implementation of proxy.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#define _GNU_SOURCE  // memmem
+#include <errno.h>
+#include <sys/socket.h>
+#include "proxy.h"
+#include "logging.h"
+
+// an upstream, and its idle conns
+typedef struct {
+  const char* prefix;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int* idle;
+  int n_idle;
+} upstream_t;
+
+// a prefix, and upstreams it's balanced over
+typedef struct {
+  const char* prefix;
+  lb_t* lb;
+  // index among all of each upstream in lb
+  int ups[LB_MAXBACKENDS];
+} route_t;
+
+static upstream_t ups[CONF_MAXPROXIES];
+static route_t routes[CONF_MAXPROXIES];
+static int n_routes = 0;
+static int max_idle = 0;
+
+// route of prefix, made if there is none
+static route_t* route_of(const char* prefix) {
+  int i;
+  for (i = 0; i < n_routes; i++)
+    if (!strcmp(routes[i].prefix, prefix))
+      return &routes[i];
+  route_t* r = &routes[n_routes++];
+  r->prefix = prefix;
+  r->lb = lb_new(prefix);
+  return r;
+}
+
+bool px_init(const conf_t* conf) {
+
+  int i;
+  for (i = 0; i < conf->n_proxies; i++) {
+    upstream_t* up = &ups[i];
+    if (!sockaddr_parse(conf->proxies[i].addr, &up->addr, &up->addrlen))
+      return false;
+    up->prefix = conf->proxies[i].prefix;
+    up->idle = malloc(sizeof(int) * max(conf->proxy_keepalive, 1));
+    up->n_idle = 0;
+
+    route_t* r = route_of(up->prefix);
+    int be = lb_add(r->lb, conf->proxies[i].addr);
+    if (be < 0)
+      return false;
+    r->ups[be] = i;
+  }
+  max_idle = conf->proxy_keepalive;
+  return true;
+}
+
+int px_route(const char* uri) {
+  int i;
+  for (i = 0; i < n_routes; i++)
+    if (strstartswith(uri, routes[i].prefix))
+      return i;
+  return -1;
+}
+
+lb_t* px_balancer(int route) {
+  return routes[route].lb;
+}
+
+void px_reset(px_t* px) {
+  px->fd = -1;
+  px->up = -1;
+  px->head_only = false;
+  px->connecting = false;
+  px->out = NULL;
+  px->in_p = 0;
+  px->in_sz = 0;
+  px->phase = PX_HEAD;
+  px->hsz = 0;
+  px->left = 0;
+  px->alive = true;
+}
+
+// check if an idle conn is still open; upstream may have closed it.
+static bool still_open(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// lease an idle conn to upstream up, or start connecting a new one
+// return the fd; -1 if upstream is unreachable right away.
+static int lease(upstream_t* up, bool* connecting) {
+
+  *connecting = false;
+  while (up->n_idle > 0) {
+    int fd = up->idle[--up->n_idle];
+    if (still_open(fd))
+      return fd;
+    close(fd);
+  }
+
+  int fd = sock_connect(&up->addr, up->addrlen);
+  if (fd < 0) {
+    log_errln("[proxy] cannot connect to %s: %s",
+              up->prefix, strerror(errno));
+    return -1;
+  }
+  *connecting = true;
+
+#if DEBUG >= 1
+  log_line("[proxy] connecting to upstream of %s at %d.", up->prefix, fd);
+#endif
+
+  return fd;
+}
+
+// fields between client and us, not to be forwarded
+static const char* hop_hdrs[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authorization",
+  "TE", "Trailer", "Transfer-Encoding", "Upgrade", NULL,
+};
+
+// check if token is in the list of any field key
+static bool listed(const hdr_t* hdrs, const char* key, const char* token) {
+  size_t len = strlen(token);
+  const hdr_t* h;
+  for (h = hdrs->next; h; h = h->next) {
+    if (strcasecmp(h->key, key))
+      continue;
+    const char* p = h->val;
+    while (*p) {
+      p += strspn(p, " \t,");
+      size_t n = strcspn(p, " \t,");
+      if (n == len && !strncasecmp(p, token, len))
+        return true;
+      p += n;
+    }
+  }
+  return false;
+}
+
+// check if field key of request is forwarded as is
+static bool forwarded(const hdr_t* hdrs, const char* key) {
+  int i;
+  for (i = 0; hop_hdrs[i]; i++)
+    if (!strcasecmp(key, hop_hdrs[i]))
+      return false;
+  // X-Forwarded-* are made anew
+  if (!strncasecmp(key, "X-Forwarded-", 12))
+    return false;
+  // and so are those Connection names
+  return !listed(hdrs, "Connection", key);
+}
+
+// pack fields from h on into p, in the order they came, i.e. reversed.
+// only values of key go, each followed by a comma, if key is given.
+static char* pack_hdrs(const hdr_t* hdrs, const hdr_t* h, const char* key,
+                       char* p) {
+  if (!h)
+    return p;
+  p = pack_hdrs(hdrs, h->next, key, p);
+  if (key && !strcasecmp(h->key, key))
+    p += sprintf(p, "%s, ", h->val);
+  else if (!key && forwarded(hdrs, h->key))
+    p += sprintf(p, "%s: %s\r\n", h->key, h->val);
+  return p;
+}
+
+// pack head of req to forward into out
+static void pack_head(const req_t* req, buf_t* out) {
+
+  char* p = out->data;
+  p += sprintf(p, "%s %s%s%s %s\r\nHost: %s\r\n", req_method(req),
+               req->uri, req->params ? "?" : "",
+               req->params ? req->params : "", req->version, req->host);
+  if (req->clen > 0 || req->method == M_POST)
+    p += sprintf(p, "Content-Length: %zd\r\n", req->clen);
+  p = pack_hdrs(req->hdrs, req->hdrs->next, NULL, p);
+
+  // client goes after the proxies it has come through
+  p += sprintf(p, "X-Forwarded-For: ");
+  p = pack_hdrs(req->hdrs, req->hdrs->next, "X-Forwarded-For", p);
+  p += sprintf(p, "%s\r\nX-Forwarded-Proto: %s\r\n\r\n", req->addr,
+               req->scheme == HTTPS ? "https" : "http");
+
+  out->sz = p - (char*) out->data;
+  out->data_p = out->data;
+}
+
+// size of the head pack_head would make, with room to spare
+static size_t head_size(const req_t* req) {
+  size_t sz = strlen(req->uri) + strlen(req->host) + 128;
+  if (req->params)
+    sz += strlen(req->params);
+  hdr_t* h;
+  for (h = req->hdrs->next; h; h = h->next)
+    sz += strlen(h->key) + strlen(h->val) + 4;
+  return sz;
+}
+
+bool px_begin(px_t* px, const req_t* req, int route, int be) {
+
+  int up = routes[route].ups[be];
+  px_reset(px);
+  px->up = up;
+  px->head_only = req->method == M_HEAD;
+
+  // X-Forwarded-* go last, and fill in the room left
+  if (head_size(req) + INET_ADDRSTRLEN + 64 > BUFSZ) {
+    log_errln("[px_begin] request head is too large to forward.");
+    return false;
+  }
+  if ((px->fd = lease(&ups[up], &px->connecting)) < 0)
+    return false;
+
+  // head waits in out till the socket is writable
+  px->out = buf_new();
+  pack_head(req, px->out);
+  px->in = malloc(PX_INSZ);
+  return true;
+}
+
+// send without blocking
+// return as send; PX_AGAIN if the socket is full.
+static ssize_t send_some(int fd, const void* data, size_t n, int flags) {
+  ssize_t sz = send(fd, data, n, flags|MSG_DONTWAIT|MSG_NOSIGNAL);
+  if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return PX_AGAIN;
+  if (sz < 0)
+    log_errln("[px_write] %s", strerror(errno));
+  return sz;
+}
+
+// finish connecting, and send the head in out
+// return 1 if it's all sent; PX_AGAIN if not yet, -1 if error occurs.
+static int flush_head(px_t* px, int flags) {
+
+  if (px->connecting) {
+    int rc = sock_connected(px->fd);
+    if (rc == 0)
+      return PX_AGAIN;
+    if (rc < 0) {
+      log_errln("[proxy] cannot connect to %s: %s",
+                ups[px->up].prefix, strerror(errno));
+      return -1;
+    }
+    px->connecting = false;
+  }
+
+  buf_t* out = px->out;
+  while (buf_rsize(out) > 0) {
+    ssize_t sz = send_some(px->fd, out->data_p, buf_rsize(out), flags);
+    if (sz < 0)
+      return sz;
+    out->data_p += sz;
+  }
+
+  buf_free(out);
+  px->out = NULL;
+  return 1;
+}
+
+ssize_t px_write(px_t* px, const void* data, size_t n) {
+
+  // request head goes first
+  if (px->out || px->connecting) {
+    int rc = flush_head(px, n > 0 ? MSG_MORE : 0);
+    if (rc != 1)
+      return rc;
+  }
+
+  if (n == 0)
+    return 0;
+  return send_some(px->fd, data, n, 0);
+}
+
+// receive into data without blocking
+// return as recv; PX_AGAIN if nothing yet.
+static ssize_t recv_some(px_t* px, void* data, size_t n) {
+  ssize_t sz = recv(px->fd, data, n, MSG_DONTWAIT);
+  if (sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return PX_AGAIN;
+  if (sz < 0)
+    log_errln("[px_read] %s", strerror(errno));
+  return sz;
+}
+
+// take more into in, after what's left of it
+// return as recv; -1 if in is full.
+static ssize_t fill(px_t* px) {
+  if (px->in_p > 0) {
+    memmove(px->in, px->in + px->in_p, px->in_sz - px->in_p);
+    px->in_sz -= px->in_p;
+    px->in_p = 0;
+  }
+  if (px->in_sz == PX_INSZ) {
+    log_errln("[px_read] line from upstream is too long.");
+    return -1;
+  }
+  ssize_t sz = recv_some(px, px->in + px->in_sz, PX_INSZ - px->in_sz);
+  if (sz > 0)
+    px->in_sz += sz;
+  return sz;
+}
+
+// hand out what's in, or receive straight into data
+// return as recv.
+static ssize_t take(px_t* px, void* data, size_t n) {
+  if (px->in_p < px->in_sz) {
+    size_t k = min(n, px->in_sz - px->in_p);
+    memcpy(data, px->in + px->in_p, k);
+    px->in_p += k;
+    return k;
+  }
+  return recv_some(px, data, n);
+}
+
+// a line in, without CRLF
+// return its length; -1 if it isn't complete yet.
+static ssize_t line(px_t* px) {
+  char* p = px->in + px->in_p;
+  char* eol = memmem(p, px->in_sz - px->in_p, "\r\n", 2);
+  return eol ? eol - p : -1;
+}
+
+// value of field key in head line p to eol; NULL if it's another.
+static const char* field(const char* p, const char* eol, const char* key) {
+  size_t len = strlen(key);
+  if (eol - p <= len || strncasecmp(p, key, len) || p[len] != ':')
+    return NULL;
+  for (p += len + 1; p < eol && (*p == ' ' || *p == '\t'); p++);
+  return p;
+}
+
+// decide how body is framed from head of size hsz
+static void frame(px_t* px, const char* head, size_t hsz) {
+
+  const char* end = head + hsz - 2;
+  const char* eol = memmem(head, hsz, "\r\n", 2);
+  const char* sp = memchr(head, ' ', eol - head);
+  int status = sp ? atoi(sp + 1) : 0;
+
+  // HTTP/1.0 closes unless it says otherwise
+  px->alive = strncmp(head, "HTTP/1.0", 8) != 0;
+  bool chunked = false;
+  long clen = -1;
+
+  const char* p;
+  for (p = eol + 2; p < end; p = eol + 2) {
+    eol = memmem(p, end + 2 - p, "\r\n", 2);
+    const char* v;
+    if ((v = field(p, eol, "Content-Length")))
+      clen = atol(v);
+    else if ((v = field(p, eol, "Transfer-Encoding")))
+      chunked = memmem(v, eol - v, "chunked", 7) != NULL;
+    else if ((v = field(p, eol, "Connection")))
+      px->alive = !strncasecmp(v, "keep-alive", 10) ||
+                  (px->alive && strncasecmp(v, "close", 5));
+  }
+
+  if (px->head_only || status == 204 || status == 304) {
+    px->phase = PX_ENDED;
+  } else if (chunked) {
+    px->phase = PX_CHUNK;
+  } else if (clen >= 0) {
+    px->phase = clen > 0 ? PX_LENGTH : PX_ENDED;
+    px->left = clen;
+  } else {
+    px->phase = PX_CLOSE;
+    px->alive = false;
+  }
+}
+
+ssize_t px_read(px_t* px, void* data, size_t n) {
+
+  ssize_t sz;
+
+  while (1) {
+    switch (px->phase) {
+
+    case PX_HEAD: {
+      char* end = memmem(px->in, px->in_sz, "\r\n\r\n", 4);
+      if (!end) {
+        sz = fill(px);
+        if (sz == 0)
+          log_errln("[px_read] upstream closed %d before response.",
+                    px->fd);
+        if (sz <= 0)
+          return sz == PX_AGAIN ? sz : -1;
+        continue;
+      }
+      px->hsz = end + 4 - px->in;
+
+      // Upgrade is never forwarded, so a 101 is bogus
+      char* sp = memchr(px->in, ' ', px->hsz);
+      if (sp && !strncmp(sp + 1, "101", 3)) {
+        log_errln("[px_read] upstream %d switched protocols.", px->fd);
+        return -1;
+      }
+      // interim response, e.g. 100 Continue, is dropped
+      if (sp && sp[1] == '1') {
+        px->in_p = px->hsz;
+        fill(px);
+        continue;
+      }
+      px->phase = PX_HEAD_OUT;
+      px->left = px->hsz;
+      break;
+    }
+
+    case PX_HEAD_OUT:
+      sz = take(px, data, min(n, px->left));
+      px->left -= sz;
+      if (px->left == 0)
+        frame(px, px->in, px->hsz);
+      return sz;
+
+    case PX_LENGTH:
+      sz = take(px, data, min(n, px->left));
+      if (sz == 0) {
+        log_errln("[px_read] upstream closed %d in the middle.", px->fd);
+        return -1;
+      }
+      if (sz > 0 && (px->left -= sz) == 0)
+        px->phase = PX_ENDED;
+      return sz;
+
+    case PX_CLOSE:
+      sz = take(px, data, n);
+      if (sz == 0)
+        px->phase = PX_ENDED;
+      return sz;
+
+    case PX_CHUNK:
+    case PX_CHUNK_END:
+    case PX_TRAILER: {
+      ssize_t len = line(px);
+      if (len < 0) {
+        sz = fill(px);
+        if (sz == 0)
+          log_errln("[px_read] upstream closed %d in the middle.", px->fd);
+        if (sz <= 0)
+          return sz == PX_AGAIN ? sz : -1;
+        continue;
+      }
+      char* p = px->in + px->in_p;
+      px->in_p += len + 2;
+
+      if (px->phase == PX_CHUNK) {
+        // extensions after ; are ignored
+        px->left = strtoul(p, NULL, 16);
+        px->phase = px->left > 0 ? PX_CHUNK_DATA : PX_TRAILER;
+      } else if (px->phase == PX_CHUNK_END) {
+        if (len != 0)
+          return -1;
+        px->phase = PX_CHUNK;
+      } else if (len == 0) {
+        px->phase = PX_ENDED;
+      }
+      break;
+    }
+
+    case PX_CHUNK_DATA:
+      sz = take(px, data, min(n, px->left));
+      if (sz == 0) {
+        log_errln("[px_read] upstream closed %d in the middle.", px->fd);
+        return -1;
+      }
+      if (sz > 0 && (px->left -= sz) == 0)
+        px->phase = PX_CHUNK_END;
+      return sz;
+
+    case PX_ENDED:
+      return 0;
+    }
+  }
+}
+
+bool px_pending(const px_t* px) {
+
+  const char* p = px->in + px->in_p;
+  size_t k = px->in_sz - px->in_p;
+
+  switch (px->phase) {
+  case PX_HEAD:
+    return memmem(px->in, px->in_sz, "\r\n\r\n", 4) != NULL;
+  case PX_HEAD_OUT:
+  case PX_ENDED:
+    return true;
+  case PX_LENGTH:
+  case PX_CHUNK_DATA:
+  case PX_CLOSE:
+    return k > 0;
+  default:
+    return memmem(p, k, "\r\n", 2) != NULL;
+  }
+}
+
+void px_strip_hdrs(hdr_t* hdrs) {
+  hdr_del(hdrs, "Connection");
+  hdr_del(hdrs, "Keep-Alive");
+  hdr_del(hdrs, "Proxy-Connection");
+  hdr_del(hdrs, "Transfer-Encoding");
+  hdr_del(hdrs, "Trailer");
+  hdr_del(hdrs, "Upgrade");
+}
+
+void px_end(px_t* px) {
+
+  if (px->fd < 0)
+    return;
+
+  upstream_t* up = &ups[px->up];
+
+  // nothing is to follow the response
+  if (px->phase == PX_ENDED && px->alive && px->in_p == px->in_sz &&
+      up->n_idle < max_idle) {
+    up->idle[up->n_idle++] = px->fd;
+#if DEBUG >= 1
+    log_line("[px_end] keep %d alive, %d idle.", px->fd, up->n_idle);
+#endif
+  } else {
+    close(px->fd);
+  }
+
+  if (px->out)
+    buf_free(px->out);
+  free(px->in);
+  px->in = NULL;
+  px_reset(px);
+}
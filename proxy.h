@@ -0,0 +1,142 @@
+/**
+ * @file proxy.h
+ * @brief HTTP reverse proxy.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * Requests under a proxy prefix are forwarded to an upstream HTTP/1.1
+ * server, over a Unix or TCP socket, instead of running CGI. Like a
+ * FastCGI request, a proxied one owns its connection until the response
+ * ends, and then the connection is kept alive for later ones.
+ *
+ * Upstreams of the same prefix are balanced by lb. The request head is
+ * packed again without hop-by-hop fields, those named in Connection, and
+ * X-Forwarded-*, the client address being appended to X-Forwarded-For;
+ * its body streams after it as is. The response head is handed out as is,
+ * to be parsed as an NPH header, while its body is handed out without
+ * framing; Content-Length, chunked, and close-delimited bodies are all
+ * understood, so that it's known where the response ends.
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "request.h"
+#include "header.h"
+#include "config.h"
+#include "lb.h"
+
+// returned by px_read and px_write if the socket isn't ready yet
+#define PX_AGAIN (-2)
+// input is taken in so much at a time; a response head has to fit.
+#define PX_INSZ (16 << 10)
+
+// a request in progress
+typedef struct {
+  // connection to upstream; -1 if none
+  int fd;
+  // index of the upstream among all
+  int up;
+  // a response to HEAD has no body
+  bool head_only;
+  // connect is in progress
+  bool connecting;
+  // request head not sent yet; NULL once it's all out.
+  buf_t* out;
+
+  // response taken in, but not handed out yet; PX_INSZ of it.
+  char* in;
+  size_t in_p;
+  size_t in_sz;
+
+  enum {
+    PX_HEAD=1,    // collecting head
+    PX_HEAD_OUT,  // handing out head
+    PX_LENGTH,    // body of known length
+    PX_CHUNK,     // size line of a chunk
+    PX_CHUNK_DATA,
+    PX_CHUNK_END, // CRLF after chunk data
+    PX_TRAILER,   // trailer after the last chunk
+    PX_CLOSE,     // body ends as upstream closes
+    PX_ENDED,
+  } phase;
+
+  // head size, or bytes left in body or chunk
+  size_t hsz;
+  size_t left;
+  // upstream keeps the connection after the response
+  bool alive;
+} px_t;
+
+/**
+ * @brief Set up upstreams.
+ * @param conf Configurations with proxy prefixes.
+ * @return true if normal.
+ *         false if some address is invalid.
+ */
+bool px_init(const conf_t* conf);
+
+/**
+ * @brief Find the prefix uri is under.
+ * @return Index of the route; -1 if uri is not proxied.
+ */
+int px_route(const char* uri);
+
+// balancer over upstreams of a route
+lb_t* px_balancer(int route);
+
+// reset a request to be unused
+void px_reset(px_t* px);
+
+/**
+ * @brief Start forwarding req on a connection to an upstream.
+ * @param px The request.
+ * @param req The request from client.
+ * @param route Index of the route.
+ * @param be Index of the upstream in its balancer.
+ * @return true if normal.
+ *         false if upstream is unreachable right away.
+ *
+ * Connecting is only started, and the head of req, with X-Forwarded-For
+ * and X-Forwarded-Proto, waits to be sent by px_write.
+ */
+bool px_begin(px_t* px, const req_t* req, int route, int be);
+
+/**
+ * @brief Send request body to upstream without blocking.
+ * @param px The request.
+ * @param data The body; NULL with n 0 to only send the head.
+ * @param n Size of data.
+ * @return Bytes sent.
+ *         PX_AGAIN if still connecting, or the socket is full.
+ *        -1 if error occurs, e.g. upstream refused to connect.
+ *
+ * Head is sent first; no body goes before it's all out.
+ */
+ssize_t px_write(px_t* px, const void* data, size_t n);
+
+/**
+ * @brief Receive the response from upstream.
+ * @param px The request.
+ * @param data Buffer for the response.
+ * @param n Capacity of data.
+ * @return Bytes received; head as is, followed by body without framing.
+ *         0 if the response has ended.
+ *         PX_AGAIN if nothing is readable yet.
+ *        -1 if error occurs.
+ */
+ssize_t px_read(px_t* px, void* data, size_t n);
+
+/**
+ * @brief Check if something can be read without waiting on the socket.
+ *
+ * Response taken in ahead, or its end, doesn't show on the socket.
+ */
+bool px_pending(const px_t* px);
+
+// remove fields of the response head that are between upstream and us
+void px_strip_hdrs(hdr_t* hdrs);
+
+// end a request; its connection is kept alive if it ended cleanly.
+void px_end(px_t* px);
+
+#endif // PROXY_H
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <strings.h>
 #include "request.h"
+#include "proxy.h"
 #include "logging.h"
 #include "utils.h"
 
@@ -28,6 +29,11 @@ void req_reset(req_t* req) {
   req->clen = -1;
   req->rsize = 0;
   req->alive = true;
+  req->inm[0] = 0;
+  req->ims = -1;
+  req->encodings = 0;
+  req->range[0] = 0;
+  req->if_range[0] = 0;
   hdr_reset(req->hdrs);
   req->phase = REQ_START;
   req->type = REQ_STATIC;
@@ -141,8 +147,8 @@ ssize_t req_parse(req_t* req, buf_t* buf) {
     log_line("[req_parse] Processed uri: %s", req->uri);
 #endif
 
-    // check cgi
-    if (strstartswith(req->uri, "/cgi/"))
+    // check cgi, or proxy
+    if (strstartswith(req->uri, "/cgi/") || px_route(req->uri) >= 0)
       req->type = REQ_DYNAMIC;
 
     // separate uri and params
@@ -227,10 +233,39 @@ ssize_t req_parse(req_t* req, buf_t* buf) {
           return -400;  // malformed header
         }
 
+      } else if (!strcasecmp(key, "Transfer-Encoding")) {
+        // no chunked body is taken; it'd be read as the next request
+        req->alive = false;
+        req->phase = REQ_ABORT;
+        return -501;
+
       } else if (!strcasecmp(key, "Connection")) {
         if (!strcasecmp(val, "close")) {
           req->alive = false;
         }
+        // proxy drops the fields it names
+        hdr_insert(req->hdrs, hdr_new(key, val));
+
+      } else if (!strcasecmp(key, "If-None-Match")) {
+        strncpy0(req->inm, val, REQ_INMSZ);
+        // CGI may want it as well
+        hdr_insert(req->hdrs, hdr_new(key, val));
+
+      } else if (!strcasecmp(key, "If-Modified-Since")) {
+        req->ims = http_date_parse(val);
+        hdr_insert(req->hdrs, hdr_new(key, val));
+
+      } else if (!strcasecmp(key, "Accept-Encoding")) {
+        req->encodings = req_parse_encodings(val);
+        hdr_insert(req->hdrs, hdr_new(key, val));
+
+      } else if (!strcasecmp(key, "Range")) {
+        strncpy0(req->range, val, REQ_RANGESZ);
+        hdr_insert(req->hdrs, hdr_new(key, val));
+
+      } else if (!strcasecmp(key, "If-Range")) {
+        strncpy0(req->if_range, val, REQ_INMSZ);
+        hdr_insert(req->hdrs, hdr_new(key, val));
 
       } else {
         hdr_insert(req->hdrs, hdr_new(key, val));
@@ -249,7 +284,7 @@ ssize_t req_parse(req_t* req, buf_t* buf) {
   *(char*) buf->data_p = 0;              \
 }
 
-ssize_t req_pack(req_t* req, buf_t* buf) {
+ssize_t req_pack(const req_t* req, buf_t* buf) {
   buf->data_p = buf->data;
   *(char*) buf->data_p = 0;
 
@@ -259,6 +294,10 @@ ssize_t req_pack(req_t* req, buf_t* buf) {
 
   /* pack uri */
   strcpy0(buf->data_p, req->uri);
+  if (req->params) {
+    pack_next('?');
+    strcpy0(buf->data_p, req->params);
+  }
   pack_next(' ');
 
   /* pack version */
@@ -306,3 +345,47 @@ const char* req_method(const req_t* req) {
   }
   return NULL;
 }
+
+int req_parse_encodings(const char* val) {
+
+  char list[HDR_VALSZ+1];
+  strncpy0(list, val, HDR_VALSZ);
+
+  int accepted = 0, rejected = 0;
+  bool any = false;
+
+  char* save = NULL;
+  char* tok;
+  for (tok = strtok_r(list, ",", &save); tok;
+       tok = strtok_r(NULL, ",", &save)) {
+
+    // split coding and qvalue
+    char* q = strchr(tok, ';');
+    bool zero = false;
+    if (q) {
+      *q++ = 0;
+      while (issp(*q))
+        q++;
+      if (!strncasecmp(q, "q=", 2))
+        zero = atof(q+2) <= 0;
+    }
+    strstrip(tok);
+
+    int enc = 0;
+    if (!strcasecmp(tok, "gzip") || !strcasecmp(tok, "x-gzip"))
+      enc = ENC_GZIP;
+    else if (!strcasecmp(tok, "br"))
+      enc = ENC_BR;
+    else if (!strcmp(tok, "*"))
+      any = !zero;
+
+    if (zero)
+      rejected |= enc;
+    else
+      accepted |= enc;
+  }
+
+  if (any)
+    accepted |= ENC_GZIP|ENC_BR;
+  return accepted & ~rejected;
+}
@@ -8,6 +8,7 @@
 #define REQUEST_H
 
 #include <arpa/inet.h>
+#include <time.h>
 #include "buffer.h"
 #include "header.h"
 #include "utils.h"
@@ -16,6 +17,12 @@
 #define REQ_VERSZ 32
 #define REQ_HOSTSZ 256
 #define REQ_CTYPESZ 64
+#define REQ_INMSZ 512
+#define REQ_RANGESZ 512
+
+// Content codings
+#define ENC_GZIP 0x1
+#define ENC_BR   0x2
 
 /**
  * @brief Parsed request header.
@@ -55,6 +62,19 @@ typedef struct {
   ssize_t clen;
   bool alive;
 
+  // Validators for conditional GET
+  // inm is the raw If-None-Match; empty if absent.
+  // ims is the If-Modified-Since; -1 if absent or invalid.
+  char inm[REQ_INMSZ+1];
+  time_t ims;
+
+  // Accepted content codings, in bits of ENC_*
+  int encodings;
+
+  // Range request; empty if absent.
+  char range[REQ_RANGESZ+1];
+  char if_range[REQ_INMSZ+1];
+
   // All other headers
   hdr_t* hdrs;
 
@@ -88,6 +108,8 @@ void req_reset(req_t* req);
 void req_free(req_t* req);
 // method in str
 const char* req_method(const req_t* req);
+// parse Accept-Encoding into bits of ENC_*
+int req_parse_encodings(const char* val);
 
 /**
  * @brief Parse request header from buffer.
@@ -112,6 +134,6 @@ ssize_t req_parse(req_t* req, buf_t* buf);
  *
  * This method assumes req is safe and fits into buf.
  */
-ssize_t req_pack(req_t* req, buf_t* buf);
+ssize_t req_pack(const req_t* req, buf_t* buf);
 
 #endif // REQUEST_H
@@ -11,8 +11,12 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <time.h>
 #include "response.h"
+#include "compress.h"
+#include "mcache.h"
+#include "mime.h"
 #include "utils.h"
 #include "logging.h"
 #include "config.h"
@@ -21,6 +25,10 @@
 
 static const char title200[] = "200 OK";
 
+static const char title206[] = "206 Partial Content";
+
+static const char title304[] = "304 Not Modified";
+
 static const char title400[] = "400 Bad Request";
 static const char msg400[] =
 "<html>" CRLF
@@ -48,6 +56,15 @@ static const char msg411[] =
 "</body>" CRLF
 "</html>" CRLF;
 
+static const char title416[] = "416 Range Not Satisfiable";
+static const char msg416[] =
+"<html>" CRLF
+"<head><title>416 Range Not Satisfiable</title></head>" CRLF
+"<body bgcolor=\"white\">" CRLF
+"<center><h1>416 Range Not Satisfiable</h1></center>" CRLF
+"</body>" CRLF
+"</html>" CRLF;
+
 static const char title500[] = "500 Internal Server Error";
 static const char msg500[] =
 "<html>" CRLF
@@ -66,6 +83,15 @@ static const char msg501[] =
 "</body>" CRLF
 "</html>" CRLF;
 
+static const char title502[] = "502 Bad Gateway";
+static const char msg502[] =
+"<html>" CRLF
+"<head><title>502 Bad Gateway</title></head>" CRLF
+"<body bgcolor=\"white\">" CRLF
+"<center><h1>502 Bad Gateway</h1></center>" CRLF
+"</body>" CRLF
+"</html>" CRLF;
+
 static const char title503[] = "503 Service Unavailable";
 static const char msg503[] =
 "<html>" CRLF
@@ -75,6 +101,15 @@ static const char msg503[] =
 "</body>" CRLF
 "</html>" CRLF;
 
+static const char title504[] = "504 Gateway Timeout";
+static const char msg504[] =
+"<html>" CRLF
+"<head><title>504 Gateway Timeout</title></head>" CRLF
+"<body bgcolor=\"white\">" CRLF
+"<center><h1>504 Gateway Timeout</h1></center>" CRLF
+"</body>" CRLF
+"</html>" CRLF;
+
 /**** Default pages if not specified ****/
 
 static const char* default_pages[] = {
@@ -83,14 +118,34 @@ static const char* default_pages[] = {
 };
 #define n_default_pages (sizeof(default_pages) / sizeof(const char*))
 
-/**** Format of time ****/
-#define DATESZ 64
-static const char* fmt_time = "%a, %d %b %Y %T %Z";
+/**** Precompressed siblings, in order of preference ****/
+
+static const struct {
+  int enc;
+  const char* suffix;
+  const char* coding;
+} siblings[] = {
+  { ENC_BR,   ".br", "br"   },
+  { ENC_GZIP, ".gz", "gzip" },
+};
+#define n_siblings (sizeof(siblings) / sizeof(siblings[0]))
+
+// release the body, mapped or cached
+static void resp_free_body(resp_t* resp) {
+  mmbuf_free(resp->mmbuf);
+  resp->mmbuf = NULL;
+  zc_release(resp->zent);
+  resp->zent = NULL;
+  mc_release(resp->ment);
+  resp->ment = NULL;
+}
 
 resp_t* resp_new() {
   resp_t* resp = malloc(sizeof(resp_t));
   resp->hdrs = hdr_new(NULL, NULL);
   resp->mmbuf = NULL;
+  resp->zent = NULL;
+  resp->ment = NULL;
   resp_reset(resp);
   return resp;
 }
@@ -100,83 +155,278 @@ void resp_reset(resp_t* resp) {
   resp->status = 200;
   resp->clen = 0;
   resp->alive = true;
-  mmbuf_free(resp->mmbuf);
-  resp->mmbuf = NULL;
+  resp->ctype[0] = 0;
+  resp->n_ranges = 0;
+  resp->range_idx = 0;
+  resp->sendfile = false;
+  resp_free_body(resp);
   hdr_reset(resp->hdrs);
 }
 
 void resp_free(resp_t* resp) {
-
   hdr_free(resp->hdrs);
-
-  if (resp->mmbuf)
-    mmbuf_free(resp->mmbuf);
-
+  resp_free_body(resp);
   free(resp);
 }
 
-static void fill_ctype(char* path, char* ctype) {
-
-  if (caseendswith(path, ".html") ||
-      caseendswith(path, ".htm"))
-    strcpy0(ctype, "text/html");
-
-  else if (caseendswith(path, ".css"))
-    strcpy0(ctype, "text/css");
-
-  else if (caseendswith(path, ".js"))
-    strcpy0(ctype, "application/javascript");
-
-  else if (caseendswith(path, "png"))
-    strcpy0(ctype, "image/png");
+// stat the static file.
+// fill in st param that's passed in.
+// return true if it's a regular file.
+static bool resp_stat(const char* path, struct stat* st) {
 
-  else if (caseendswith(path, ".jpg") ||
-           caseendswith(path, ".jpeg"))
-    strcpy0(ctype, "image/jpeg");
+  if (stat(path, st) < 0) {
+#if DEBUG >= 1
+    log_line("[resp_stat] Error in stat path %s", path);
+#endif
+    return false;
+  }
 
-  else if (caseendswith(path, ".gif"))
-    strcpy0(ctype, "image/gif");
+  if (S_ISDIR(st->st_mode)) {
+#if DEBUG >= 1
+    log_line("[resp_stat] Path is dir: %s", path);
+#endif
+    return false;
+  }
 
-  else
-    strcpy0(ctype, "text/plain");
+  return true;
 }
 
 // mmap the static file into response.
-// fill in st param that's passed in.
 // return size of file if success.
 //        -1 if error occurs.
-static ssize_t resp_mmap(resp_t* resp, const char* path,
-                         struct stat* st) {
+static off_t resp_mmap(resp_t* resp, const char* path, off_t sz) {
 
   int fd;
 
-  if (stat(path, st) < 0) {
+  if ((fd = open(path, O_RDONLY, 0)) < 0) {
 #if DEBUG >= 1
-    log_line("[resp_mmap] Error in stat path %s", path);
+    log_line("[resp_mmap] Error in open path %s", path);
 #endif
     return -1;
   }
 
-  if (S_ISDIR(st->st_mode)) {
-#if DEBUG >= 1
-    log_line("[resp_mmap] Path is dir: %s", path);
-#endif
+  // fd is kept open by mmbuf
+  resp->mmbuf = mmbuf_new(fd, sz);
+
+  if (!resp->mmbuf)
     return -1;
+
+  return sz;
+}
+
+#define ETAGSZ 64
+
+// strong etag derived from inode, mtime and size
+static void fill_etag(const struct stat* st, char* etag) {
+  sprintf(etag, "\"%lx-%lx-%lx\"",
+          (unsigned long) st->st_ino,
+          (unsigned long) st->st_mtime,
+          (unsigned long) st->st_size);
+}
+
+// check if etag is listed in If-None-Match.
+// weak comparison is used, as RFC 7232 requires.
+static bool etag_listed(const char* inm, const char* etag) {
+
+  char list[REQ_INMSZ+1];
+  strcpy0(list, inm);
+
+  char* save = NULL;
+  char* tag;
+  for (tag = strtok_r(list, ",", &save); tag;
+       tag = strtok_r(NULL, ",", &save)) {
+    strstrip(tag);
+    if (!strcmp(tag, "*"))
+      return true;
+    if (!strncmp(tag, "W/", 2))
+      tag += 2;
+    if (!strcmp(tag, etag))
+      return true;
   }
+  return false;
+}
 
-  if ((fd = open(path, O_RDONLY, 0)) < 0) {
-#if DEBUG >= 1
-    log_line("[resp_mmap] Error in open path %s", path);
-#endif
+// check if client's copy is still fresh.
+// If-Modified-Since is ignored if If-None-Match presents.
+static bool not_modified(const req_t* req, const struct stat* st,
+                         const char* etag) {
+  if (req->inm[0])
+    return etag_listed(req->inm, etag);
+  if (req->ims >= 0)
+    return st->st_mtime <= req->ims;
+  return false;
+}
+
+// check if ranges can be applied given If-Range.
+// only exact strong validators match.
+static bool if_range_match(const req_t* req, const struct stat* st,
+                           const char* etag) {
+  if (!req->if_range[0])
+    return true;
+  if (req->if_range[0] == '"')
+    return !strcmp(req->if_range, etag);
+  if (!strncmp(req->if_range, "W/", 2))
+    return false;
+  return http_date_parse(req->if_range) == st->st_mtime;
+}
+
+int resp_parse_range(const char* spec, off_t fsz, range_t* ranges) {
+
+  if (strncasecmp(spec, "bytes=", 6))
     return -1;
+
+  char list[REQ_RANGESZ+1];
+  strncpy0(list, spec+6, REQ_RANGESZ);
+
+  int n = 0, total = 0;
+  char* save = NULL;
+  char* tok;
+  for (tok = strtok_r(list, ",", &save); tok;
+       tok = strtok_r(NULL, ",", &save)) {
+
+    strstrip(tok);
+    // empty elements are allowed
+    if (!*tok)
+      continue;
+    // too many ranges might be an attack
+    if (++total > RESP_MAXRANGES)
+      return -1;
+
+    char* first = tok;
+    char* last = strchr(tok, '-');
+    if (!last)
+      return -1;
+    *last++ = 0;
+    strstrip(first);
+    strstrip(last);
+    if (!isnum(first) || !isnum(last) || (!*first && !*last))
+      return -1;
+
+    range_t r;
+    if (!*first) {
+      // suffix range, i.e. the last n bytes
+      off_t suffix = strtoll(last, NULL, 10);
+      if (suffix == 0 || fsz == 0)
+        continue;
+      r.first = max(fsz - suffix, 0);
+      r.last = fsz - 1;
+    } else {
+      r.first = strtoll(first, NULL, 10);
+      r.last = *last ? strtoll(last, NULL, 10) : fsz - 1;
+      if (*last && r.last < r.first)
+        return -1;
+      if (r.first >= fsz)
+        continue;
+      r.last = min(r.last, fsz - 1);
+    }
+    ranges[n++] = r;
   }
 
-  resp->mmbuf = mmbuf_new(fd, st->st_size);
-  if (!resp->mmbuf)
+  if (total == 0)
     return -1;
+  return n;
+}
+
+ssize_t resp_part_hdr(const resp_t* resp, int idx, char* hdr) {
+
+  if (idx >= resp->n_ranges)
+    return sprintf(hdr, "\r\n--%s--\r\n", resp->boundary);
+
+  const range_t* r = &resp->ranges[idx];
+  return sprintf(hdr, "\r\n--%s\r\n"
+                      "Content-Type: %s\r\n"
+                      "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                 resp->boundary, resp->ctype,
+                 (long long) r->first, (long long) r->last,
+                 (long long) resp->mmbuf->sz);
+}
+
+off_t resp_body_rsize(const resp_t* resp) {
+
+  mmbuf_t* mmbuf = resp->mmbuf;
+  if (!mmbuf)
+    return 0;
+
+  off_t end = mmbuf->sz;
+  if (resp->n_ranges)
+    end = resp->ranges[resp->range_idx].last + 1;
+  return end - mmbuf->pos;
+}
+
+// look for a fresh precompressed sibling acceptable to client.
+// st and fpath are updated to the sibling if found.
+// varied is set if any fresh sibling exists.
+// return the content coding; NULL if not found.
+static const char* find_sibling(const req_t* req, const char* path,
+                                struct stat* st, char* fpath,
+                                bool* varied) {
+  struct stat sst;
+  int i;
+
+  *varied = false;
+  for (i = 0; i < n_siblings; i++) {
+    sprintf(fpath, "%s%s", path, siblings[i].suffix);
+
+    // a stale sibling is as good as none
+    if (!resp_stat(fpath, &sst) || sst.st_mtime < st->st_mtime)
+      continue;
+
+    *varied = true;
+    if (req->encodings & siblings[i].enc) {
+      *st = sst;
+      return siblings[i].coding;
+    }
+  }
 
-  close(fd);
-  return st->st_size;
+  strcpy0(fpath, path);
+  return NULL;
+}
+
+// check if a file is worth compressing on the fly
+static bool gzip_worthy(const struct stat* st, const char* ctype,
+                        const conf_t* conf) {
+  return conf->gzip_level > 0 &&
+         st->st_size >= conf->gzip_min_length &&
+         st->st_size <= conf->gzip_max_length &&
+         conf_gzip_type(conf, ctype);
+}
+
+// serve compressed variant of the file from cache.
+// compress and cache it if it's not cached.
+// return true if success.
+static bool resp_zip(resp_t* resp, const char* path,
+                     const struct stat* st, const conf_t* conf) {
+
+  zc_ent_t* ent = zc_lookup(path, st, ENC_GZIP);
+
+  if (!ent) {
+    // compressed in one shot, so map the file as a whole
+    int fd = open(path, O_RDONLY, 0);
+    if (fd < 0)
+      return false;
+    void* raw = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (raw == MAP_FAILED)
+      return false;
+    ent = zc_put(path, st, ENC_GZIP, raw, conf->gzip_level);
+    munmap(raw, st->st_size);
+    if (!ent)
+      return false;
+  }
+
+  // body is in cache, so don't unmap it when done
+  resp->zent = ent;
+  resp->mmbuf = mmbuf_wrap(ent->data, ent->sz);
+  return true;
+}
+
+// find max-age of path; -1 if no policy applies.
+static long find_max_age(const char* path, const conf_t* conf) {
+  int i;
+  for (i = 0; i < conf->n_policies; i++)
+    if (caseendswith(path, conf->policies[i].ext))
+      return conf->policies[i].max_age;
+  return -1;
 }
 
 bool resp_build(resp_t* resp, const req_t* req, const conf_t* conf) {
@@ -188,15 +438,14 @@ bool resp_build(resp_t* resp, const req_t* req, const conf_t* conf) {
 
   // try several paths
   char path[REQ_URISZ*3];
-  strncpy0(path, conf->www, REQ_URISZ);
-  strncat(path, req->uri, REQ_URISZ);
+  snprintf(path, sizeof(path), "%s%s", conf->www, req->uri);
 #if DEBUG >= 1
   log_line("[recv_to_send] path is %s", path);
 #endif
 
-  bool mmapped = resp_mmap(resp, path, &st) >= 0;
+  bool found = resp_stat(path, &st);
 
-  if (!mmapped) {
+  if (!found) {
 
     char* path_p = path + strlen(path);
     if (path_p[-1] != '/')
@@ -208,33 +457,149 @@ bool resp_build(resp_t* resp, const req_t* req, const conf_t* conf) {
 #if DEBUG >= 1
       log_line("[recv_to_send] try path %s", path);
 #endif
-      mmapped = resp_mmap(resp, path, &st) >= 0;
-      if (mmapped)
+      found = resp_stat(path, &st);
+      if (found)
         break;
     }
   }
 
-  if (!mmapped) {
+  if (!found) {
     resp->status = 404;
     return false;
   }
 
-  /**** update header fields ****/
+  strncpy0(resp->ctype, mime_type(path), RESP_CTYPESZ);
+
+  /**** content coding ****/
+  // path is kept for Content-Type; fpath is the file to serve.
+  char fpath[REQ_URISZ*3+8];
+  bool varied;
+  const char* coding = find_sibling(req, path, &st, fpath, &varied);
+
+  // no sibling; compress on the fly if it's worth it.
+  bool zipped = false;
+  if (!coding && gzip_worthy(&st, resp->ctype, conf)) {
+    varied = true;
+    if (req->encodings & ENC_GZIP) {
+      zipped = true;
+      coding = "gzip";
+    }
+  }
+
+  /**** validators ****/
   hdr_t* hdr;
-  resp->clen = st.st_size;
 
-  if (req->method == M_GET || req->method == M_HEAD) {
+  if (varied)
+    hdr_insert(resp->hdrs, hdr_new("Vary", "Accept-Encoding"));
 
-    hdr = hdr_new("Content-Type", "");
-    fill_ctype(path, hdr->val);
+  char etag[ETAGSZ];
+  fill_etag(&st, etag);
+  // compressed variant is a different representation
+  if (zipped)
+    strcpy0(etag + strlen(etag) - 1, "-gz\"");
+  hdr_insert(resp->hdrs, hdr_new("ETag", etag));
+
+  long max_age = find_max_age(path, conf);
+  if (max_age >= 0) {
+    hdr = hdr_new("Cache-Control", "");
+    sprintf(hdr->val, "max-age=%ld", max_age);
     hdr_insert(resp->hdrs, hdr);
+  }
+
+  // client's copy is fresh; don't even open the file.
+  if ((req->method == M_GET || req->method == M_HEAD) &&
+      not_modified(req, &st, etag)) {
+    resp->status = 304;
+    resp->clen = 0;
+    return true;
+  }
+
+  /**** body ****/
+  if (zipped) {
+    if (!resp_zip(resp, fpath, &st, conf)) {
+      resp->status = 500;
+      return false;
+    }
+  } else {
+    if (resp_mmap(resp, fpath, st.st_size) < 0) {
+      resp->status = 404;
+      return false;
+    }
+  }
+  off_t bsz = resp->mmbuf->sz;
+  resp->clen = bsz;
+
+  /**** ranges ****/
+  // only GET can be ranged; a stale If-Range gets the entire body.
+  if (req->method == M_GET && req->range[0] &&
+      if_range_match(req, &st, etag)) {
+
+    int n = resp_parse_range(req->range, bsz, resp->ranges);
+
+    if (n == 0) {
+      resp->status = 416;
+      hdr = hdr_new("Content-Range", "");
+      sprintf(hdr->val, "bytes */%lld", (long long) bsz);
+      hdr_insert(resp->hdrs, hdr);
+      return false;
+    }
+
+    if (n > 0) {
+      resp->status = 206;
+      resp->n_ranges = n;
+    }
+  }
+
+  /**** update header fields ****/
+  if (req->method == M_GET || req->method == M_HEAD) {
+
+    hdr_insert(resp->hdrs, hdr_new("Accept-Ranges", "bytes"));
+
+    if (coding)
+      hdr_insert(resp->hdrs, hdr_new("Content-Encoding", coding));
 
     hdr = hdr_new("Last-Modified", "");
-    strftime(hdr->val, DATESZ, fmt_time, localtime(&st.st_mtime));
+    http_date_fmt(st.st_mtime, hdr->val);
     hdr_insert(resp->hdrs, hdr);
   }
 
-  return st.st_size;
+  if (resp->n_ranges == 1) {
+
+    range_t* r = &resp->ranges[0];
+    resp->clen = r->last - r->first + 1;
+    resp->mmbuf->pos = r->first;
+
+    hdr_insert(resp->hdrs, hdr_new("Content-Type", resp->ctype));
+
+    hdr = hdr_new("Content-Range", "");
+    sprintf(hdr->val, "bytes %lld-%lld/%lld",
+            (long long) r->first, (long long) r->last,
+            (long long) bsz);
+    hdr_insert(resp->hdrs, hdr);
+
+  } else if (resp->n_ranges > 1) {
+
+    sprintf(resp->boundary, "%08lx%08lx", random(), random());
+
+    // sum up part headers, ranges and the closing boundary
+    char part[BUFSZ];
+    int i;
+    resp->clen = 0;
+    for (i = 0; i <= resp->n_ranges; i++) {
+      resp->clen += resp_part_hdr(resp, i, part);
+      if (i < resp->n_ranges)
+        resp->clen += resp->ranges[i].last - resp->ranges[i].first + 1;
+    }
+
+    hdr = hdr_new("Content-Type", "");
+    sprintf(hdr->val, "multipart/byteranges; boundary=%s", resp->boundary);
+    hdr_insert(resp->hdrs, hdr);
+
+  } else if (req->method == M_GET || req->method == M_HEAD) {
+    hdr_insert(resp->hdrs, hdr_new("Content-Type", resp->ctype));
+  }
+
+  return true;
 }
 
 ssize_t resp_hdr(const resp_t* resp, char* hdr) {
@@ -243,10 +608,8 @@ ssize_t resp_hdr(const resp_t* resp, char* hdr) {
   sprintf(hdr_p, "HTTP/1.1 %s\r\n", resp_title(resp->status));
   hdr_p += strlen(hdr_p);
 
-  char date[DATESZ];
-  time_t t = time(NULL);
-  struct tm tm = *localtime(&t);
-  strftime(date, DATESZ, fmt_time, &tm);
+  char date[HTTP_DATESZ];
+  http_date_fmt(time(NULL), date);
 
   sprintf(hdr_p, "Date: %s\r\n", date);
   hdr_p += strlen(hdr_p);
@@ -257,8 +620,11 @@ ssize_t resp_hdr(const resp_t* resp, char* hdr) {
   sprintf(hdr_p, "Connection: %s\r\n", resp->alive ? "keep-alive" : "close");
   hdr_p += strlen(hdr_p);
 
-  sprintf(hdr_p, "Content-Length: %zd\r\n", resp->clen);
-  hdr_p += strlen(hdr_p);
+  // 304 has no body
+  if (resp->status != 304) {
+    sprintf(hdr_p, "Content-Length: %lld\r\n", (long long) resp->clen);
+    hdr_p += strlen(hdr_p);
+  }
 
   hdr_t* h;
   for (h = resp->hdrs->next; h; h = h->next) {
@@ -275,12 +641,17 @@ ssize_t resp_hdr(const resp_t* resp, char* hdr) {
 const char* resp_title(int code) {
   switch (code) {
     case 200: return title200;
+    case 206: return title206;
+    case 304: return title304;
     case 400: return title400;
     case 404: return title404;
     case 411: return title411;
+    case 416: return title416;
     case 500: return title500;
     case 501: return title501;
+    case 502: return title502;
     case 503: return title503;
+    case 504: return title504;
     default:
       log_errln("Status Code(%d) undefined.", code);
       return title500;
@@ -292,9 +663,12 @@ const char* resp_msg(int code) {
     case 400: return msg400;
     case 404: return msg404;
     case 411: return msg411;
+    case 416: return msg416;
     case 500: return msg500;
     case 501: return msg501;
+    case 502: return msg502;
     case 503: return msg503;
+    case 504: return msg504;
     default:
       log_errln("Status Code(%d) undefined.", code);
       return msg500;
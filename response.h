@@ -13,19 +13,48 @@
 #include "utils.h"
 #include "config.h"
 
+#define RESP_CTYPESZ 128
+#define RESP_BOUNDARYSZ 32
+// more ranges than this are ignored
+#define RESP_MAXRANGES 16
+
+// byte range of the file; both ends are inclusive
+typedef struct {
+  off_t first;
+  off_t last;
+} range_t;
+
 typedef struct resp_s {
   enum {
     RESP_READY=1,
+    RESP_BUILDING,  // being built by worker
     RESP_HEADER,
+    RESP_PART,  // part header of multipart/byteranges
     RESP_BODY,
     RESP_ABORT,
     RESP_DISABLED,
   } phase;
   int status;
-  ssize_t clen;
+  off_t clen;
   bool alive;
   hdr_t* hdrs;
-  buf_t* mmbuf;
+  // body; either mapped from file, or from zent if it's compressed.
+  mmbuf_t* mmbuf;
+  struct zc_ent_s* zent;
+  // or from a response cached for CGI
+  struct mc_ent_s* ment;
+  // send body from mmbuf->fd by sendfile, instead of from memory
+  bool sendfile;
+
+  // content type of the file
+  char ctype[RESP_CTYPESZ+1];
+
+  // ranges to serve; 0 means the entire file.
+  // more than 1 range is served as multipart/byteranges.
+  int n_ranges;
+  int range_idx;
+  range_t ranges[RESP_MAXRANGES];
+  char boundary[RESP_BOUNDARYSZ+1];
 } resp_t;
 
 // constructor
@@ -55,6 +84,29 @@ bool resp_build(resp_t* resp, const req_t* req, const conf_t* conf);
  */
 ssize_t resp_hdr(const resp_t* resp, char* hdr);
 
+/**
+ * @brief Serialize part header for multipart/byteranges.
+ * @param resp The response to be built from.
+ * @param idx Index of the range; n_ranges for the closing boundary.
+ * @param hdr The part header to be built.
+ * @return Serialized part header size.
+ */
+ssize_t resp_part_hdr(const resp_t* resp, int idx, char* hdr);
+
+// Remaining body size of the current range.
+off_t resp_body_rsize(const resp_t* resp);
+
+/**
+ * @brief Parse Range header.
+ * @param spec Value of the Range header.
+ * @param fsz Size of the file.
+ * @param ranges The ranges to be filled in.
+ * @return Number of satisfiable ranges; 0 if none is satisfiable.
+ *         -1 if spec is malformed or has too many ranges, and
+ *         should be ignored.
+ */
+int resp_parse_range(const char* spec, off_t fsz, range_t* ranges);
+
 // Returns error title given status code.
 const char* resp_title(int code);
 // Returns error msg given status code.
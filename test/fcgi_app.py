@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""A FastCGI responder for testing lisod's FastCGI client.
+
+Usage: fcgi_app.py <unix:/path|host:port>
+
+  /cgi/env       params as text, with Content-Length
+  /cgi/echo      md5 of stdin, along with a line to stderr
+  /cgi/stream?n  n lines without Content-Length
+  /cgi/status?c  empty response with Status: c
+  /cgi/pid       pid and number of requests on this conn
+
+Conns are kept open between requests if the server asks so.
+"""
+
+import hashlib
+import os
+import socket
+import struct
+import sys
+import threading
+
+BEGIN_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT, STDERR = 1, 3, 4, 5, 6, 7
+KEEP_CONN = 1
+
+
+def recv_all(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def recv_record(sock):
+    hdr = recv_all(sock, 8)
+    if not hdr:
+        return None
+    _, typ, rid, clen, plen, _ = struct.unpack('!BBHHBB', hdr)
+    content = recv_all(sock, clen) if clen else b''
+    if plen:
+        recv_all(sock, plen)
+    return typ, rid, content
+
+
+def send_record(sock, typ, rid, content=b''):
+    # split into records, padded to 8 bytes
+    while True:
+        part, content = content[:65535], content[65535:]
+        pad = -len(part) % 8
+        sock.sendall(struct.pack('!BBHHBB', 1, typ, rid, len(part), pad, 0)
+                     + part + b'\0' * pad)
+        if not content:
+            return
+
+
+def parse_params(data):
+    params = {}
+    i = 0
+    while i < len(data):
+        lens = []
+        for _ in range(2):
+            if data[i] >> 7:
+                lens.append(struct.unpack('!I', data[i:i+4])[0] & 0x7fffffff)
+                i += 4
+            else:
+                lens.append(data[i])
+                i += 1
+        k = data[i:i+lens[0]].decode()
+        i += lens[0]
+        params[k] = data[i:i+lens[1]].decode()
+        i += lens[1]
+    return params
+
+
+def respond(sock, rid, params, stdin, served):
+    path = params.get('PATH_INFO', '')
+    query = params.get('QUERY_STRING', '')
+    if path == '/env':
+        body = ''.join('%s=%s\n' % kv for kv in sorted(params.items()))
+        body = body.encode()
+        out = b'Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n' \
+            % len(body) + body
+    elif path == '/echo':
+        send_record(sock, STDERR, rid, b'echo %d bytes\n' % len(stdin))
+        body = hashlib.md5(stdin).hexdigest().encode()
+        out = b'Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n' \
+            % len(body) + body
+    elif path == '/stream':
+        send_record(sock, STDOUT, rid, b'Content-Type: text/plain\r\n\r\n')
+        for i in range(int(query or 10)):
+            send_record(sock, STDOUT, rid, b'line %d\n' % i)
+        out = b''
+    elif path == '/status':
+        out = b'Status: %s\r\n\r\n' % (query or '204').encode()
+    else:
+        body = b'%d %d\n' % (os.getpid(), served)
+        out = b'Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n' \
+            % len(body) + body
+    if out:
+        send_record(sock, STDOUT, rid, out)
+    send_record(sock, STDOUT, rid)
+    send_record(sock, END_REQUEST, rid, struct.pack('!IB3x', 0, 0))
+
+
+def serve(sock):
+    served = 0
+    try:
+        while True:
+            rec = recv_record(sock)
+            if not rec:
+                return
+            typ, rid, content = rec
+            if typ != BEGIN_REQUEST:
+                continue
+            keep = content[2] & KEEP_CONN
+            params, stdin = b'', b''
+            while True:
+                typ, _, content = recv_record(sock)
+                if typ == PARAMS:
+                    params += content
+                elif typ == STDIN:
+                    if not content:
+                        break
+                    stdin += content
+            served += 1
+            respond(sock, rid, parse_params(params), stdin, served)
+            if not keep:
+                return
+    finally:
+        sock.close()
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write('Usage: %s <unix:/path|host:port>\n' % sys.argv[0])
+        sys.exit(1)
+    addr = sys.argv[1]
+    if addr.startswith('unix:'):
+        if os.path.exists(addr[5:]):
+            os.unlink(addr[5:])
+        lsock = socket.socket(socket.AF_UNIX)
+        lsock.bind(addr[5:])
+    else:
+        host, port = addr.rsplit(':', 1)
+        lsock = socket.socket()
+        lsock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        lsock.bind((host, int(port)))
+    lsock.listen(128)
+    while True:
+        sock, _ = lsock.accept()
+        threading.Thread(target=serve, args=(sock,), daemon=True).start()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""An upstream HTTP/1.1 server for testing lisod's reverse proxy.
+
+Usage: upstream.py <port>
+
+  /len?n       n bytes, with Content-Length
+  /chunked?n   n bytes in chunks of 1000
+  /close?n     n bytes, ended by closing the conn
+  /echo        md5 of the request body
+  /status?c    empty response with status c
+  /conn        port of the conn and number of requests on it
+  /hdrs        request head as received
+
+Body of n bytes is "0123456789" repeated. Conns are kept alive unless
+asked otherwise.
+"""
+
+import hashlib
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+def body_of(n):
+    return (b'0123456789' * (n // 10 + 1))[:n]
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def setup(self):
+        super().setup()
+        self.served = 0
+
+    def log_message(self, *args):
+        pass
+
+    def reply(self, status, body, headers=()):
+        self.send_response(status)
+        for k, v in headers:
+            self.send_header(k, v)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        if self.command != 'HEAD':
+            self.wfile.write(body)
+
+    def do_GET(self):
+        self.served += 1
+        path, _, query = self.path.partition('?')
+        n = int(query) if query.isdigit() else 0
+
+        if path.endswith('/slow'):
+            time.sleep(1)
+            path = path[:-5]
+
+        if path == '/api/len':
+            self.reply(200, body_of(n), [('Content-Type', 'text/plain')])
+
+        elif path == '/api/chunked':
+            self.send_response(200)
+            self.send_header('Transfer-Encoding', 'chunked')
+            self.end_headers()
+            if self.command == 'HEAD':
+                return
+            data = body_of(n)
+            for i in range(0, len(data), 1000):
+                piece = data[i:i+1000]
+                self.wfile.write(b'%x;ext=1\r\n%s\r\n' % (len(piece), piece))
+            self.wfile.write(b'0\r\nX-Trailer: yes\r\n\r\n')
+
+        elif path == '/api/close':
+            self.send_response(200)
+            self.send_header('Connection', 'close')
+            self.end_headers()
+            if self.command != 'HEAD':
+                self.wfile.write(body_of(n))
+            self.close_connection = True
+
+        elif path == '/api/status':
+            self.send_response(int(query or 204))
+            if int(query or 204) != 204:
+                self.send_header('Content-Length', '0')
+            self.end_headers()
+
+        elif path == '/api/conn':
+            body = b'%d %d\n' % (self.client_address[1], self.served)
+            self.reply(200, body)
+
+        elif path == '/api/hdrs':
+            body = ('%s\n%s' % (self.requestline, self.headers)).encode()
+            self.reply(200, body)
+
+        else:
+            self.reply(404, b'not found\n')
+
+    do_HEAD = do_GET
+
+    def do_POST(self):
+        self.served += 1
+        n = int(self.headers.get('Content-Length', 0))
+        md5 = hashlib.md5()
+        while n > 0:
+            data = self.rfile.read(min(n, 65536))
+            if not data:
+                break
+            md5.update(data)
+            n -= len(data)
+        self.reply(200, md5.hexdigest().encode() + b'\n')
+
+
+if __name__ == '__main__':
+    ThreadingHTTPServer(('127.0.0.1', int(sys.argv[1])), Handler) \
+        .serve_forever()
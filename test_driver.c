@@ -7,6 +7,13 @@
 #include <assert.h>
 #include <string.h>
 #include "utils.h"
+#include "response.h"
+#include "mime.h"
+#include "tls.h"
+#include "cgi.h"
+#include "mcache.h"
+#include "cgiq.h"
+#include "lb.h"
 
 
 bool _test_strstrip(char* str, char* tgt) {
@@ -35,10 +42,196 @@ void test_strstartswith() {
   assert(strstartswith("abc", "abc"));
 }
 
+void test_http_date() {
+  char date[HTTP_DATESZ];
+  http_date_fmt(784111777, date);
+  assert(!strcmp(date, "Sun, 06 Nov 1994 08:49:37 GMT"));
+  assert(http_date_parse(date) == 784111777);
+  assert(http_date_parse("Sunday, 06-Nov-94") == -1);
+}
+
+void test_parse_range() {
+  range_t r[RESP_MAXRANGES];
+  assert(resp_parse_range("bytes=0-99", 1000, r) == 1);
+  assert(r[0].first == 0 && r[0].last == 99);
+  assert(resp_parse_range("bytes=-100", 1000, r) == 1);
+  assert(r[0].first == 900 && r[0].last == 999);
+  assert(resp_parse_range("bytes=990-2000, 5-", 1000, r) == 2);
+  assert(r[0].last == 999 && r[1].first == 5 && r[1].last == 999);
+  assert(resp_parse_range("bytes=1000-", 1000, r) == 0);
+  assert(resp_parse_range("bytes=5-1", 1000, r) == -1);
+  assert(resp_parse_range("items=0-1", 1000, r) == -1);
+  assert(resp_parse_range("bytes=x-1", 1000, r) == -1);
+}
+
+void test_parse_encodings() {
+  assert(req_parse_encodings("gzip, deflate, br") == (ENC_GZIP|ENC_BR));
+  assert(req_parse_encodings("gzip;q=0, br;q=0.5") == ENC_BR);
+  assert(req_parse_encodings("*, br;q=0") == ENC_GZIP);
+  assert(req_parse_encodings("identity") == 0);
+}
+
+void test_mime() {
+  mime_init();
+  assert(!strcmp(mime_type("/a/b.PNG"), "image/png"));
+  assert(!strcmp(mime_type("/a.b/c"), MIME_DEFAULT));
+  assert(!strcmp(mime_type("/a/b."), MIME_DEFAULT));
+  assert(mime_add("Liso", "text/x-liso"));
+  assert(!strcmp(mime_type("x.liso"), "text/x-liso"));
+  assert(!mime_add("", "text/x-empty"));
+}
+
+void test_tls_recycle() {
+  conf_t conf;
+  conf_init(&conf);
+  conf.ssl_free_list = 1;
+  SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+  assert(tls_setup(ctx, &conf) > 0);
+  SSL* a = tls_ssl_new(ctx);
+  SSL* b = tls_ssl_new(ctx);
+  tls_ssl_free(a);
+  tls_ssl_free(b);
+  assert(tls_ssl_new(ctx) == a);
+}
+
+void test_cgi_parse_hdr() {
+  cgi_t* cgi = cgi_new();
+  const char* nph = "HTTP/1.1 404 Not Found\r\nA: b\r\n\r\nbody";
+  assert(cgi_parse_hdr(cgi, nph, strlen(nph)) == strlen(nph) - 4);
+  assert(cgi->nph && cgi->status == 404 && !strcmp(cgi->reason, "Not Found"));
+  const char* hdr = "Status: 201 Created\r\nA: b\r\n\r\n";
+  assert(cgi_parse_hdr(cgi, hdr, strlen(hdr)) == strlen(hdr));
+  assert(!cgi->nph && cgi->status == 201 && !hdr_get(cgi->hdrs, "Status"));
+  hdr = "Location: /x\r\n\r\n";
+  assert(cgi_parse_hdr(cgi, hdr, strlen(hdr)) > 0 && cgi->status == 302);
+  hdr = "Status: x\r\n\r\n";
+  assert(cgi_parse_hdr(cgi, hdr, strlen(hdr)) == -1);
+  assert(cgi_parse_hdr(cgi, hdr, 5) == 0);
+  cgi_free(cgi);
+}
+
+void test_mc_cap_hdr() {
+  conf_t conf;
+  conf_init(&conf);
+  strcpy(conf.cgi_cache_vary[conf.n_cgi_cache_vary++], "Accept-Language");
+  hdr_t* hdrs = hdr_new(NULL, NULL);
+  hdr_append(hdrs, hdr_new("Cache-Control", "public, max-age=5, "
+                                            "stale-while-revalidate=9"));
+  hdr_append(hdrs, hdr_new("Vary", "accept-language"));
+  mc_cap_t* cap = mc_cap_new("k", 1, &conf);
+  assert(mc_cap_hdr(cap, 200, hdrs, &conf));
+  assert(cap->ttl == 5 && cap->swr == 9);
+  mc_cap_free(cap);
+  cap = mc_cap_new("k", 1, &conf);
+  assert(!mc_cap_hdr(cap, 404, hdrs, &conf));
+  hdr_append(hdrs, hdr_new("Vary", "Cookie"));
+  assert(!mc_cap_hdr(cap, 200, hdrs, &conf));
+  hdr_reset(hdrs);
+  hdr_append(hdrs, hdr_new("Set-Cookie", "a=b"));
+  assert(!mc_cap_hdr(cap, 200, hdrs, &conf));
+  mc_cap_free(cap);
+  hdr_free(hdrs);
+}
+
+void test_mc_key() {
+  conf_t conf;
+  conf_init(&conf);
+  strcpy(conf.cgi_caches[conf.n_cgi_caches].prefix, "/cgi/");
+  conf.cgi_caches[conf.n_cgi_caches++].ttl = 1;
+  req_t* req = req_new();
+  char key[MC_KEYSZ];
+  req->method = M_GET;
+  strcpy(req->uri, "/cgi/a");
+  assert(mc_key(req, &conf, key) == 1);
+  hdr_append(req->hdrs, hdr_new("Cookie", "id=1"));
+  assert(mc_key(req, &conf, key) == -1);
+  strcpy(conf.cgi_cache_vary[conf.n_cgi_cache_vary++], "cookie");
+  assert(mc_key(req, &conf, key) == 1 && strstr(key, "\nid=1"));
+  req_free(req);
+}
+
+void test_cq_enter() {
+  static conf_t conf;
+  conf_init(&conf);
+  conf.cgi_max = 2;
+  conf.cgi_queue = 2;
+  strcpy(conf.cgi_limits[0].prefix, "/a");
+  conf.cgi_limits[conf.n_cgi_limits++].max = 1;
+  cq_init(&conf);
+  cq_ent_t a1, a2, b1, b2, c;
+  cq_reset(&a1); cq_reset(&a2); cq_reset(&b1); cq_reset(&b2); cq_reset(&c);
+  assert(cq_enter(&a1, "/a/x") && a1.state == CQ_ADMITTED);
+  assert(cq_enter(&a2, "/a/y") && a2.state == CQ_WAITING);
+  // /a is full, but b goes on
+  assert(cq_enter(&b1, "/b") && b1.state == CQ_ADMITTED);
+  assert(cq_enter(&b2, "/b") && b2.state == CQ_WAITING);
+  assert(!cq_enter(&c, "/c"));
+  cq_leave(&a1);
+  assert(cq_pump() == 0);
+  assert(a2.state == CQ_ADMITTED && b2.state == CQ_WAITING);
+  cq_leave(&b2);
+  assert(cq_pump() == -1);
+  cq_leave(&a2);
+  cq_leave(&b1);
+}
+
+void test_sockaddr_parse() {
+  struct sockaddr_storage addr;
+  socklen_t len;
+  assert(sockaddr_parse("127.0.0.1:8081", &addr, &len));
+  assert(addr.ss_family == AF_INET);
+  assert(sockaddr_parse("unix:/tmp/a.sock", &addr, &len));
+  assert(addr.ss_family == AF_UNIX);
+  assert(!sockaddr_parse("127.0.0.1", &addr, &len));
+  assert(!sockaddr_parse("unix:", &addr, &len));
+}
+
+void test_lb_pick() {
+  static conf_t conf;
+  conf_init(&conf);
+  conf.backend_max_fails = 2;
+  conf.backend_slow_start = 0;
+  lb_init(&conf);
+
+  lb_t* lb = lb_new("test");
+  lb_add(lb, "a");
+  lb_add(lb, "b");
+
+  // the least busy one, taking turns on ties
+  assert(lb_pick(lb) == 0);
+  assert(lb_pick(lb) == 1);
+  lb_done(lb, 0, LB_OK, 5);
+  assert(lb_pick(lb) == 0);
+  lb_done(lb, 0, LB_OK, 5);
+  lb_done(lb, 1, LB_OK, 5);
+
+  // b is ejected after failing twice in a row
+  assert(lb_pick(lb) == 1);
+  lb_done(lb, 1, LB_FAIL, -1);
+  assert(lb_pick(lb) == 0);
+  assert(lb_pick(lb) == 1);
+  lb_done(lb, 1, LB_FAIL, -1);
+  assert(lb->be[1].ejected);
+  assert(lb_pick(lb) == 0);
+  assert(lb_pick(lb) == 0);
+  assert(lb->be[0].inflight == 3);
+}
+
 int main() {
   test_strstrip();
   test_isnum();
   test_strstartswith();
+  test_http_date();
+  test_parse_range();
+  test_parse_encodings();
+  test_mime();
+  test_tls_recycle();
+  test_cgi_parse_hdr();
+  test_mc_cap_hdr();
+  test_mc_key();
+  test_cq_enter();
+  test_sockaddr_parse();
+  test_lb_pick();
   printf("[test_driver] Passed!\n");
   return 0;
 }
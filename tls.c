@@ -0,0 +1,464 @@
+/**
+ * @file tls.c
+ * @brief Implementation of tls.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+#include "tls.h"
+#include "logging.h"
+
+// id of cached sessions; sessions are not resumed across servers.
+#define TLS_SID_CTX "liso"
+
+typedef struct {
+  unsigned char name[TLS_KEYNAMESZ];
+  unsigned char aes[TLS_KEYSZ];
+  unsigned char hmac[TLS_KEYSZ];
+  // 0 if the key is unused
+  time_t created;
+} ticket_key_t;
+
+// ring of ticket keys, in memory shared across processes
+typedef struct {
+  pthread_rwlock_t lock;
+  int cur;
+  ticket_key_t keys[TLS_TICKET_KEYS];
+} ticket_keys_t;
+
+static ticket_keys_t* tkeys = NULL;
+static long rotate_interval = 0;
+
+// SSL objects ready for new conns; only touched by the event loop.
+static SSL** free_ssls = NULL;
+static size_t n_free = 0;
+static size_t max_free = 0;
+// SSL objects held by conns, and where they came from
+static size_t n_live = 0;
+static size_t n_created = 0;
+static size_t n_recycled = 0;
+
+// record sizing; small records are off if rec_small is 0.
+static int rec_small = 0;
+static long rec_boost = 0;
+static long rec_idle = 0;
+// bytes sent in small and max records, and how often sizes changed
+static size_t rec_small_bytes = 0;
+static size_t rec_max_bytes = 0;
+static size_t n_boosts = 0;
+static size_t n_shrinks = 0;
+
+// each block allocated by openssl is prefixed by its size.
+// 16 bytes keep the block aligned as malloc does.
+#define TLS_MEMHDR 16
+static bool mem_tracked = false;
+static size_t mem_used = 0;
+
+static const struct {
+  const char* name;
+  int version;
+} versions[] = {
+  { "TLSv1",   TLS1_VERSION   },
+  { "TLSv1.1", TLS1_1_VERSION },
+  { "TLSv1.2", TLS1_2_VERSION },
+  { "TLSv1.3", TLS1_3_VERSION },
+};
+#define n_versions (sizeof(versions) / sizeof(versions[0]))
+
+int tls_parse_version(const char* name) {
+  int i;
+  for (i = 0; i < n_versions; i++)
+    if (!strcasecmp(name, versions[i].name))
+      return versions[i].version;
+  return 0;
+}
+
+/**** memory accounting ****/
+
+// openssl allocates from handshake workers as well
+static void mem_add(size_t n) {
+  __atomic_add_fetch(&mem_used, n, __ATOMIC_RELAXED);
+}
+
+static void mem_sub(size_t n) {
+  __atomic_sub_fetch(&mem_used, n, __ATOMIC_RELAXED);
+}
+
+static void* mem_malloc(size_t n, const char* file, int line) {
+  size_t* p = malloc(n + TLS_MEMHDR);
+  if (!p)
+    return NULL;
+  *p = n;
+  mem_add(n);
+  return (char*) p + TLS_MEMHDR;
+}
+
+static void mem_free(void* ptr, const char* file, int line) {
+  if (!ptr)
+    return;
+  size_t* p = (size_t*) ((char*) ptr - TLS_MEMHDR);
+  mem_sub(*p);
+  free(p);
+}
+
+static void* mem_realloc(void* ptr, size_t n, const char* file, int line) {
+  if (!ptr)
+    return mem_malloc(n, file, line);
+  if (n == 0) {
+    mem_free(ptr, file, line);
+    return NULL;
+  }
+  size_t* p = (size_t*) ((char*) ptr - TLS_MEMHDR);
+  size_t old = *p;
+  if (!(p = realloc(p, n + TLS_MEMHDR)))
+    return NULL;
+  *p = n;
+  mem_sub(old);
+  mem_add(n);
+  return (char*) p + TLS_MEMHDR;
+}
+
+bool tls_track_memory() {
+  mem_tracked = CRYPTO_set_mem_functions(mem_malloc, mem_realloc, mem_free);
+  return mem_tracked;
+}
+
+size_t tls_memory() {
+  return __atomic_load_n(&mem_used, __ATOMIC_RELAXED);
+}
+
+/**** recycling of ssl objects ****/
+
+SSL* tls_ssl_new(SSL_CTX* ctx) {
+
+  SSL* ssl = NULL;
+  while (n_free > 0 && !ssl) {
+    ssl = free_ssls[--n_free];
+    // left from an old context
+    if (SSL_get_SSL_CTX(ssl) != ctx) {
+      SSL_free(ssl);
+      ssl = NULL;
+    }
+  }
+
+  if (ssl) {
+    n_recycled++;
+  } else {
+    if (!(ssl = SSL_new(ctx)))
+      return NULL;
+    n_created++;
+  }
+
+  n_live++;
+  return ssl;
+}
+
+void tls_ssl_free(SSL* ssl) {
+
+  if (!ssl)
+    return;
+  n_live--;
+
+  if (n_free < max_free) {
+    // drop the socket and the session of the old conn; the fd itself
+    // is closed by its owner.
+    SSL_set_bio(ssl, NULL, NULL);
+    if (SSL_set_session(ssl, NULL) && SSL_clear(ssl)) {
+      free_ssls[n_free++] = ssl;
+      return;
+    }
+  }
+
+  SSL_free(ssl);
+}
+
+/**** record sizing ****/
+
+static long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+size_t tls_rec_size(tls_rec_t* rec) {
+
+  if (rec->blocked)
+    return rec->size;
+
+  int size = TLS_MAXRECORD;
+  if (rec_small > 0) {
+    long now = now_ms();
+    // idle conn starts over, as its congestion window shrinks
+    if (rec->size > 0 && now - rec->last > rec_idle)
+      rec->sent = 0;
+    rec->last = now;
+    if (rec->sent < (size_t) rec_boost)
+      size = rec_small;
+  }
+
+  if (rec->size == rec_small && size == TLS_MAXRECORD)
+    n_boosts++;
+  else if (rec->size == TLS_MAXRECORD && size == rec_small)
+    n_shrinks++;
+
+  rec->size = size;
+  return size;
+}
+
+void tls_rec_sent(tls_rec_t* rec, size_t n) {
+  rec->blocked = false;
+  rec->sent += n;
+  if (rec->size < TLS_MAXRECORD)
+    rec_small_bytes += n;
+  else
+    rec_max_bytes += n;
+}
+
+void tls_report() {
+  log_line("[tls_report] %zu conns, %zu idle SSL objects; "
+           "%zu created, %zu recycled.",
+           n_live, n_free, n_created, n_recycled);
+  log_line("[tls_report] %zu bytes in small records, %zu in max records; "
+           "%zu boosts, %zu shrinks.",
+           rec_small_bytes, rec_max_bytes, n_boosts, n_shrinks);
+  if (!mem_tracked) {
+    log_line("[tls_report] OpenSSL heap is not tracked.");
+    return;
+  }
+  // heap includes contexts and cached sessions, shared by all conns.
+  size_t mem = tls_memory();
+  log_line("[tls_report] OpenSSL heap %zu bytes, %zu bytes per conn.",
+           mem, mem / max(n_live, 1));
+}
+
+/**** session tickets ****/
+
+// fill a new key; return false if out of randomness.
+static bool new_key(ticket_key_t* key, time_t now) {
+  if (RAND_bytes(key->name, TLS_KEYNAMESZ) <= 0 ||
+      RAND_bytes(key->aes, TLS_KEYSZ) <= 0 ||
+      RAND_bytes(key->hmac, TLS_KEYSZ) <= 0)
+    return false;
+  key->created = now;
+  return true;
+}
+
+// rotate keys if the current one is too old; write lock must be held.
+static void rotate_keys(time_t now) {
+
+  if (rotate_interval <= 0 ||
+      now - tkeys->keys[tkeys->cur].created < rotate_interval)
+    return;
+
+  int next = (tkeys->cur + 1) % TLS_TICKET_KEYS;
+  if (!new_key(&tkeys->keys[next], now)) {
+    log_errln("[rotate_keys] Failed to generate ticket key.");
+    return;
+  }
+  tkeys->cur = next;
+
+#if DEBUG >= 1
+  log_line("[rotate_keys] Ticket key rotated.");
+#endif
+}
+
+// set hmac key of ticket
+static int init_hmac(EVP_MAC_CTX* hctx, ticket_key_t* key) {
+  OSSL_PARAM params[] = {
+    OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                      key->hmac, TLS_KEYSZ),
+    OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "sha256", 0),
+    OSSL_PARAM_construct_end(),
+  };
+  return EVP_MAC_CTX_set_params(hctx, params);
+}
+
+// encrypt ticket with the current key, or find the key to decrypt it.
+// return 1 if ticket is encrypted, or decrypted by the current key.
+//        2 if it's decrypted by an old key; a new ticket is issued.
+//        0 if the key is gone; full handshake is needed.
+//       -1 if error occurs.
+static int ticket_key_cb(SSL* ssl, unsigned char* name, unsigned char* iv,
+                         EVP_CIPHER_CTX* ctx, EVP_MAC_CTX* hctx, int enc) {
+  int rc = -1;
+
+  if (enc) {
+
+    pthread_rwlock_wrlock(&tkeys->lock);
+    rotate_keys(time(NULL));
+    ticket_key_t* key = &tkeys->keys[tkeys->cur];
+
+    memcpy(name, key->name, TLS_KEYNAMESZ);
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) > 0 &&
+        EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes, iv) &&
+        init_hmac(hctx, key))
+      rc = 1;
+
+    pthread_rwlock_unlock(&tkeys->lock);
+    return rc;
+  }
+
+  pthread_rwlock_rdlock(&tkeys->lock);
+
+  time_t now = time(NULL);
+  int i;
+  rc = 0;
+  for (i = 0; i < TLS_TICKET_KEYS; i++) {
+    ticket_key_t* key = &tkeys->keys[i];
+    if (!key->created || memcmp(name, key->name, TLS_KEYNAMESZ))
+      continue;
+
+    // key should have been rotated out, even if no ticket is issued since
+    long age = now - key->created;
+    if (rotate_interval > 0 && age >= rotate_interval * TLS_TICKET_KEYS)
+      break;
+
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes, iv) &&
+        init_hmac(hctx, key))
+      // renew tickets of keys that are due for rotation
+      rc = i == tkeys->cur &&
+           (rotate_interval <= 0 || age < rotate_interval) ? 1 : 2;
+    else
+      rc = -1;
+    break;
+  }
+
+  pthread_rwlock_unlock(&tkeys->lock);
+  return rc;
+}
+
+/**** certificates ****/
+
+// add an ecdsa pair next to the one loaded already
+// return false if error occurs.
+static bool use_ecdsa_cert(SSL_CTX* ctx, const char* key, const char* crt) {
+
+  if (!SSL_CTX_use_certificate_chain_file(ctx, crt)) {
+    log_errln("[tls_setup] Failed to load certificate %s.", crt);
+    return false;
+  }
+
+  // the certificate goes to the slot of its key type
+  X509* x509 = SSL_CTX_get0_certificate(ctx);
+  if (EVP_PKEY_get_base_id(X509_get0_pubkey(x509)) != EVP_PKEY_EC) {
+    log_errln("[tls_setup] %s is not an ECDSA certificate.", crt);
+    return false;
+  }
+
+  if (!SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) ||
+      !SSL_CTX_check_private_key(ctx)) {
+    log_errln("[tls_setup] Failed to load private key %s.", key);
+    return false;
+  }
+
+  return true;
+}
+
+// create ticket keys in shared memory
+// return false if error occurs.
+static bool init_ticket_keys() {
+
+  tkeys = mmap(NULL, sizeof(ticket_keys_t), PROT_READ|PROT_WRITE,
+               MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (tkeys == MAP_FAILED) {
+    tkeys = NULL;
+    return false;
+  }
+  memset(tkeys, 0, sizeof(ticket_keys_t));
+
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_rwlock_init(&tkeys->lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+
+  return new_key(&tkeys->keys[0], time(NULL));
+}
+
+int tls_setup(SSL_CTX* ctx, const conf_t* conf) {
+
+  if (!SSL_CTX_set_min_proto_version(ctx, conf->ssl_min_version)) {
+    log_errln("[tls_setup] Invalid min version %x.", conf->ssl_min_version);
+    return -1;
+  }
+
+  /**** handshake ****/
+
+  // openssl picks the certificate matching client's signature algorithms
+  if (conf->ssl_ecdsa_crt &&
+      !use_ecdsa_cert(ctx, conf->ssl_ecdsa_key, conf->ssl_ecdsa_crt))
+    return -1;
+
+  if (!SSL_CTX_set_cipher_list(ctx, conf->ssl_ciphers)) {
+    log_errln("[tls_setup] Invalid ciphers %s.", conf->ssl_ciphers);
+    return -1;
+  }
+  if (!SSL_CTX_set1_groups_list(ctx, conf->ssl_groups)) {
+    log_errln("[tls_setup] Invalid groups %s.", conf->ssl_groups);
+    return -1;
+  }
+  if (conf->ssl_prefer_server_ciphers)
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+
+  // a write returns once a record is out, and may be retried from
+  // another address, e.g. after the mmap window moves.
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  // neither side renegotiates, so tls 1.2 writes never wait for reads.
+  SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+  // requests are delimited by length; a client closing without
+  // close_notify is just closed.
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+  rec_small = conf->ssl_record_small;
+  rec_boost = conf->ssl_record_boost;
+  rec_idle = conf->ssl_record_idle;
+
+  // idle conns hand their record buffers back
+  if (conf->ssl_release_buffers)
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+  /**** free-list of ssl objects ****/
+
+  while (n_free > (size_t) conf->ssl_free_list)
+    SSL_free(free_ssls[--n_free]);
+  max_free = conf->ssl_free_list;
+  free_ssls = realloc(free_ssls, max(max_free, 1) * sizeof(SSL*));
+
+  /**** session cache ****/
+
+  if (conf->ssl_session_cache > 0) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, conf->ssl_session_cache);
+    SSL_CTX_set_session_id_context(ctx, (unsigned char*) TLS_SID_CTX,
+                                   strlen(TLS_SID_CTX));
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  }
+  // lifetime of both cached sessions and tickets
+  SSL_CTX_set_timeout(ctx, conf->ssl_session_timeout);
+
+  /**** session tickets ****/
+
+  if (!conf->ssl_session_tickets) {
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    // tls 1.3 resumes from cache by stateful tickets
+    if (conf->ssl_session_cache <= 0)
+      SSL_CTX_set_num_tickets(ctx, 0);
+    return 1;
+  }
+
+  if (!tkeys && !init_ticket_keys()) {
+    log_errln("[tls_setup] Failed to init ticket keys.");
+    return -1;
+  }
+  rotate_interval = conf->ssl_ticket_key_rotate;
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+
+  return 1;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file tls.h
+ * @brief TLS policies of the server.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * Sets up protocol versions, certificates, ciphers and session resumption
+ * on an SSL context. An ECDSA certificate can be served next to the RSA
+ * one, for clients that support it.
+ * Sessions are resumed either from the internal session cache, or from
+ * stateless session tickets. Ticket keys are rotated periodically, and
+ * a few old keys are kept to decrypt tickets issued before rotation.
+ * Keys live in shared memory, so that processes forked after setup
+ * share them as well.
+ *
+ * SSL objects of closed conns are recycled through a free-list, and idle
+ * conns release their record buffers, so that each conn holds little
+ * memory while it waits. Heap used by OpenSSL is tracked for reporting.
+ *
+ * Records start small, so that the first bytes of a response fit in a
+ * few packets and can be decrypted early; once a conn has sent enough,
+ * records grow to the max size for throughput, and shrink again after
+ * the conn goes idle.
+ */
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <openssl/ssl.h>
+#include "config.h"
+
+// number of ticket keys kept, including the current one
+#define TLS_TICKET_KEYS 3
+#define TLS_KEYNAMESZ 16
+#define TLS_KEYSZ 32
+// max size of plaintext in a record
+#define TLS_MAXRECORD 16384
+
+// state of record sizing of a conn
+typedef struct {
+  // bytes sent since records became small
+  size_t sent;
+  // when it last sent, in ms
+  long last;
+  // max size of records now; 0 if not sized yet.
+  int size;
+  // a write is waiting to be retried; size can't change.
+  bool blocked;
+} tls_rec_t;
+
+/**
+ * @brief Apply TLS policies to ctx.
+ * @param ctx The SSL context.
+ * @param conf Global configurations.
+ * @return 1 if normal.
+ *        -1 if error occurs.
+ */
+int tls_setup(SSL_CTX* ctx, const conf_t* conf);
+
+// parse a protocol name like TLSv1.2; return 0 if unknown.
+int tls_parse_version(const char* name);
+
+/**
+ * @brief Track heap allocated by OpenSSL.
+ * @return true if normal.
+ *         false if OpenSSL has allocated before; nothing is tracked.
+ *
+ * Must be called before any other OpenSSL call.
+ */
+bool tls_track_memory();
+
+// bytes of heap held by OpenSSL; 0 if not tracked.
+size_t tls_memory();
+
+// get an SSL object of ctx, recycled from the free-list if possible
+SSL* tls_ssl_new(SSL_CTX* ctx);
+// put ssl back to the free-list, or free it if the list is full
+void tls_ssl_free(SSL* ssl);
+
+/**
+ * @brief Size the next record by what the conn has sent.
+ * @param rec Record sizing of the conn.
+ * @return Max bytes to pass to the next SSL_write.
+ *
+ * A write of no more than the max record goes out as one record, so
+ * capping writes sizes records without touching buffers of ssl.
+ */
+size_t tls_rec_size(tls_rec_t* rec);
+// account n bytes written
+void tls_rec_sent(tls_rec_t* rec, size_t n);
+
+// log memory used by TLS conns, and counters of records
+void tls_report();
+
+#endif // TLS_H
@@ -4,9 +4,15 @@
  * @author Longqi Cai <longqic@andrew.cmu.edu>
  */
 
+#define _GNU_SOURCE  // strptime, timegm
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/un.h>
 #include "utils.h"
 
 void strstrip(char* str) {
@@ -60,3 +66,89 @@ bool caseendswith(const char* str, const char* suffix) {
 bool strstartswith(const char* str, const char* prefix) {
   return !strncmp(str, prefix, strlen(prefix));
 }
+
+// http dates are always in GMT
+static const char* fmt_http_date = "%a, %d %b %Y %T GMT";
+
+size_t http_date_fmt(time_t t, char* date) {
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  return strftime(date, HTTP_DATESZ, fmt_http_date, &tm);
+}
+
+time_t http_date_parse(const char* date) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  char* end = strptime(date, fmt_http_date, &tm);
+  if (!end || *end)
+    return -1;
+  return timegm(&tm);
+}
+
+bool sockaddr_parse(const char* str, struct sockaddr_storage* addr,
+                    socklen_t* len) {
+
+  if (!strncmp(str, "unix:", 5)) {
+    struct sockaddr_un* un = (struct sockaddr_un*) addr;
+    if (!str[5] || strlen(str+5) >= sizeof(un->sun_path))
+      return false;
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, str+5);
+    *len = sizeof(struct sockaddr_un);
+    // abstract socket, named by what follows @
+    if (un->sun_path[0] == '@') {
+      un->sun_path[0] = 0;
+      *len = offsetof(struct sockaddr_un, sun_path) + strlen(str+5);
+    }
+    return true;
+  }
+
+  char host[256];
+  const char* colon = strrchr(str, ':');
+  if (!colon || colon == str || colon - str >= sizeof(host))
+    return false;
+  strncpy0(host, str, colon - str);
+
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, colon+1, &hints, &res))
+    return false;
+  memcpy(addr, res->ai_addr, res->ai_addrlen);
+  *len = res->ai_addrlen;
+  freeaddrinfo(res);
+  return true;
+}
+
+int sock_connect(const struct sockaddr_storage* addr, socklen_t len) {
+  int fd = socket(addr->ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  // a unix socket connects or fails at once; tcp is usually in progress.
+  if (connect(fd, (const struct sockaddr*) addr, len) < 0 &&
+      errno != EINPROGRESS) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+int sock_connected(int fd) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+    return -1;
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  // no error yet, and no peer either while the handshake goes on
+  struct sockaddr_storage peer;
+  len = sizeof(peer);
+  if (getpeername(fd, (struct sockaddr*) &peer, &len) < 0)
+    return errno == ENOTCONN ? 0 : -1;
+  return 1;
+}
@@ -14,6 +14,8 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
 
 #define DEBUG 0
 
@@ -39,4 +41,37 @@ bool caseendswith(const char* str, const char* suffix);
 // check if str starts with prefix
 bool strstartswith(const char* str, const char* prefix);
 
+// size of buffer for http date
+#define HTTP_DATESZ 64
+// format t as http date, e.g. Sun, 06 Nov 1994 08:49:37 GMT
+size_t http_date_fmt(time_t t, char* date);
+// parse http date; return -1 if invalid
+time_t http_date_parse(const char* date);
+
+/**
+ * @brief Resolve address of a backend.
+ * @param str `unix:/path` or `host:port`; `unix:@name` is an abstract
+ *            socket.
+ * @param addr The address resolved.
+ * @param len Its length.
+ * @return true if success.
+ */
+bool sockaddr_parse(const char* str, struct sockaddr_storage* addr,
+                    socklen_t* len);
+
+/**
+ * @brief Connect to a backend without blocking.
+ * @return A non-blocking socket, which may still be connecting.
+ *        -1 if it fails right away.
+ */
+int sock_connect(const struct sockaddr_storage* addr, socklen_t len);
+
+/**
+ * @brief Check how connecting goes, without blocking.
+ * @return 1 if connected.
+ *         0 if still connecting; wait for it to be writable.
+ *        -1 if it failed; errno tells why.
+ */
+int sock_connected(int fd);
+
 #endif // UTILS_H
@@ -0,0 +1,127 @@
+/**
+ * @file worker.c
+ * @brief Implementation of worker.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "worker.h"
+#include "logging.h"
+
+struct wk_pool_s {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // jobs to be done, in FIFO
+  wk_job_t* head;
+  wk_job_t* tail;
+};
+
+// finished jobs of all pools, in FIFO
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static wk_job_t* done_head = NULL;
+static wk_job_t* done_tail = NULL;
+
+static int efd = -1;
+
+// append job to queue
+static void enqueue(wk_job_t** head, wk_job_t** tail, wk_job_t* job) {
+  job->next = NULL;
+  if (*tail)
+    (*tail)->next = job;
+  else
+    *head = job;
+  *tail = job;
+}
+
+static void* wk_loop(void* arg) {
+
+  wk_pool_t* pool = arg;
+
+  while (1) {
+
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->head)
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    wk_job_t* job = pool->head;
+    pool->head = job->next;
+    if (!pool->head)
+      pool->tail = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    job->rc = job->work(job->arg);
+
+    pthread_mutex_lock(&done_mutex);
+    enqueue(&done_head, &done_tail, job);
+    pthread_mutex_unlock(&done_mutex);
+
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) < 0)
+      log_errln("[wk_loop] Failed to signal: %s", strerror(errno));
+  }
+
+  return NULL;
+}
+
+int wk_init() {
+  if ((efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0) {
+    log_errln("[wk_init] eventfd failed: %s", strerror(errno));
+    errno = 0;
+  }
+  return efd;
+}
+
+wk_pool_t* wk_new(int n) {
+
+  if (efd < 0)
+    return NULL;
+
+  wk_pool_t* pool = malloc(sizeof(wk_pool_t));
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->head = pool->tail = NULL;
+
+  int i;
+  for (i = 0; i < min(n, WK_MAXTHREADS); i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, wk_loop, pool)) {
+      log_errln("[wk_new] Failed to create worker %d.", i);
+      // jobs are still done by those created
+      if (i > 0)
+        break;
+      free(pool);
+      return NULL;
+    }
+    pthread_detach(tid);
+  }
+
+  return pool;
+}
+
+void wk_submit(wk_pool_t* pool, wk_job_t* job) {
+  pthread_mutex_lock(&pool->mutex);
+  enqueue(&pool->head, &pool->tail, job);
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+void wk_complete() {
+
+  // clear the counter, so that it's not readable until next job is done
+  uint64_t cnt;
+  if (read(efd, &cnt, sizeof(cnt)) < 0)
+    errno = 0;
+
+  pthread_mutex_lock(&done_mutex);
+  wk_job_t* job = done_head;
+  done_head = done_tail = NULL;
+  pthread_mutex_unlock(&done_mutex);
+
+  while (job) {
+    // job may be reused on completion, so move on first
+    wk_job_t* next = job->next;
+    job->done(job->arg, job->rc);
+    job = next;
+  }
+}
@@ -0,0 +1,69 @@
+/**
+ * @file worker.h
+ * @brief Pools of worker threads for blocking jobs.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * Jobs that may block, e.g. disk I/O or heavy crypto, are run on worker
+ * threads, so as not to stall the event loop. Each kind of job gets a
+ * pool of its own, so that a burst of one kind doesn't hold up others.
+ * Finished jobs of all pools are queued, and signaled through an
+ * eventfd, which is selected by the event loop along with the sockets.
+ * Jobs are collected and completed in the event loop.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "utils.h"
+
+// max number of threads in a pool
+#define WK_MAXTHREADS 64
+
+/**
+ * @brief Work to be done on a worker thread.
+ * @param arg Argument of the job.
+ * @return Result of the job.
+ */
+typedef int (*WorkFn)(void* arg);
+
+/**
+ * @brief Completion of a job, run in the event loop.
+ * @param arg Argument of the job.
+ * @param rc Result of the work.
+ */
+typedef void (*DoneFn)(void* arg, int rc);
+
+typedef struct wk_job_s {
+  WorkFn work;
+  DoneFn done;
+  void* arg;
+  // result of work
+  int rc;
+  struct wk_job_s* next;
+} wk_job_t;
+
+typedef struct wk_pool_s wk_pool_t;
+
+/**
+ * @brief Init the queue of finished jobs.
+ * @return The eventfd that's readable when jobs are finished.
+ *         -1 if error occurs.
+ */
+int wk_init();
+
+/**
+ * @brief Start a pool of worker threads.
+ * @param n Number of threads.
+ * @return The pool; NULL if error occurs.
+ *
+ * Must be called after daemonize, because threads don't survive fork.
+ */
+wk_pool_t* wk_new(int n);
+
+// submit a job; it's owned by worker pool until it's completed.
+void wk_submit(wk_pool_t* pool, wk_job_t* job);
+
+// complete finished jobs, in the order they are finished.
+void wk_complete();
+
+#endif // WORKER_H
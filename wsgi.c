@@ -0,0 +1,152 @@
+/**
+ * @file wsgi.c
+ * @brief Implementation of wsgi.h
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "wsgi.h"
+#include "logging.h"
+
+// helpers accept on it; held here so that it outlives them
+static int lsock = -1;
+static const conf_t* wconf = NULL;
+
+// pid of each helper; 0 if it has died
+static volatile sig_atomic_t pids[WSGI_MAXHELPERS];
+static time_t spawned[WSGI_MAXHELPERS];
+static int n_helpers = 0;
+// some helper has died
+static volatile sig_atomic_t dead = 0;
+
+bool wsgi_init(conf_t* conf) {
+
+  // abstract socket, so nothing is left in file system; it's named
+  // after the port, which is unique already.
+  char addr[64];
+  snprintf(addr, sizeof(addr), "unix:@liso-wsgi-%d", conf->http_port);
+  const char* name = addr + 5;
+  size_t len = strlen(name);
+
+  struct sockaddr_un un;
+  memset(&un, 0, sizeof(un));
+  un.sun_family = AF_UNIX;
+  memcpy(un.sun_path, name, len);
+  un.sun_path[0] = 0;
+
+  lsock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (lsock < 0 ||
+      bind(lsock, (struct sockaddr*) &un,
+           offsetof(struct sockaddr_un, sun_path) + len) < 0 ||
+      listen(lsock, SOMAXCONN) < 0) {
+    fprintf(stderr, "Cannot listen for WSGI helpers: %s\n",
+            strerror(errno));
+    return false;
+  }
+
+  conf->fastcgi = strdup(addr);
+  n_helpers = conf->wsgi_workers;
+  wconf = conf;
+  return true;
+}
+
+// spawn the i-th helper
+static void spawn(int i) {
+
+  int pid = fork();
+  if (pid < 0) {
+    log_errln("[wsgi] cannot fork helper: %s", strerror(errno));
+    return;
+  }
+
+  /**** child ****/
+  if (pid == 0) {
+    // go along with lisod
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    dup2(lsock, STDIN_FILENO);
+
+    // tracebacks of loading the application go to log
+    int fd = open(wconf->log, O_WRONLY|O_APPEND|O_CREAT, 0640);
+    if (fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+    }
+
+    // don't hold sockets of lisod
+    for (fd = getdtablesize(); fd > STDERR_FILENO; fd--)
+      close(fd);
+
+    char* argv[] = {wconf->wsgi_host, wconf->wsgi, NULL};
+    execv(wconf->wsgi_host, argv);
+    // threads of lisod may hold locks of stdio; only write(2) is safe.
+    static const char msg[] = "[wsgi] cannot run wsgi_host\n";
+    write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    // don't flush log buffer of parent
+    _exit(EXIT_FAILURE);
+  }
+
+  /**** parent ****/
+  pids[i] = pid;
+  spawned[i] = time(NULL);
+
+#if DEBUG >= 1
+  log_line("[wsgi] spawned helper %d for %s.", pid, wconf->wsgi);
+#endif
+}
+
+void wsgi_start() {
+  int i;
+  for (i = 0; i < n_helpers; i++)
+    spawn(i);
+}
+
+void wsgi_reaped(int pid) {
+  int i;
+  for (i = 0; i < n_helpers; i++) {
+    if (pids[i] == pid) {
+      pids[i] = 0;
+      dead = 1;
+    }
+  }
+}
+
+bool wsgi_check() {
+
+  if (!dead)
+    return false;
+  dead = 0;
+
+  bool held = false;
+  time_t now = time(NULL);
+  int i;
+  for (i = 0; i < n_helpers; i++) {
+    if (pids[i])
+      continue;
+    // it may fail to load the application over and over
+    if (now - spawned[i] < 1) {
+      held = true;
+      continue;
+    }
+    log_errln("[wsgi] helper %d has died; spawn it again.", i);
+    spawn(i);
+  }
+
+  if (held)
+    dead = 1;
+  return held;
+}
+
+void wsgi_stop() {
+  int i;
+  for (i = 0; i < n_helpers; i++) {
+    if (pids[i] > 0)
+      kill(pids[i], SIGTERM);
+  }
+}
@@ -0,0 +1,49 @@
+/**
+ * @file wsgi.h
+ * @brief Host of a WSGI application in helper processes.
+ * @author Longqi Cai <longqic@andrew.cmu.edu>
+ *
+ * Instead of running a CGI script per request, lisod can host a WSGI
+ * application like flaskr.flaskr:app. It is loaded once by wsgi_host.py
+ * in a few long-lived helper processes, which accept on a listening
+ * socket handed down as their stdin. Requests get there through the
+ * FastCGI client, with the environ built by the CGI module, and output
+ * comes back along the dynamic response path.
+ *
+ * The listening socket is held by lisod, so requests wait in its
+ * backlog while a helper that died is spawned again.
+ */
+
+#ifndef WSGI_H
+#define WSGI_H
+
+#include "config.h"
+
+// max number of helper processes
+#define WSGI_MAXHELPERS 64
+
+/**
+ * @brief Open the listening socket for helpers.
+ * @param conf Configurations; conf->fastcgi is pointed to the socket.
+ * @return true if normal.
+ *         false if the socket cannot be opened.
+ */
+bool wsgi_init(conf_t* conf);
+
+// spawn helpers; they are children of the calling process.
+void wsgi_start();
+
+// note that a child has been reaped; safe in signal handler.
+void wsgi_reaped(int pid);
+
+/**
+ * @brief Spawn helpers again where they have died.
+ * @return true if some are held back, since each is spawned at most
+ *         once a second; check again later.
+ */
+bool wsgi_check();
+
+// terminate helpers
+void wsgi_stop();
+
+#endif // WSGI_H
@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+"""WSGI host of lisod.
+
+Usage: wsgi_host.py <module:callable>
+
+Loads a WSGI application once, e.g. flaskr.flaskr:app, and serves it
+over FastCGI on the listening socket passed as stdin. lisod spawns a
+few of these, and sends each request as records carrying the environ
+it would give a CGI script. Each conn is served by a thread of its own,
+since lisod keeps conns open between requests.
+"""
+
+import importlib
+import io
+import os
+import socket
+import struct
+import sys
+import threading
+import traceback
+
+BEGIN_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT, STDERR = 1, 3, 4, 5, 6, 7
+RESPONDER, KEEP_CONN = 1, 1
+MAXCONTENT = 65535
+
+
+def recv_all(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+
+def recv_record(sock):
+    hdr = recv_all(sock, 8)
+    if not hdr:
+        return None
+    _, typ, rid, clen, plen, _ = struct.unpack('!BBHHBB', hdr)
+    content = recv_all(sock, clen + plen)
+    if content is None:
+        return None
+    return typ, rid, content[:clen]
+
+
+def send_record(sock, typ, rid, content=b''):
+    while True:
+        part, content = content[:MAXCONTENT], content[MAXCONTENT:]
+        sock.sendall(struct.pack('!BBHHBB', 1, typ, rid, len(part), 0, 0)
+                     + part)
+        if not content:
+            return
+
+
+def parse_params(data):
+    params = {}
+    i = 0
+    while i < len(data):
+        lens = []
+        for _ in range(2):
+            if data[i] >> 7:
+                lens.append(struct.unpack('!I', data[i:i+4])[0] & 0x7fffffff)
+                i += 4
+            else:
+                lens.append(data[i])
+                i += 1
+        # WSGI wants native strings, decoded as latin-1
+        k = data[i:i+lens[0]].decode('latin-1')
+        i += lens[0]
+        params[k] = data[i:i+lens[1]].decode('latin-1')
+        i += lens[1]
+    return params
+
+
+class Errors(object):
+    """wsgi.errors, sent back as STDERR records"""
+
+    def __init__(self, sock, rid):
+        self.sock, self.rid = sock, rid
+
+    def write(self, s):
+        if isinstance(s, str):
+            s = s.encode('utf-8', 'replace')
+        if s:
+            send_record(self.sock, STDERR, self.rid, s)
+
+    def writelines(self, lines):
+        for line in lines:
+            self.write(line)
+
+    def flush(self):
+        pass
+
+
+def run(app, sock, rid, environ, stdin):
+    environ.update({
+        'wsgi.version': (1, 0),
+        'wsgi.url_scheme': 'https' if environ.get('HTTPS') == 'on'
+                           else 'http',
+        'wsgi.input': io.BytesIO(stdin),
+        'wsgi.errors': Errors(sock, rid),
+        'wsgi.multithread': True,
+        'wsgi.multiprocess': True,
+        'wsgi.run_once': False,
+    })
+    state = {'status': None, 'headers': None, 'sent': False}
+
+    def write(data):
+        if not state['sent']:
+            # CGI header; lisod turns it into a response header
+            hdr = 'Status: %s\r\n' % state['status']
+            hdr += ''.join('%s: %s\r\n' % kv for kv in state['headers'])
+            send_record(sock, STDOUT, rid, (hdr + '\r\n').encode('latin-1'))
+            state['sent'] = True
+        if data:
+            send_record(sock, STDOUT, rid, data)
+
+    def start_response(status, headers, exc_info=None):
+        if exc_info and state['sent']:
+            raise exc_info[1].with_traceback(exc_info[2])
+        state['status'], state['headers'] = status, headers
+        return write
+
+    try:
+        result = app(environ, start_response)
+        try:
+            for data in result:
+                if data:
+                    write(data)
+            if not state['sent']:
+                write(b'')
+        finally:
+            if hasattr(result, 'close'):
+                result.close()
+    except Exception:
+        environ['wsgi.errors'].write(traceback.format_exc())
+        if not state['sent']:
+            state['status'] = '500 Internal Server Error'
+            state['headers'] = [('Content-Length', '0')]
+            write(b'')
+
+    send_record(sock, STDOUT, rid)
+    send_record(sock, END_REQUEST, rid, struct.pack('!IB3x', 0, 0))
+
+
+def serve(app, sock):
+    try:
+        while True:
+            rec = recv_record(sock)
+            if not rec:
+                return
+            typ, rid, content = rec
+            if typ != BEGIN_REQUEST:
+                continue
+            role = struct.unpack('!H', content[:2])[0]
+            keep = content[2] & KEEP_CONN
+            params, stdin = b'', b''
+            while True:
+                rec = recv_record(sock)
+                if not rec:
+                    return
+                typ, _, content = rec
+                if typ == PARAMS:
+                    params += content
+                elif typ == STDIN:
+                    if not content:
+                        break
+                    stdin += content
+            if role == RESPONDER:
+                run(app, sock, rid, parse_params(params), stdin)
+            else:
+                # unknown role
+                send_record(sock, END_REQUEST, rid,
+                            struct.pack('!IB3x', 0, 3))
+            if not keep:
+                return
+    except (OSError, ValueError):
+        traceback.print_exc()
+    finally:
+        sock.close()
+
+
+def load(spec):
+    # modules are looked up from where lisod runs
+    sys.path.insert(0, os.getcwd())
+    module, _, name = spec.partition(':')
+    app = importlib.import_module(module)
+    for attr in name.split('.'):
+        app = getattr(app, attr)
+    return app
+
+
+def main():
+    if len(sys.argv) != 2 or ':' not in sys.argv[1]:
+        sys.stderr.write('Usage: %s <module:callable>\n' % sys.argv[0])
+        sys.exit(1)
+    app = load(sys.argv[1])
+    lsock = socket.socket(fileno=0)
+    while True:
+        sock, _ = lsock.accept()
+        t = threading.Thread(target=serve, args=(app, sock))
+        t.daemon = True
+        t.start()
+
+
+if __name__ == '__main__':
+    main()